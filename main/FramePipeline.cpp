@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "FramePipeline.hpp"
+
+#include <chrono>
+
+static inline double elapsedMs(const std::chrono::steady_clock::time_point &start)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+FramePipeline::FramePipeline(
+    spf::fusion::Fusion &fusion, IDataStreamer &dataStreamer, const IntrinsicsType &intrinsics,
+    const size_t width, const size_t height, const float minDist, const float maxDist,
+    const bool useOPC, const bool updateMesh) :
+    fusion_(fusion),
+    dataStreamer_(dataStreamer),
+    intrinsics_(intrinsics),
+    minDist_(minDist),
+    maxDist_(maxDist),
+    useOPC_(useOPC),
+    updateMesh_(updateMesh)
+{
+  for(size_t i = 0; i < poolSize_; i++)
+  {
+    framePool_.emplace_back(new Frame(width, height));
+    freeFrames_.Push(framePool_.back().get());
+  }
+}
+
+FramePipeline::~FramePipeline()
+{
+  Stop();
+  Wait();
+}
+
+void FramePipeline::Start()
+{
+  running_ = true;
+  threads_.emplace_back(&FramePipeline::DecodeLoop, this);
+  threads_.emplace_back(&FramePipeline::FilterLoop, this);
+  threads_.emplace_back(&FramePipeline::IntegrateLoop, this);
+  if(updateMesh_)
+  {
+    threads_.emplace_back(&FramePipeline::MeshLoop, this);
+  }
+}
+
+void FramePipeline::Wait()
+{
+  if(threads_.empty())
+  {
+    return;
+  }
+
+  for(auto &thread : threads_)
+  {
+    thread.join();
+  }
+  threads_.clear();
+
+  utils::Log::Info("Pipeline", "Processed %lu frames\n", numFrames_);
+  utils::Log::Info(
+      "Pipeline",
+      "Time per stage : decode %f ms (and %f ms waiting for free frames), filter %f ms, "
+      "integrate %f ms, mesh %f ms\n",
+      decodeTime_ - decodeWaitTime_, decodeWaitTime_, filterTime_, integrateTime_, meshTime_);
+}
+
+void FramePipeline::PushFrame(
+    const uint16_t *depth, const uint8_t *color, const spf::Mat4f &transform, const size_t w,
+    const size_t h)
+{
+  // The pool frames are allocated once with the camera dimensions
+  const auto &poolFrame = framePool_.front()->rgbd;
+  if(w != poolFrame.Width() || h != poolFrame.Height())
+  {
+    utils::Log::Error(
+        "Pipeline", "Dropping a %lux%lu frame, the pipeline expects %lux%lu frames\n", w, h,
+        poolFrame.Width(), poolFrame.Height());
+    return;
+  }
+
+  // Waiting for the next stages is not decoding time
+  const auto start = std::chrono::steady_clock::now();
+  Frame *frame = nullptr;
+  const bool popped = freeFrames_.Pop(frame);
+  decodeWaitTime_ += elapsedMs(start);
+  if(!popped)
+  {
+    return;
+  }
+
+  if(color == nullptr)
+  {
+    memset(frame->rgbd.Color(), 127, 3 * w * h * sizeof(uint8_t));
+  }
+  else
+  {
+    memcpy(frame->rgbd.Color(), color, 3 * w * h * sizeof(uint8_t));
+  }
+  memcpy(frame->rgbd.Depth(), depth, w * h * sizeof(uint16_t));
+  frame->transform = transform;
+
+  // The queue holds the whole pool, this never waits
+  decodedFrames_.Push(frame);
+}
+
+void FramePipeline::DecodeLoop()
+{
+  auto start = std::chrono::steady_clock::now();
+  while(!stopRequested_ && dataStreamer_.StreamNextData())
+  {
+    decodeTime_ += elapsedMs(start);
+    start = std::chrono::steady_clock::now();
+  }
+  decodeTime_ += elapsedMs(start);
+  decodedFrames_.Close();
+}
+
+void FramePipeline::FilterLoop()
+{
+  Frame *frame = nullptr;
+  while(decodedFrames_.Pop(frame))
+  {
+    const auto start = std::chrono::steady_clock::now();
+    frame->rgbd.FilterData();
+    filterTime_ += elapsedMs(start);
+
+    filteredFrames_.Push(frame);
+  }
+  filteredFrames_.Close();
+}
+
+void FramePipeline::IntegrateLoop()
+{
+  Frame *frame = nullptr;
+  while(filteredFrames_.Pop(frame))
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if(useOPC_)
+    {
+      fusion_.IntegrateDepthMapOrdered(
+          frame->rgbd, intrinsics_, frame->transform, minDist_, maxDist_);
+    }
+    else
+    {
+      fusion_.IntegrateDepthMap(frame->rgbd, intrinsics_, frame->transform, minDist_, maxDist_);
+    }
+
+    if(updateMesh_)
+    {
+      frame->updatedBlocks = fusion_.GetUpdatedBlocks();
+    }
+    integrateTime_ += elapsedMs(start);
+    numFrames_++;
+
+    if(updateMesh_)
+    {
+      integratedFrames_.Push(frame);
+    }
+    else
+    {
+      freeFrames_.Push(frame);
+    }
+  }
+  integratedFrames_.Close();
+
+  if(!updateMesh_)
+  {
+    running_ = false;
+  }
+}
+
+void FramePipeline::MeshLoop()
+{
+  Frame *frame = nullptr;
+  while(integratedFrames_.Pop(frame))
+  {
+    const auto start = std::chrono::steady_clock::now();
+    fusion_.UpdateMeshes(frame->updatedBlocks);
+    meshTime_ += elapsedMs(start);
+
+    freeFrames_.Push(frame);
+  }
+  running_ = false;
+}
@@ -20,34 +20,52 @@
 using namespace spf::fusion;
 
 SliceRenderer::SliceRenderer(const size_t w, const size_t h, spf::fusion::Volume &volume) :
-    height_(h), width_(w), volume_(volume), tsdfImg_(new Color3u[w * h])
+    width_(w), height_(h), voxelRes_(volume.VoxelRes()), volume_(volume),
+    tsdfImg_(new Color3u[w * h])
 {}
 
 void SliceRenderer::Render(const Vec3 &center, const Vec3 & /*axis*/)
 {
+  static constexpr int blockSize = BlockProperties<float>::blockSize;
+
   const auto centerBlockId = GetId(center, voxelRes_);
   const auto centerVoxId = GetVoxelId(center, voxelRes_);
   const auto centerPos = GetVoxelAbsolutePos(centerBlockId, centerVoxId);
 
-#pragma omp parallel for
-  for(size_t v = 0; v < height_; v++)
+#pragma omp parallel
   {
-    for(size_t u = 0; u < width_; u++)
-    {
-      const auto absVoxelPos = centerPos - spf::fusion::Index3d(u - width_ / 2, v - height_ / 2, 0);
-      const auto blockId = Div(absVoxelPos, spf::fusion::BLOCK_SIZE);
-      const auto voxelId = Mod(absVoxelPos, spf::fusion::BLOCK_SIZE);
+    BlockCache blockCache(volume_);
 
-      const auto *block = volume_.GetBlock(blockId);
-      if(block != nullptr)
+#pragma omp for
+    for(size_t v = 0; v < height_; v++)
+    {
+      // Only the first block of a row is looked up, the next ones are reached through the links
+      // of the previous block
+      const VoxelBlock *block = nullptr;
+      BlockId currentId(std::numeric_limits<int>::max());
+      for(size_t u = 0; u < width_; u++)
       {
-        const auto tsdf = block->TSDFAt(voxelId);
-        const auto pxValue = ColorTSDF(tsdf);
-        const size_t index = v * width_ + u;
-        tsdfImg_[index].r = uint8_t(255.0f * pxValue.x);
-        tsdfImg_[index].g = uint8_t(255.0f * pxValue.y);
-        tsdfImg_[index].b = uint8_t(255.0f * pxValue.z);
+        const auto absVoxelPos =
+            centerPos - spf::fusion::Index3d(u - width_ / 2, v - height_ / 2, 0);
+        const auto blockId = Div(absVoxelPos, blockSize);
+        const auto voxelId = Mod(absVoxelPos, blockSize);
+
+        if(!(blockId == currentId))
+        {
+          block = block != nullptr ? block->Neighbour(blockId - currentId)
+                                   : blockCache.GetBlock(blockId);
+          currentId = blockId;
+        }
+        if(block != nullptr)
+        {
+          const auto tsdf = block->TSDFAt(voxelId);
+          const auto pxValue = ColorTSDF(tsdf);
+          const size_t index = v * width_ + u;
+          tsdfImg_[index].r = uint8_t(255.0f * pxValue.x);
+          tsdfImg_[index].g = uint8_t(255.0f * pxValue.y);
+          tsdfImg_[index].b = uint8_t(255.0f * pxValue.z);
+        }
       }
     }
-  }
+  } // omp parallel
 }
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <utility>
+#include <gflags/gflags.h>
+
+#include "spf/fusion/Fusion.hpp"
+
+#include "BenchDataset.hpp"
+
+DEFINE_string(datasetType, "fr1", "Type of dataset to use : [fr1, icl1, synthetic0]");
+DEFINE_string(dataset, "", "Dataset path");
+DEFINE_uint64(maxFrames, 200, "Number of frames to integrate (0 : all)");
+DEFINE_double(voxelRes, 0.01, "Voxel resolution in meters");
+DEFINE_double(tau, 0.025, "Truncation distance");
+DEFINE_double(maxDist, 2.0, "Max integration distance");
+DEFINE_double(minDist, 0.0, "Minimum integration distance");
+
+using namespace spf::fusion;
+
+// Time per frame and blocks allocated by the block traversals on the same frames, each one in its
+// own volume. Blocks that never receive a sample are counted by removing them at the end.
+int main(int argc, char **argv)
+{
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage("Block traversal benchmark");
+
+  const BenchDataset dataset = loadBenchDataset(FLAGS_datasetType, FLAGS_dataset, FLAGS_maxFrames);
+
+  const std::pair<BlockTraversal, const char *> traversals[] = {
+      {BlockTraversal::Bresenham, "bresenham"}, {BlockTraversal::DDA, "dda"}};
+
+  for(const auto &traversal : traversals)
+  {
+    Fusion fusion(
+        static_cast<float>(FLAGS_voxelRes), static_cast<float>(FLAGS_tau),
+        dataset.params.cameraWidth, dataset.params.cameraHeight);
+    fusion.SetBlockTraversal(traversal.first);
+    const double t = integrateBenchDataset(
+        fusion, dataset, static_cast<float>(FLAGS_minDist), static_cast<float>(FLAGS_maxDist));
+    const size_t numBlocks = fusion.NumBlocks();
+    const size_t numEmpty = fusion.CollectEmptyBlocks();
+    fprintf(
+        stdout, "%-10s : %8.3f ms / frame, %lu blocks allocated, %lu without samples\n",
+        traversal.second, t, numBlocks, numEmpty);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <utility>
+#include <gflags/gflags.h>
+
+#include "spf/fusion/Fusion.hpp"
+
+#include "BenchDataset.hpp"
+
+DEFINE_string(datasetType, "fr1", "Type of dataset to use : [fr1, icl1, synthetic0]");
+DEFINE_string(dataset, "", "Dataset path");
+DEFINE_uint64(maxFrames, 200, "Number of frames to integrate (0 : all)");
+DEFINE_double(voxelRes, 0.01, "Voxel resolution in meters");
+DEFINE_double(tau, 0.025, "Truncation distance");
+DEFINE_double(maxDist, 2.0, "Max integration distance");
+DEFINE_double(minDist, 0.0, "Minimum integration distance");
+
+using namespace spf::fusion;
+
+// Time per frame of the integration modes on the same frames, each one in its own volume
+int main(int argc, char **argv)
+{
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage("Integration modes benchmark");
+
+  const BenchDataset dataset = loadBenchDataset(FLAGS_datasetType, FLAGS_dataset, FLAGS_maxFrames);
+
+  const std::pair<IntegrationMode, const char *> modes[] = {
+      {IntegrationMode::RayMarching, "raymarching"},
+      {IntegrationMode::BlockBucketed, "bucketed"},
+      {IntegrationMode::Projective, "projective"}};
+
+  for(const auto &mode : modes)
+  {
+    Fusion fusion(
+        static_cast<float>(FLAGS_voxelRes), static_cast<float>(FLAGS_tau),
+        dataset.params.cameraWidth, dataset.params.cameraHeight);
+    fusion.SetIntegrationMode(mode.first);
+    const double t = integrateBenchDataset(
+        fusion, dataset, static_cast<float>(FLAGS_minDist), static_cast<float>(FLAGS_maxDist));
+    fprintf(stdout, "%-12s : %8.3f ms / frame, %lu blocks\n", mode.second, t, fusion.NumBlocks());
+  }
+
+  return EXIT_SUCCESS;
+}
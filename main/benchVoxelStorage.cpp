@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <gflags/gflags.h>
+
+#include "spf/fusion/Fusion.hpp"
+
+#include "BenchDataset.hpp"
+
+DEFINE_string(datasetType, "fr1", "Type of dataset to use : [fr1, icl1, synthetic0]");
+DEFINE_string(dataset, "", "Dataset path");
+DEFINE_uint64(maxFrames, 200, "Number of frames to integrate (0 : all)");
+DEFINE_double(voxelRes, 0.01, "Voxel resolution in meters");
+DEFINE_double(tau, 0.025, "Truncation distance");
+DEFINE_double(maxDist, 2.0, "Max integration distance");
+DEFINE_double(minDist, 0.0, "Minimum integration distance");
+
+using namespace spf::fusion;
+
+// Voxel memory and time per frame of the float and compact storages on the same frames, then the
+// error of the compact voxels against the float ones, over the voxels observed by both volumes.
+int main(int argc, char **argv)
+{
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  gflags::SetUsageMessage("Voxel storage benchmark");
+
+  const BenchDataset dataset = loadBenchDataset(FLAGS_datasetType, FLAGS_dataset, FLAGS_maxFrames);
+
+  const std::pair<VoxelStorage, const char *> storages[] = {
+      {VoxelStorage::Float, "float"}, {VoxelStorage::Compact, "compact"}};
+
+  std::vector<std::unique_ptr<Fusion>> fusions;
+  for(const auto &storage : storages)
+  {
+    fusions.emplace_back(new Fusion(
+        static_cast<float>(FLAGS_voxelRes), static_cast<float>(FLAGS_tau),
+        dataset.params.cameraWidth, dataset.params.cameraHeight));
+    Fusion &fusion = *fusions.back();
+    fusion.SetVoxelStorage(storage.first);
+    const double t = integrateBenchDataset(
+        fusion, dataset, static_cast<float>(FLAGS_minDist), static_cast<float>(FLAGS_maxDist));
+    fprintf(
+        stdout, "%-8s : %8.3f ms / frame, %lu blocks, %8.2f MB (%lu bytes per block)\n",
+        storage.second, t, fusion.NumBlocks(), double(fusion.VoxelMemory()) / (1024.0 * 1024.0),
+        VoxelBlock::VoxelBytes(storage.first, true));
+  }
+
+  Volume &reference = fusions[0]->GetVolume();
+  Volume &compact = fusions[1]->GetVolume();
+  size_t numVoxels = 0;
+  double sumTsdfErr = 0.0;
+  double maxTsdfErr = 0.0;
+  double sumWeightErr = 0.0;
+  size_t numSignChanges = 0;
+  for(const auto &blockId : reference.GetAllIds())
+  {
+    const VoxelBlock *refBlock = reference.GetBlock(blockId);
+    const VoxelBlock *compactBlock = compact.GetBlock(blockId);
+    if(compactBlock == nullptr)
+    {
+      continue;
+    }
+    for(int k = 0; k < int(VoxelBlock::BlockSize()); k++)
+    {
+      for(int j = 0; j < int(VoxelBlock::BlockSize()); j++)
+      {
+        for(int i = 0; i < int(VoxelBlock::BlockSize()); i++)
+        {
+          const Index3d index(i, j, k);
+          const float weight = refBlock->WeightAt(index);
+          if(weight <= 0.0f || compactBlock->WeightAt(index) <= 0.0f)
+          {
+            continue;
+          }
+          const float tsdf = refBlock->TSDFAt(index);
+          const float compactTsdf = compactBlock->TSDFAt(index);
+          const double tsdfErr = fabs(double(compactTsdf) - double(tsdf));
+          sumTsdfErr += tsdfErr;
+          maxTsdfErr = std::max(maxTsdfErr, tsdfErr);
+          sumWeightErr += fabs(double(compactBlock->WeightAt(index)) - double(weight)) / weight;
+          numSignChanges += (tsdf < 0.0f) != (compactTsdf < 0.0f) ? 1 : 0;
+          numVoxels++;
+        }
+      }
+    }
+  }
+
+  if(numVoxels > 0)
+  {
+    fprintf(
+        stdout,
+        "compact error over %lu voxels : tsdf mean %.3f mm, max %.3f mm, weight mean %.3f%%, "
+        "%lu sign changes\n",
+        numVoxels, 1000.0 * sumTsdfErr / double(numVoxels), 1000.0 * maxTsdfErr,
+        100.0 * sumWeightErr / double(numVoxels), numSignChanges);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+#include "spf/fusion/WeightTable.hpp"
+
+#define NUM_SAMPLES (1 << 24)
+#define NUM_RUNS 10
+#define TAU 0.025f
+#define TABLE_SIZE 1024
+
+using namespace spf::fusion;
+
+// Weights are evaluated one sample at a time in the integration loops (each sample also needs a
+// block lookup), so vectorization is disabled to measure the same scalar code path.
+template <typename F>
+__attribute__((optimize("no-tree-vectorize"))) static double benchmark(
+    const std::vector<float> &samples, F &&weight, float &checksum)
+{
+  double best = 0.0;
+  for(size_t run = 0; run < NUM_RUNS; run++)
+  {
+    float sum = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < samples.size(); i++)
+    {
+      sum += weight(samples[i]);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    const double t = std::chrono::duration<double, std::milli>(stop - start).count();
+    best = run == 0 ? t : std::min(best, t);
+    checksum = sum;
+  }
+  return best;
+}
+
+int main()
+{
+  const WeightTable table(TAU, 2.0f * TAU, TABLE_SIZE);
+
+  std::vector<float> samples(NUM_SAMPLES);
+  srand(0);
+  for(size_t i = 0; i < samples.size(); i++)
+  {
+    samples[i] = TAU * (2.0f * float(rand()) / float(RAND_MAX) - 1.0f);
+  }
+
+  float maxErrInterpolated = 0.0f;
+  float maxErrNearest = 0.0f;
+  for(size_t i = 0; i < samples.size(); i++)
+  {
+    const float ref = table.Exact(samples[i]);
+    maxErrInterpolated = std::max(maxErrInterpolated, fabsf(table.Interpolated(samples[i]) - ref));
+    maxErrNearest = std::max(maxErrNearest, fabsf(table.Nearest(samples[i]) - ref));
+  }
+
+  float checksum;
+  const double tExact =
+      benchmark(samples, [&table](const float d) { return table.Exact(d); }, checksum);
+  fprintf(stdout, "expf         : %8.3f ms (checksum %f)\n", tExact, checksum);
+  const double tInterpolated =
+      benchmark(samples, [&table](const float d) { return table.Interpolated(d); }, checksum);
+  fprintf(
+      stdout, "interpolated : %8.3f ms (checksum %f, max rel error %e)\n", tInterpolated, checksum,
+      maxErrInterpolated / table.Coeff());
+  const double tNearest =
+      benchmark(samples, [&table](const float d) { return table.Nearest(d); }, checksum);
+  fprintf(
+      stdout, "nearest      : %8.3f ms (checksum %f, max rel error %e)\n", tNearest, checksum,
+      maxErrNearest / table.Coeff());
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "spf/utils.hpp"
+#include "spf/fusion/Fusion.hpp"
+
+#include "Parameters.hpp"
+#include "DataStreamer.hpp"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Frames of a dataset decoded and filtered before running the benchmarks, so that only the
+// fusion is timed. All the benchmarks of a program integrate the same frames.
+struct BenchDataset
+{
+  std::string datasetType;
+  CameraParameters params;
+  std::vector<spf::fusion::Fusion::FrameType> frames;
+  std::vector<spf::Mat4f> transforms;
+  size_t maxFrames = 0;
+};
+
+// Dataset filled by the streamer callback, which has no user pointer
+static BenchDataset *benchDataset_ = nullptr;
+
+static void onBenchFrame(
+    const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
+    const size_t w, const size_t h)
+{
+  BenchDataset &dataset = *benchDataset_;
+  if(dataset.maxFrames > 0 && dataset.frames.size() >= dataset.maxFrames)
+  {
+    return;
+  }
+  if(w != dataset.params.cameraWidth || h != dataset.params.cameraHeight)
+  {
+    utils::Log::Error("Bench", "Skipping a %lux%lu frame\n", w, h);
+    return;
+  }
+
+  spf::fusion::Fusion::FrameType frame(w, h);
+  memcpy(frame.Depth(), depth, w * h * sizeof(uint16_t));
+  if(color == nullptr)
+  {
+    memset(frame.Color(), 127, 3 * w * h * sizeof(uint8_t));
+  }
+  else
+  {
+    memcpy(frame.Color(), color, 3 * w * h * sizeof(uint8_t));
+  }
+  frame.FilterData();
+  dataset.frames.push_back(std::move(frame));
+
+  // Same poses as the main program
+  const spf::Mat4f &axisPermut = dataset.params.AXIS_PERMUT;
+  if(dataset.datasetType == "synthetic0")
+  {
+    dataset.transforms.push_back(
+        spf::Mat4f::Inverse(spf::Mat4f::Affine(rotation, translation)) * axisPermut);
+  }
+  else
+  {
+    dataset.transforms.push_back(axisPermut * spf::Mat4f::Affine(rotation, translation));
+  }
+}
+
+// Reads the first maxFrames frames of a dataset, all of them if maxFrames is 0
+static BenchDataset loadBenchDataset(
+    const std::string &datasetType, const std::string &datasetDir, const size_t maxFrames)
+{
+  BenchDataset dataset;
+  dataset.datasetType = datasetType;
+  dataset.params = getParams(datasetType);
+  dataset.maxFrames = maxFrames;
+
+  std::unique_ptr<IDataStreamer> streamer;
+  if(datasetType == "synthetic0")
+  {
+    streamer.reset(new SyntheticDataStreamer(datasetDir.c_str()));
+  }
+  else
+  {
+    streamer.reset(new DataStreamer(datasetDir.c_str()));
+  }
+
+  benchDataset_ = &dataset;
+  streamer->RegisterRGBDFrameCallback(onBenchFrame);
+  streamer->PrepareStreamingData();
+  while(streamer->StreamNextData() && (maxFrames == 0 || dataset.frames.size() < maxFrames)) {}
+  benchDataset_ = nullptr;
+
+  utils::Log::Info("Bench", "Loaded %lu frames\n", dataset.frames.size());
+  return dataset;
+}
+
+// Integrates all the frames of the dataset one by one and returns the mean time per frame in ms
+static double integrateBenchDataset(
+    spf::fusion::Fusion &fusion, const BenchDataset &dataset, const float near, const float far)
+{
+  double total = 0.0;
+  for(size_t i = 0; i < dataset.frames.size(); i++)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    fusion.IntegrateDepthMap(
+        dataset.frames[i], dataset.params.depthIntrinsics, dataset.transforms[i], near, far);
+    const auto stop = std::chrono::steady_clock::now();
+    total += std::chrono::duration<double, std::milli>(stop - start).count();
+  }
+  return dataset.frames.empty() ? 0.0 : total / double(dataset.frames.size());
+}
+
+#pragma GCC diagnostic pop
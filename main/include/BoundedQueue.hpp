@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BOUNDED_QUEUE_HPP__
+#define __BOUNDED_QUEUE_HPP__
+
+#include <atomic>
+#include <thread>
+#include <cstddef>
+
+// Lock free ring buffer between one producer thread and one consumer thread. Push and Pop wait
+// (yielding) while the queue is full / empty. Once closed, Pop returns false when the queue has
+// been drained, which is used to shut the pipeline stages down in order.
+template <typename T, size_t N>
+class BoundedQueue
+{
+  static_assert((N & (N - 1)) == 0, "Queue capacity must be a power of 2");
+
+public:
+  BoundedQueue() = default;
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  bool TryPush(const T &value)
+  {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if(tail - head_.load(std::memory_order_acquire) == N)
+    {
+      return false;
+    }
+    data_[tail & (N - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool TryPop(T &value)
+  {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if(tail_.load(std::memory_order_acquire) == head)
+    {
+      return false;
+    }
+    value = data_[head & (N - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  void Push(const T &value)
+  {
+    while(!TryPush(value))
+    {
+      std::this_thread::yield();
+    }
+  }
+
+  bool Pop(T &value)
+  {
+    while(!TryPop(value))
+    {
+      if(closed_.load(std::memory_order_acquire))
+      {
+        // Items pushed before closing must still be delivered
+        return TryPop(value);
+      }
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  void Close() { closed_.store(true, std::memory_order_release); }
+
+  static constexpr size_t Capacity() { return N; }
+
+private:
+  T data_[N];
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::atomic<bool> closed_{false};
+};
+
+#endif // __BOUNDED_QUEUE_HPP__
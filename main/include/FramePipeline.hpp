@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_PIPELINE_HPP__
+#define __FRAME_PIPELINE_HPP__
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "spf/fusion/Fusion.hpp"
+#include "BoundedQueue.hpp"
+#include "DataStreamer.hpp"
+
+// Runs the fusion of a data stream as four stages, each one on its own thread :
+//   decode    : the data streamer reads the next frame and hands it to PushFrame
+//   filter    : RGBDFrame::FilterData
+//   integrate : Fusion::IntegrateDepthMap(Ordered)
+//   mesh      : Fusion::UpdateMeshes on the blocks touched by the frame (optional)
+// Frames come from a fixed pool and travel between stages through bounded lock free queues, so
+// that frame N+1 is decoded and filtered while frame N is integrated. Integration and meshing both
+// access the voxels, they are serialized by Fusion, see Fusion::UpdateMeshes : meshing of frame
+// N-1 overlaps with the decoding and filtering of the next frames.
+class FramePipeline
+{
+public:
+  using FrameType = spf::fusion::Fusion::FrameType;
+  using IntrinsicsType = spf::fusion::Fusion::IntrinsicsType;
+
+  FramePipeline(
+      spf::fusion::Fusion &fusion, IDataStreamer &dataStreamer, const IntrinsicsType &intrinsics,
+      const size_t width, const size_t height, const float minDist, const float maxDist,
+      const bool useOPC, const bool updateMesh);
+
+  ~FramePipeline();
+
+  void Start();
+
+  // Stops decoding new frames, frames already decoded are still integrated
+  void Stop() { stopRequested_ = true; }
+
+  // Waits for all the stages to finish and logs the time spent in each of them
+  void Wait();
+
+  bool Running() const { return running_; }
+
+  // Called from the decode thread, through the data streamer callback. Frames whose dimensions
+  // differ from those given to the constructor are dropped.
+  void PushFrame(
+      const uint16_t *depth, const uint8_t *color, const spf::Mat4f &transform, const size_t w,
+      const size_t h);
+
+private:
+  struct Frame
+  {
+    FrameType rgbd;
+    spf::Mat4f transform;
+    spf::fusion::BlockIdList updatedBlocks;
+
+    Frame(const size_t w, const size_t h) : rgbd(w, h) {}
+  };
+
+  static constexpr size_t poolSize_ = 4;
+  using FrameQueue = BoundedQueue<Frame *, poolSize_>;
+
+  spf::fusion::Fusion &fusion_;
+  IDataStreamer &dataStreamer_;
+  IntrinsicsType intrinsics_;
+  float minDist_;
+  float maxDist_;
+  bool useOPC_;
+  bool updateMesh_;
+
+  std::vector<std::unique_ptr<Frame>> framePool_;
+  FrameQueue freeFrames_;
+  FrameQueue decodedFrames_;
+  FrameQueue filteredFrames_;
+  FrameQueue integratedFrames_;
+
+  std::vector<std::thread> threads_;
+  std::atomic<bool> stopRequested_{false};
+  std::atomic<bool> running_{false};
+
+  size_t numFrames_{0};
+  double decodeTime_{0.0};
+  double decodeWaitTime_{0.0};
+  double filterTime_{0.0};
+  double integrateTime_{0.0};
+  double meshTime_{0.0};
+
+  void DecodeLoop();
+  void FilterLoop();
+  void IntegrateLoop();
+  void MeshLoop();
+};
+
+#endif // __FRAME_PIPELINE_HPP__
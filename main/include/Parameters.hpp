@@ -63,6 +63,9 @@ struct FusionParameters
 {
   float tau;
   float voxelRes;
+  // Blocks of the scene, empty when it is not bounded. Block coordinates are limited to
+  // [-2^20, 2^20) either way, see ValidBlockId.
+  spf::fusion::BlockBounds bounds;
 };
 
 static const CameraParameters FR1_PARAMS = {
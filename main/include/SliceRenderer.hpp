@@ -68,7 +68,7 @@ private:
       ret = Vec3(1.0f);
     }
 
-    if(tsdf == spf::fusion::INVALID_TSDF)
+    if(tsdf == spf::fusion::BlockProperties<float>::invalidTsdf)
     {
       ret = Vec3(0.5f, 0.0f, 0.0f);
     }
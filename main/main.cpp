@@ -42,6 +42,7 @@
 #include "MeshRenderer.hpp"
 #include "DepthMapRenderer.hpp"
 #include "OPCFrameRenderer.hpp"
+#include "FramePipeline.hpp"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -77,6 +78,7 @@ struct Instance
   spf::data_types::CameraIntrinsics<float> intrinsics;
 
   Fusion fusion;
+  std::unique_ptr<FramePipeline> pipeline;
 
   GLFWwindow *mainWindow;
 
@@ -94,7 +96,9 @@ struct Instance
       inputOpc(params.cameraWidth, params.cameraHeight),
       rgbd(params.cameraWidth, params.cameraHeight),
       intrinsics(params.depthIntrinsics),
-      fusion(fusionParams.voxelRes, fusionParams.tau, params.cameraWidth, params.cameraHeight)
+      fusion(
+          fusionParams.voxelRes, fusionParams.tau, params.cameraWidth, params.cameraHeight, 1024,
+          fusionParams.bounds)
   {}
 
   void InitRendering()
@@ -123,6 +127,12 @@ static void onRGBDFrameAvailable(
     const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
     const size_t w, const size_t h);
 
+static void onRGBDFramePipelined(
+    const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
+    const size_t w, const size_t h);
+
+static Mat4 computeTransform(const Vec3 &translation, const Vec4 &rotation);
+
 static void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
 
 static void error_callback(int error, const char *description);
@@ -131,6 +141,8 @@ static void windowResizeCallback(GLFWwindow *window, int w, int h);
 
 static void appMainLoop(void);
 
+static void pipelineMainLoop(void);
+
 // -----------------------------------------------------------------------------
 
 // Parameters
@@ -143,6 +155,21 @@ DEFINE_double(minDist, 0.0, "Minimum integration distance");
 DEFINE_bool(updateMesh, false, "Update mesh after each level");
 DEFINE_bool(useOPC, false, "Use OPC or not for integration");
 DEFINE_bool(useHybrid, false, "Hybrid integration (experimental");
+DEFINE_bool(pipeline, false, "Decode, filter, integrate and mesh frames on separate threads");
+DEFINE_string(
+    integrationMode, "bucketed",
+    "Integration mode : [bucketed, projective, raymarching (legacy, racy)]");
+DEFINE_string(blockTraversal, "dda", "Block allocation traversal : [dda, bresenham]");
+DEFINE_string(raySampling, "half", "Voxel sampling along rays : [half, dda]");
+DEFINE_bool(keyframeGate, false, "Skip or subsample the frames bringing little new information");
+DEFINE_string(weightMode, "exact", "Sample weighting : [exact, interpolated, nearest]");
+DEFINE_string(voxelStorage, "float", "Voxel storage : [float, compact]");
+DEFINE_string(
+    bounds, "", "Scene box \"xmin,ymin,zmin,xmax,ymax,zmax\" in meters, indexed by a dense grid");
+DEFINE_bool(hugePages, false, "Back the voxel memory by transparent huge pages");
+DEFINE_uint64(memoryBudget, 0, "Voxel memory budget in MB, blocks are spilled above it (0 : none)");
+DEFINE_uint64(gcPeriod, 0, "Remove the blocks never observed every N frames (0 : never)");
+DEFINE_string(spillDir, "", "Directory of the spilled blocks (default : <outputDir>/spill)");
 DEFINE_bool(noExport, false, "Export final mesh");
 DEFINE_bool(dumpBlocks, false, "Dump all blocks at the end");
 DEFINE_bool(preload, false, "Preload previously stored blocks");
@@ -161,12 +188,96 @@ int main(int argc, char **argv)
   FusionParameters params;
   params.voxelRes = static_cast<float>(FLAGS_voxelRes);
   params.tau = static_cast<float>(FLAGS_tau);
+  if(!FLAGS_bounds.empty())
+  {
+    spf::Point3f boxMin, boxMax;
+    if(sscanf(
+           FLAGS_bounds.c_str(), "%f,%f,%f,%f,%f,%f", &boxMin.x, &boxMin.y, &boxMin.z, &boxMax.x,
+           &boxMax.y, &boxMax.z)
+       != 6)
+    {
+      throw std::runtime_error("Invalid scene bounds");
+    }
+    params.bounds = spf::fusion::BlockBounds::FromBox(boxMin, boxMax, params.voxelRes);
+  }
 
   const char *datasetType = FLAGS_datasetType.c_str();
   const char *datasetDir = FLAGS_dataset.c_str();
 
   instance_ = new Instance(getParams(datasetType), params, datasetDir);
 
+  if(FLAGS_integrationMode == std::string("raymarching"))
+  {
+    instance_->fusion.SetIntegrationMode(spf::fusion::IntegrationMode::RayMarching);
+  }
+  else if(FLAGS_integrationMode == std::string("projective"))
+  {
+    instance_->fusion.SetIntegrationMode(spf::fusion::IntegrationMode::Projective);
+  }
+  else if(FLAGS_integrationMode != std::string("bucketed"))
+  {
+    throw std::runtime_error("Unknown integration mode");
+  }
+
+  if(FLAGS_blockTraversal == std::string("bresenham"))
+  {
+    instance_->fusion.SetBlockTraversal(spf::fusion::BlockTraversal::Bresenham);
+  }
+  else if(FLAGS_blockTraversal != std::string("dda"))
+  {
+    throw std::runtime_error("Unknown block traversal");
+  }
+
+  if(FLAGS_raySampling == std::string("dda"))
+  {
+    instance_->fusion.SetRaySampling(spf::fusion::RaySampling::VoxelDDA);
+  }
+  else if(FLAGS_raySampling != std::string("half"))
+  {
+    throw std::runtime_error("Unknown ray sampling");
+  }
+
+  if(FLAGS_weightMode == std::string("interpolated"))
+  {
+    instance_->fusion.SetWeightMode(spf::fusion::WeightMode::Interpolated);
+  }
+  else if(FLAGS_weightMode == std::string("nearest"))
+  {
+    instance_->fusion.SetWeightMode(spf::fusion::WeightMode::Nearest);
+  }
+  else if(FLAGS_weightMode != std::string("exact"))
+  {
+    throw std::runtime_error("Unknown weight mode");
+  }
+
+  if(FLAGS_voxelStorage == std::string("compact"))
+  {
+    instance_->fusion.SetVoxelStorage(spf::fusion::VoxelStorage::Compact);
+  }
+  else if(FLAGS_voxelStorage != std::string("float"))
+  {
+    throw std::runtime_error("Unknown voxel storage");
+  }
+
+  instance_->fusion.UseHugePages(FLAGS_hugePages);
+
+  if(FLAGS_memoryBudget > 0)
+  {
+    const std::string spillDir =
+        FLAGS_spillDir.empty() ? FLAGS_outputDir + "/spill" : FLAGS_spillDir;
+    if(!instance_->fusion.SetMemoryBudget(FLAGS_memoryBudget * 1024 * 1024, spillDir))
+    {
+      throw std::runtime_error("Could not open the spill directory");
+    }
+  }
+
+  if(FLAGS_keyframeGate)
+  {
+    instance_->fusion.EnableKeyframeGate();
+  }
+
+  instance_->fusion.SetCollectionPeriod(FLAGS_gcPeriod);
+
   if(std::string(datasetType) == std::string("synthetic0"))
   {
     instance_->dataStreamer = std::unique_ptr<IDataStreamer>(new SyntheticDataStreamer(datasetDir));
@@ -207,7 +318,8 @@ int main(int argc, char **argv)
 
   instance_->InitRendering();
 
-  instance_->dataStreamer->RegisterRGBDFrameCallback(onRGBDFrameAvailable);
+  instance_->dataStreamer->RegisterRGBDFrameCallback(
+      FLAGS_pipeline ? onRGBDFramePipelined : onRGBDFrameAvailable);
   instance_->dataStreamer->PrepareStreamingData();
 
   if(FLAGS_preload)
@@ -216,8 +328,44 @@ int main(int argc, char **argv)
     instance_->fusion.PreloadBlocks(FLAGS_outputDir.c_str());
   }
 
-  appMainLoop();
+  if(FLAGS_pipeline)
+  {
+    instance_->pipeline = std::unique_ptr<FramePipeline>(new FramePipeline(
+        instance_->fusion, *instance_->dataStreamer, instance_->intrinsics,
+        instance_->params.cameraWidth, instance_->params.cameraHeight,
+        static_cast<float>(FLAGS_minDist), static_cast<float>(FLAGS_maxDist), FLAGS_useOPC,
+        FLAGS_updateMesh));
+    pipelineMainLoop();
+    instance_->pipeline.reset();
+  }
+  else
+  {
+    appMainLoop();
+  }
+
+  if(FLAGS_keyframeGate)
+  {
+    const auto &gate = instance_->fusion.GetKeyframeGate();
+    utils::Log::Info(
+        "Main", "Keyframe gate : %lu integrated, %lu subsampled, %lu skipped\n",
+        gate.Count(spf::fusion::FrameDecision::Integrate),
+        gate.Count(spf::fusion::FrameDecision::Subsample),
+        gate.Count(spf::fusion::FrameDecision::Skip));
+  }
 
+  utils::Log::Info(
+      "Main", "Voxel memory : %lu blocks, %f MB (%f MB reserved)\n", instance_->fusion.NumBlocks(),
+      double(instance_->fusion.VoxelMemory()) / (1024.0 * 1024.0),
+      double(instance_->fusion.ReservedMemory()) / (1024.0 * 1024.0));
+  if(FLAGS_memoryBudget > 0)
+  {
+    utils::Log::Info("Main", "Spilled blocks : %lu\n", instance_->fusion.NumSpilledBlocks());
+  }
+
+  if(FLAGS_gcPeriod > 0)
+  {
+    instance_->fusion.CollectEmptyBlocks();
+  }
   instance_->fusion.RecomputeMeshes();
 
   if(!FLAGS_noExport)
@@ -243,22 +391,30 @@ int main(int argc, char **argv)
 
 // -----------------------------------------------------------------------------
 
-static void onRGBDFrameAvailable(
-    const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
-    const size_t w, const size_t h)
+static Mat4 computeTransform(const Vec3 &translation, const Vec4 &rotation)
 {
   const Mat4 axisPermut = instance_->params.AXIS_PERMUT;
 
   // TODO : for normal dataset : axisPermut * affine
-  Mat4 transform;
   if(std::string(FLAGS_datasetType) == std::string("synthetic0"))
   {
-    transform = Mat4::Inverse(Mat4::Affine(rotation, translation)) * axisPermut;
-  }
-  else
-  {
-    transform = axisPermut * Mat4::Affine(rotation, translation);
+    return Mat4::Inverse(Mat4::Affine(rotation, translation)) * axisPermut;
   }
+  return axisPermut * Mat4::Affine(rotation, translation);
+}
+
+static void onRGBDFramePipelined(
+    const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
+    const size_t w, const size_t h)
+{
+  instance_->pipeline->PushFrame(depth, color, computeTransform(translation, rotation), w, h);
+}
+
+static void onRGBDFrameAvailable(
+    const uint16_t *depth, const uint8_t *color, const Vec3 &translation, const Vec4 &rotation,
+    const size_t w, const size_t h)
+{
+  const Mat4 transform = computeTransform(translation, rotation);
 
   instance_->rgbd.Clear();
   instance_->inputCloud.Clear();
@@ -360,3 +516,22 @@ static void appMainLoop()
   }
 }
 #pragma GCC diagnostic pop
+
+static void pipelineMainLoop()
+{
+  // Input frames are not displayed, the window only keeps the event loop running
+  instance_->pipeline->Start();
+  while(instance_->pipeline->Running())
+  {
+    if(glfwWindowShouldClose(instance_->mainWindow))
+    {
+      instance_->pipeline->Stop();
+    }
+    instance_->renderWindow.Draw();
+    glFlush();
+    glFinish();
+    glfwSwapBuffers(instance_->mainWindow);
+    glfwPollEvents();
+  }
+  instance_->pipeline->Wait();
+}
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <vector>
 #include <numeric>
 #include <algorithm>
 
@@ -189,7 +190,10 @@ public:
   auto Width() const { return width_; }
   auto Height() const { return height_; }
   auto Res() const { return width_ * height_; }
-  auto Capacity() const { return points_.capacity(); }
+  auto Capacity() const { return points_.Capacity(); }
+
+  const VecType& Origin() const { return org_; }
+  void SetOrigin(const VecType& org) { org_ = org; }
 
   VecType Centroid() const
   {
@@ -258,8 +262,16 @@ public:
 
     for(size_t i = 0; i < height_; i++)
     {
+      Normals(i, 0) = VecType{0};
+      Normals(i, width_ - 1) = VecType{0};
       for(size_t j = 1; j < width_ - 1; j++)
       {
+        if(i == 0 || i == height_ - 1)
+        {
+          Normals(i, j) = VecType{0};
+          continue;
+        }
+
         const auto& p = Points(i, j);
         const auto& tmp00 = Points((i - 1), j);
         const auto& tmp01 = Points((i + 1), j);
@@ -279,7 +291,7 @@ public:
         const bool validTmp10 = isValid(tmp10) && VecType::Dist(tmp10, p) <= distThr;
         const bool validTmp11 = isValid(tmp11) && VecType::Dist(tmp11, p) <= distThr;
 
-        if(validTmp11 && validTmp10)
+        if(validTmp11 && validTmp01)
         {
           norm += correctNormal(VecType::Cross(tmp11 - p, tmp01 - p), p);
           n++;
@@ -405,8 +417,8 @@ public:
 private:
   using PointTypeList = PointList<PointType>;
 
-  size_t width_;
-  size_t height_;
+  size_t width_{0};
+  size_t height_{0};
   PointTypeList points_;
   VecType org_;
 };
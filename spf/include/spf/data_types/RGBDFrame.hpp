@@ -186,6 +186,139 @@ public:
     }
   }
 
+  // Fused ExtractPoints / OrderedPointCloud::Transform / OrderedPointCloud::EstimateNormals.
+  // Rows are processed by tiles on numThreads threads, each tile being back projected,
+  // transformed and oriented while it is still in cache. Points on the neighbour rows of a tile are
+  // recomputed instead of being shared, so that tiles are independent. The cloud must already have
+  // the frame dimensions, it is not reallocated.
+  template <typename PointType, typename T>
+  void ExtractOrientedPoints(
+      OrderedPointCloud<PointType> &cloud, const CameraIntrinsics<T> &intrinsics,
+      const geometry::Mat4<T> &transform, const T near, const T far, const T scale,
+      const T distThr, const size_t numThreads) const
+  {
+    using PointCloudType = OrderedPointCloud<PointType>;
+    using ScalarType = typename PointCloudType::ScalarType;
+    using VecType = typename PointCloudType::VecType;
+    static_assert(std::is_same_v<T, ScalarType>, "Types must be the same for scalar type");
+    static_assert(PointType::hasColors(), "PointType must have colors");
+    static_assert(PointType::hasNormals(), "PointType must have normals");
+    static constexpr size_t tileHeight = 8;
+
+    if(cloud.Width() != width_ || cloud.Height() != height_)
+    {
+      throw std::runtime_error("Ordered point cloud and frame dimensions must match");
+    }
+
+    const VecType invalid{std::numeric_limits<ScalarType>::max()};
+    const VecType org = transform * VecType{0};
+    const ScalarType invFx = ScalarType(1) / intrinsics.fx;
+    const ScalarType invFy = ScalarType(1) / intrinsics.fy;
+    cloud.SetOrigin(org);
+
+    auto getPosition = [&](const size_t u, const size_t v) {
+      const DepthType depth = depthImage_(v, u, 0);
+      const auto z = ScalarType(depth) / scale;
+      if(depth == DepthType(0) || z <= near || z > far)
+      {
+        return invalid;
+      }
+      const auto x = (ScalarType(u) - intrinsics.cx) * (z * invFx);
+      const auto y = (ScalarType(v) - intrinsics.cy) * (z * invFy);
+      return transform * VecType({x, y, z});
+    };
+    auto isValid = [&invalid](const VecType &p) { return p != invalid; };
+    auto correctNormal = [&org](VecType const &n, VecType const &p) -> VecType {
+      return VecType::Dot(n, p - org) < ScalarType(0) ? -n : n;
+    };
+
+    const size_t numTiles = (height_ + tileHeight - 1) / tileHeight;
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+    for(size_t tile = 0; tile < numTiles; tile++)
+    {
+      const size_t firstRow = tile * tileHeight;
+      const size_t lastRow = std::min(firstRow + tileHeight, height_);
+
+      // Back projection and transform
+      for(size_t v = firstRow; v < lastRow; v++)
+      {
+        for(size_t u = 0; u < width_; u++)
+        {
+          const ColorType *rgb = colorImage_.Data() + 3 * (v * width_ + u);
+          cloud.Points(v, u) = getPosition(u, v);
+          cloud.Colors(v, u) =
+              VecType(ScalarType(rgb[0]), ScalarType(rgb[1]), ScalarType(rgb[2])) / ScalarType(255);
+        }
+      }
+
+      // Normal estimation, same stencil as OrderedPointCloud::EstimateNormals
+      auto getNeighbour = [&](const size_t v, const size_t u) -> VecType {
+        return (v >= firstRow && v < lastRow) ? cloud.Points(v, u) : getPosition(u, v);
+      };
+      for(size_t v = firstRow; v < lastRow; v++)
+      {
+        cloud.Normals(v, 0) = VecType{0};
+        cloud.Normals(v, width_ - 1) = VecType{0};
+        for(size_t u = 1; u < width_ - 1; u++)
+        {
+          const auto &p = cloud.Points(v, u);
+          if(v == 0 || v == height_ - 1 || !isValid(p))
+          {
+            cloud.Normals(v, u) = VecType{0};
+            continue;
+          }
+
+          const auto tmp00 = getNeighbour(v - 1, u);
+          const auto tmp01 = getNeighbour(v + 1, u);
+          const auto &tmp10 = cloud.Points(v, u - 1);
+          const auto &tmp11 = cloud.Points(v, u + 1);
+
+          VecType norm{0};
+          int n = 0;
+          const bool validTmp00 = isValid(tmp00) && VecType::Dist(tmp00, p) <= distThr;
+          const bool validTmp01 = isValid(tmp01) && VecType::Dist(tmp01, p) <= distThr;
+          const bool validTmp10 = isValid(tmp10) && VecType::Dist(tmp10, p) <= distThr;
+          const bool validTmp11 = isValid(tmp11) && VecType::Dist(tmp11, p) <= distThr;
+
+          if(validTmp11 && validTmp01)
+          {
+            norm += correctNormal(VecType::Cross(tmp11 - p, tmp01 - p), p);
+            n++;
+          }
+
+          if(validTmp01 && validTmp10)
+          {
+            norm += correctNormal(VecType::Cross(tmp01 - p, tmp10 - p), p);
+            n++;
+          }
+
+          if(validTmp10 && validTmp00)
+          {
+            norm += correctNormal(VecType::Cross(tmp10 - p, tmp00 - p), p);
+            n++;
+          }
+
+          if(validTmp00 && validTmp11)
+          {
+            norm += correctNormal(VecType::Cross(tmp00 - p, tmp11 - p), p);
+            n++;
+          }
+
+          cloud.Normals(v, u) = n == 0 ? VecType{0} : VecType::Normalize(norm);
+        }
+      }
+
+      // Clean points with empty normals
+      for(size_t index = firstRow * width_; index < lastRow * width_; index++)
+      {
+        if(cloud.Normals()[index] == VecType{0})
+        {
+          cloud.Points()[index] = invalid;
+        }
+      }
+    }
+  }
+
   void FilterData()
   {
     static_assert(std::is_same_v<DepthType, uint16_t>, "Filtering not implemented for other types");
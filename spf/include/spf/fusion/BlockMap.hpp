@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+#include "spf/fusion/BlockUtils.hpp"
+
+namespace spf
+{
+namespace fusion
+{
+// Flat open addressing table from block ids to small values (e.g. indices), with linear probing
+// on packed 64 bit keys. Lookups are lock free and may run concurrently with inserts and erases,
+// which are serialized by a mutex. A lookup concurrent with the insert of the same id may miss it.
+// Growing allocates a new table and keeps the previous ones until Clear, ReleaseOldTables or
+// destruction, so that concurrent lookups never read freed memory.
+template <typename T, typename Hasher = BlockKeyHasher>
+class BlockMap
+{
+public:
+  BlockMap(const size_t size = 1024) { table_ = NewTable(CapacityFor(size)); }
+
+  BlockMap(const BlockMap &) = delete;
+  BlockMap &operator=(const BlockMap &) = delete;
+
+  inline bool Find(const BlockId &blockId, T &value) const
+  {
+    const Table *table = table_.load(std::memory_order_acquire);
+    const uint64_t key = PackBlockId(blockId);
+    for(size_t i = Hasher()(key) & table->mask;; i = (i + 1) & table->mask)
+    {
+      const uint64_t slotKey = table->keys[i].load(std::memory_order_acquire);
+      if(slotKey == key)
+      {
+        value = table->values[i].load(std::memory_order_relaxed);
+        return true;
+      }
+      if(slotKey == emptyKey_)
+      {
+        return false;
+      }
+    }
+  }
+
+  inline bool Contains(const BlockId &blockId) const
+  {
+    T value;
+    return Find(blockId, value);
+  }
+
+  // Returns false if the id is already in the map, its value is then left unchanged
+  bool Insert(const BlockId &blockId, const T &value)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Table *table = table_.load(std::memory_order_relaxed);
+    if(2 * (size_ + 1) > table->mask + 1)
+    {
+      table = Rehash(2 * (table->mask + 1));
+    }
+    else if(4 * (size_ + numErased_ + 1) > 3 * (table->mask + 1))
+    {
+      // Mostly erased slots, rebuild at the same size
+      table = Rehash(table->mask + 1);
+    }
+
+    const uint64_t key = PackBlockId(blockId);
+    size_t slot = table->mask + 1;
+    for(size_t i = Hasher()(key) & table->mask;; i = (i + 1) & table->mask)
+    {
+      const uint64_t slotKey = table->keys[i].load(std::memory_order_relaxed);
+      if(slotKey == key)
+      {
+        return false;
+      }
+      if(slotKey == erasedKey_ && slot > table->mask)
+      {
+        slot = i;
+      }
+      if(slotKey == emptyKey_)
+      {
+        if(slot > table->mask)
+        {
+          slot = i;
+        }
+        else
+        {
+          numErased_--;
+        }
+        break;
+      }
+    }
+
+    // The value is published before the key
+    table->values[slot].store(value, std::memory_order_relaxed);
+    table->keys[slot].store(key, std::memory_order_release);
+    size_++;
+    return true;
+  }
+
+  bool Erase(const BlockId &blockId)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Table *table = table_.load(std::memory_order_relaxed);
+    const uint64_t key = PackBlockId(blockId);
+    for(size_t i = Hasher()(key) & table->mask;; i = (i + 1) & table->mask)
+    {
+      const uint64_t slotKey = table->keys[i].load(std::memory_order_relaxed);
+      if(slotKey == key)
+      {
+        table->keys[i].store(erasedKey_, std::memory_order_release);
+        size_--;
+        numErased_++;
+        return true;
+      }
+      if(slotKey == emptyKey_)
+      {
+        return false;
+      }
+    }
+  }
+
+  // Empties the map, keeping its capacity. Not safe with concurrent lookups.
+  void Clear()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Table *table = table_.load(std::memory_order_relaxed);
+    for(size_t i = 0; i <= table->mask; i++)
+    {
+      table->keys[i].store(emptyKey_, std::memory_order_relaxed);
+    }
+    size_ = 0;
+    numErased_ = 0;
+    tables_.erase(tables_.begin(), tables_.end() - 1);
+  }
+
+  // Frees the tables replaced by the last growth. Not safe with concurrent lookups.
+  void ReleaseOldTables()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tables_.erase(tables_.begin(), tables_.end() - 1);
+  }
+
+  // Calls func(blockId, value) for each entry, in table order. Not safe with concurrent inserts.
+  template <typename Func>
+  void ForEach(Func &&func) const
+  {
+    const Table *table = table_.load(std::memory_order_acquire);
+    for(size_t i = 0; i <= table->mask; i++)
+    {
+      const uint64_t key = table->keys[i].load(std::memory_order_acquire);
+      if(key != emptyKey_ && key != erasedKey_)
+      {
+        func(UnpackBlockId(key), table->values[i].load(std::memory_order_relaxed));
+      }
+    }
+  }
+
+  inline size_t Size() const { return size_; }
+  inline bool Empty() const { return size_ == 0; }
+  inline size_t Capacity() const { return table_.load(std::memory_order_acquire)->mask + 1; }
+
+private:
+  // Packed ids never have the highest bit set
+  static constexpr uint64_t emptyKey_ = ~uint64_t(0);
+  static constexpr uint64_t erasedKey_ = ~uint64_t(0) - 1;
+
+  struct Table
+  {
+    size_t mask;
+    std::unique_ptr<std::atomic<uint64_t>[]> keys;
+    std::unique_ptr<std::atomic<T>[]> values;
+  };
+
+  // Current table, the last one of tables_
+  std::atomic<Table *> table_;
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::mutex mutex_;
+  std::atomic<size_t> size_{0};
+  size_t numErased_{0};
+
+  static inline size_t CapacityFor(const size_t size)
+  {
+    size_t capacity = 16;
+    while(capacity < 2 * size)
+    {
+      capacity *= 2;
+    }
+    return capacity;
+  }
+
+  Table *NewTable(const size_t capacity)
+  {
+    std::unique_ptr<Table> table(new Table);
+    table->mask = capacity - 1;
+    table->keys.reset(new std::atomic<uint64_t>[capacity]);
+    table->values.reset(new std::atomic<T>[capacity]);
+    for(size_t i = 0; i < capacity; i++)
+    {
+      table->keys[i].store(emptyKey_, std::memory_order_relaxed);
+    }
+    tables_.emplace_back(std::move(table));
+    return tables_.back().get();
+  }
+
+  Table *Rehash(const size_t capacity)
+  {
+    const Table *oldTable = table_.load(std::memory_order_relaxed);
+    Table *newTable = NewTable(capacity);
+    for(size_t i = 0; i <= oldTable->mask; i++)
+    {
+      const uint64_t key = oldTable->keys[i].load(std::memory_order_relaxed);
+      if(key == emptyKey_ || key == erasedKey_)
+      {
+        continue;
+      }
+      size_t j = Hasher()(key) & newTable->mask;
+      while(newTable->keys[j].load(std::memory_order_relaxed) != emptyKey_)
+      {
+        j = (j + 1) & newTable->mask;
+      }
+      newTable->values[j].store(
+          oldTable->values[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      newTable->keys[j].store(key, std::memory_order_relaxed);
+    }
+    numErased_ = 0;
+    table_.store(newTable, std::memory_order_release);
+    return newTable;
+  }
+};
+} // namespace fusion
+} // namespace spf
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <string>
+
+#include "spf/Types.hpp"
+#include "spf/data_types/Mesh.hpp"
+#include "spf/fusion/BlockUtils.hpp"
+#include "spf/fusion/BlockMap.hpp"
+#include "spf/fusion/VoxelBlock.hpp"
+
+namespace spf
+{
+namespace fusion
+{
+// Blocks spilled to disk. Each block is written with its mesh and its dirty flag in a compressed
+// file of the store directory, voxels are kept in their storage. Blocks are read back in the
+// storage of the destination block, so that the volume storage can change in between.
+// Writes and reads of different blocks can run concurrently. Removing a block from the store
+// leaves its file on disk, it is overwritten when the block is spilled again.
+class BlockStore
+{
+public:
+  using MeshType = data_types::Mesh<data_types::PointXYZRGBN<float>>;
+  using MeshPtrType = std::unique_ptr<MeshType>;
+
+  BlockStore() = default;
+
+  BlockStore(const BlockStore &) = delete;
+  BlockStore &operator=(const BlockStore &) = delete;
+
+  // Creates the directory if needed, blocks previously in the store are forgotten
+  bool Open(const std::string &dir);
+
+  inline bool IsOpen() const { return !dir_.empty(); }
+  inline const std::string &Dir() const { return dir_; }
+
+  inline bool Contains(const BlockId &blockId) const { return blockIds_.Contains(blockId); }
+  inline size_t Size() const { return blockIds_.Size(); }
+  inline bool Empty() const { return blockIds_.Empty(); }
+
+  std::vector<BlockId> GetAllIds() const;
+
+  // Number of triangles of the mesh stored with a block, 0 if the block is not in the store
+  size_t NumTriangles(const BlockId &blockId) const;
+
+  // Writes the voxels of a block and its mesh, which may be nullptr
+  bool Write(const BlockId &blockId, const VoxelBlock &block, const MeshType *mesh);
+
+  // Reads the voxels of a block, and its mesh if mesh is not nullptr. The block is marked dirty if
+  // it was when written. The block stays in the store.
+  bool Read(const BlockId &blockId, VoxelBlock &block, MeshPtrType *mesh) const;
+
+  bool ReadMesh(const BlockId &blockId, MeshPtrType &mesh) const;
+
+  void Remove(const BlockId &blockId);
+
+  // Puts back a removed block whose file is still up to date
+  void Restore(const BlockId &blockId, const size_t numTriangles);
+
+  void Clear();
+
+private:
+  static constexpr uint32_t magic_ = 0x4b4c4253; // "SBLK"
+
+  struct FileHeader
+  {
+    uint32_t magic;
+    uint8_t storage;
+    uint8_t useColor;
+    uint8_t dirty;
+    uint8_t reserved;
+    VoxelQuantization quantization;
+    uint64_t numTriangles;
+  };
+
+  std::string dir_;
+
+  // Number of triangles of the stored meshes
+  BlockMap<int> blockIds_;
+
+  std::string Filename(const BlockId &blockId) const;
+};
+} // namespace fusion
+} // namespace spf
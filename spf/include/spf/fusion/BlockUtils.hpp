@@ -17,7 +17,11 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <limits>
+#include <vector>
+#include <cstdint>
 
 namespace spf
 {
@@ -40,7 +44,17 @@ static constexpr size_t getShift()
   }
 }
 
-template <typename T, size_t N = 16>
+// Number of voxels along each axis of the blocks of the volume, chosen when building the library
+// (make BLOCK_SIZE=8). Smaller blocks waste fewer voxels around the surface, larger ones need
+// fewer hash lookups.
+#ifndef SPF_BLOCK_SIZE
+#  define SPF_BLOCK_SIZE 16
+#endif
+static_assert(
+    SPF_BLOCK_SIZE == 8 || SPF_BLOCK_SIZE == 16 || SPF_BLOCK_SIZE == 32,
+    "SPF_BLOCK_SIZE must be 8, 16 or 32");
+
+template <typename T, size_t N = SPF_BLOCK_SIZE>
 struct BlockProperties
 {
   static constexpr T invalidTsdf = std::numeric_limits<T>::max();
@@ -140,7 +154,7 @@ static inline Index3d Div(Index3d const& index, const int val)
   return Index3d(Div(index.x, val), Div(index.y, val), Div(index.z, val));
 }
 
-template <size_t N = 16>
+template <size_t N = SPF_BLOCK_SIZE>
 static inline BlockId GetId(Point3f const& v, const float voxelRes)
 {
   const int x = (int) floorf(v.x / voxelRes) >> BlockProperties<float, N>::blockShift;
@@ -149,7 +163,7 @@ static inline BlockId GetId(Point3f const& v, const float voxelRes)
   return BlockId(x, y, z);
 }
 
-template <size_t N = 16>
+template <size_t N = SPF_BLOCK_SIZE>
 static inline Index3d GetVoxelAbsolutePos(BlockId const& blockId, Index3d const& voxelId)
 {
   return BlockProperties<float, N>::blockSize * blockId + voxelId;
@@ -160,7 +174,7 @@ static inline Point3f GetVoxelPos(const Index3d& id, const float voxelRes)
   return voxelRes * Point3f((float) id.x, (float) id.y, (float) id.z);
 }
 
-template <size_t N = 16>
+template <size_t N = SPF_BLOCK_SIZE>
 static inline Index3d GetVoxelId(const Point3f& p, const float voxelRes)
 {
   const int x = Mod((int) floorf(p.x / voxelRes), BlockProperties<float, N>::blockSize);
@@ -169,16 +183,213 @@ static inline Index3d GetVoxelId(const Point3f& p, const float voxelRes)
   return Index3d(x, y, z);
 }
 
-struct ChunkHasher
+// Amanatides & Woo traversal of the voxel grid. Voxel values are sampled at GetVoxelPos(id), so
+// the cell of a voxel is centered on that position. func is called once with the absolute index
+// of each voxel whose cell is crossed by the segment [first, last].
+template <typename Func>
+static inline void TraverseVoxels(
+    const Point3f& first, const Point3f& last, const float voxelRes, Func&& func)
+{
+  const Point3f p0 = first / voxelRes + Point3f(0.5f, 0.5f, 0.5f);
+  const Point3f p1 = last / voxelRes + Point3f(0.5f, 0.5f, 0.5f);
+  const Vec3f dir = p1 - p0;
+
+  Index3d id((int) floorf(p0.x), (int) floorf(p0.y), (int) floorf(p0.z));
+  const Index3d lastId((int) floorf(p1.x), (int) floorf(p1.y), (int) floorf(p1.z));
+
+  auto initAxis = [](const float p, const float d, const int i, int& step, float& tMax,
+                     float& tDelta) {
+    if(d > 0.0f)
+    {
+      step = 1;
+      tDelta = 1.0f / d;
+      tMax = (float(i + 1) - p) / d;
+    }
+    else if(d < 0.0f)
+    {
+      step = -1;
+      tDelta = -1.0f / d;
+      tMax = (float(i) - p) / d;
+    }
+    else
+    {
+      step = 0;
+      tDelta = std::numeric_limits<float>::max();
+      tMax = std::numeric_limits<float>::max();
+    }
+  };
+
+  int stepX, stepY, stepZ;
+  float tMaxX, tMaxY, tMaxZ;
+  float tDeltaX, tDeltaY, tDeltaZ;
+  initAxis(p0.x, dir.x, id.x, stepX, tMaxX, tDeltaX);
+  initAxis(p0.y, dir.y, id.y, stepY, tMaxY, tDeltaY);
+  initAxis(p0.z, dir.z, id.z, stepZ, tMaxZ, tDeltaZ);
+
+  // Bounds the walk when rounding makes it miss the last voxel
+  const int maxSteps =
+      std::abs(lastId.x - id.x) + std::abs(lastId.y - id.y) + std::abs(lastId.z - id.z);
+
+  func(id);
+  for(int i = 0; i < maxSteps && !(id == lastId); i++)
+  {
+    if(tMaxX <= tMaxY && tMaxX <= tMaxZ)
+    {
+      id.x += stepX;
+      tMaxX += tDeltaX;
+    }
+    else if(tMaxY <= tMaxZ)
+    {
+      id.y += stepY;
+      tMaxY += tDeltaY;
+    }
+    else
+    {
+      id.z += stepZ;
+      tMaxZ += tDeltaZ;
+    }
+    func(id);
+  }
+}
+
+// Block ids packed in a 64 bit key, 21 bits per coordinate. Coordinates must be in
+// [-2^20, 2^20), i.e. about 160 km from the origin with 16 voxels of 1 cm per block. The highest
+// bit is never set by a packed id.
+static constexpr int blockKeyBits = 21;
+
+// Ids out of that range alias other ids once packed, they are never added to a volume
+static inline bool ValidBlockId(const BlockId& id)
+{
+  constexpr int limit = 1 << (blockKeyBits - 1);
+  return id.x >= -limit && id.x < limit && id.y >= -limit && id.y < limit && id.z >= -limit
+         && id.z < limit;
+}
+
+static inline uint64_t PackBlockId(const BlockId& id)
 {
-  static constexpr size_t p1 = 73856093;
-  static constexpr size_t p2 = 19349663;
-  static constexpr size_t p3 = 83492791;
+  constexpr uint64_t mask = (uint64_t(1) << blockKeyBits) - 1;
+  constexpr int offset = 1 << (blockKeyBits - 1);
+  return (uint64_t(id.x + offset) & mask) | ((uint64_t(id.y + offset) & mask) << blockKeyBits)
+         | ((uint64_t(id.z + offset) & mask) << (2 * blockKeyBits));
+}
+
+static inline BlockId UnpackBlockId(const uint64_t key)
+{
+  constexpr uint64_t mask = (uint64_t(1) << blockKeyBits) - 1;
+  constexpr int offset = 1 << (blockKeyBits - 1);
+  return BlockId(
+      int(key & mask) - offset, int((key >> blockKeyBits) & mask) - offset,
+      int((key >> (2 * blockKeyBits)) & mask) - offset);
+}
+
+// Finalizer of MurmurHash3 : every bit of the key affects every bit of the hash, so that the low
+// bits used by power of two tables are well distributed, negative coordinates included
+struct BlockKeyHasher
+{
+  inline std::size_t operator()(uint64_t key) const
+  {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+  }
+};
 
+struct ChunkHasher
+{
   inline std::size_t operator()(const BlockId& key) const
   {
-    return (key.x * p1 ^ key.y * p2 ^ key.z * p3);
+    return BlockKeyHasher()(PackBlockId(key));
+  }
+};
+
+// Spreads the low 21 bits of v to every third bit
+static inline uint64_t SpreadBits3(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x1f00000000ffffULL;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+  v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+  v = (v | (v << 2)) & 0x1249249249249249ULL;
+  return v;
+}
+
+// Block ids packed in Morton order : the bits of the coordinates, offset as in PackBlockId, are
+// interleaved. Blocks close to each other have close keys, so that lists sorted by key are
+// processed one neighbourhood after the other.
+static inline uint64_t MortonBlockKey(const BlockId& id)
+{
+  constexpr int offset = 1 << (blockKeyBits - 1);
+  return SpreadBits3(uint64_t(id.x + offset)) | (SpreadBits3(uint64_t(id.y + offset)) << 1)
+         | (SpreadBits3(uint64_t(id.z + offset)) << 2);
+}
+
+// Sorts block ids in Morton order and removes the duplicates. Work lists are sorted this way so
+// that consecutive blocks share their neighbours in cache, and batches of consecutive blocks are
+// compact. Ids are sorted in place, so that the per-frame lists do not allocate.
+static inline bool MortonLess(const BlockId& id0, const BlockId& id1)
+{
+  return MortonBlockKey(id0) < MortonBlockKey(id1);
+}
+
+static inline void SortBlockIds(std::vector<BlockId>& ids)
+{
+  std::sort(ids.begin(), ids.end(), MortonLess);
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+}
+
+// Layouts of the voxels of a block, chosen when building the library (make VOXEL_LAYOUT=morton).
+// Voxels are addressed by their offset x + y * blockSize + z * blockSize^2 in the block, the
+// layout gives the index at which they are stored.
+// The linear layout stores voxels at their offset : rows along x are contiguous, which suits the
+// vectorized projective integration, but the next voxel along z is blockSize^2 voxels away.
+struct LinearVoxelLayout
+{
+  static constexpr bool isLinear = true;
+
+  static inline size_t Index(const size_t x, const size_t y, const size_t z, const size_t blockSize)
+  {
+    return x + (y + z * blockSize) * blockSize;
+  }
+};
+
+// Voxel coordinates in [0, 32) with their bits spread to every third bit
+static constexpr std::array<uint16_t, 32> getSpreadTable()
+{
+  std::array<uint16_t, 32> table{};
+  for(size_t i = 0; i < table.size(); i++)
+  {
+    for(size_t bit = 0; bit < 5; bit++)
+    {
+      table[i] |= uint16_t(((i >> bit) & 1) << (3 * bit));
+    }
+  }
+  return table;
+}
+
+// The Morton layout stores the 8 voxels of each 2x2x2 cube together, then the 8 cubes of each 4x4x4
+// cube and so on, so that the neighbours of a voxel along every axis are mostly in the same cache
+// lines. Rows along x are no longer contiguous.
+struct MortonVoxelLayout
+{
+  static constexpr bool isLinear = false;
+
+  static inline size_t Index(const size_t x, const size_t y, const size_t z, const size_t)
+  {
+    return spread_[x] | (spread_[y] << 1) | (spread_[z] << 2);
   }
+
+private:
+  static constexpr std::array<uint16_t, 32> spread_ = getSpreadTable();
 };
+
+#ifdef SPF_MORTON_VOXELS
+using VoxelLayout = MortonVoxelLayout;
+#else
+using VoxelLayout = LinearVoxelLayout;
+#endif
 } // namespace fusion
 } // namespace spf
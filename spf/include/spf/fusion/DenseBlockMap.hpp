@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <cstdint>
+
+#include "spf/Types.hpp"
+#include "spf/fusion/BlockUtils.hpp"
+
+namespace spf
+{
+namespace fusion
+{
+// Block ids in [min, max] along each axis. The default bounds are empty.
+struct BlockBounds
+{
+  BlockId min{0};
+  BlockId max{-1};
+
+  BlockBounds() = default;
+  BlockBounds(const BlockId &min, const BlockId &max) : min(min), max(max) {}
+
+  // Blocks holding the voxels of the box [boxMin, boxMax] of the world
+  static inline BlockBounds FromBox(
+      const Point3f &boxMin, const Point3f &boxMax, const float voxelRes)
+  {
+    return BlockBounds(GetId(boxMin, voxelRes), GetId(boxMax, voxelRes));
+  }
+
+  inline bool Empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+  inline size_t NumBlocks() const
+  {
+    return Empty() ? 0
+                   : size_t(max.x - min.x + 1) * size_t(max.y - min.y + 1)
+                         * size_t(max.z - min.z + 1);
+  }
+
+  inline bool Contains(const BlockId &blockId) const
+  {
+    return blockId.x >= min.x && blockId.y >= min.y && blockId.z >= min.z && blockId.x <= max.x
+           && blockId.y <= max.y && blockId.z <= max.z;
+  }
+};
+
+// Same interface as BlockMap for the blocks of bounded scenes : values are stored in a dense
+// array with one slot per block of the bounds, so that lookups are a few index computations. Ids
+// outside of the bounds are never in the map. Lookups, inserts and erases of different ids may
+// run concurrently. The array takes sizeof(T) bytes per block of the bounds, whether the block is
+// in the map or not, and ForEach goes through all of it.
+// T must be an integral type, the lowest value marks the empty slots and cannot be stored.
+template <typename T>
+class DenseBlockMap
+{
+public:
+  DenseBlockMap(const BlockBounds &bounds) :
+      bounds_(bounds),
+      dimX_(bounds.Empty() ? 0 : bounds.max.x - bounds.min.x + 1),
+      dimY_(bounds.Empty() ? 0 : bounds.max.y - bounds.min.y + 1),
+      dimZ_(bounds.Empty() ? 0 : bounds.max.z - bounds.min.z + 1),
+      slots_(new std::atomic<T>[bounds.NumBlocks()])
+  {
+    Clear();
+  }
+
+  DenseBlockMap(const DenseBlockMap &) = delete;
+  DenseBlockMap &operator=(const DenseBlockMap &) = delete;
+
+  inline bool Find(const BlockId &blockId, T &value) const
+  {
+    const size_t slot = Slot(blockId);
+    if(slot == invalidSlot_)
+    {
+      return false;
+    }
+    const T slotValue = slots_[slot].load(std::memory_order_acquire);
+    if(slotValue == emptyValue_)
+    {
+      return false;
+    }
+    value = slotValue;
+    return true;
+  }
+
+  inline bool Contains(const BlockId &blockId) const
+  {
+    T value;
+    return Find(blockId, value);
+  }
+
+  // Returns false if the id is already in the map, its value is then left unchanged, or if it is
+  // outside of the bounds
+  bool Insert(const BlockId &blockId, const T &value)
+  {
+    const size_t slot = Slot(blockId);
+    if(slot == invalidSlot_)
+    {
+      return false;
+    }
+    T expected = emptyValue_;
+    if(!slots_[slot].compare_exchange_strong(expected, value, std::memory_order_release))
+    {
+      return false;
+    }
+    size_++;
+    return true;
+  }
+
+  bool Erase(const BlockId &blockId)
+  {
+    const size_t slot = Slot(blockId);
+    if(slot == invalidSlot_)
+    {
+      return false;
+    }
+    if(slots_[slot].exchange(emptyValue_, std::memory_order_release) == emptyValue_)
+    {
+      return false;
+    }
+    size_--;
+    return true;
+  }
+
+  // Empties the map. Not safe with concurrent lookups.
+  void Clear()
+  {
+    for(size_t i = 0; i < bounds_.NumBlocks(); i++)
+    {
+      slots_[i].store(emptyValue_, std::memory_order_relaxed);
+    }
+    size_ = 0;
+  }
+
+  // Nothing to release, the array never grows
+  inline void ReleaseOldTables() {}
+
+  // Calls func(blockId, value) for each entry, x first. Not safe with concurrent inserts.
+  template <typename Func>
+  void ForEach(Func &&func) const
+  {
+    size_t slot = 0;
+    for(int z = bounds_.min.z; z <= bounds_.max.z; z++)
+    {
+      for(int y = bounds_.min.y; y <= bounds_.max.y; y++)
+      {
+        for(int x = bounds_.min.x; x <= bounds_.max.x; x++, slot++)
+        {
+          const T value = slots_[slot].load(std::memory_order_acquire);
+          if(value != emptyValue_)
+          {
+            func(BlockId(x, y, z), value);
+          }
+        }
+      }
+    }
+  }
+
+  inline size_t Size() const { return size_; }
+  inline bool Empty() const { return size_ == 0; }
+  inline size_t Capacity() const { return bounds_.NumBlocks(); }
+  inline const BlockBounds &Bounds() const { return bounds_; }
+
+  inline bool InBounds(const BlockId &blockId) const { return Slot(blockId) != invalidSlot_; }
+
+private:
+  static constexpr T emptyValue_ = std::numeric_limits<T>::lowest();
+  static constexpr size_t invalidSlot_ = std::numeric_limits<size_t>::max();
+
+  BlockBounds bounds_;
+  size_t dimX_;
+  size_t dimY_;
+  size_t dimZ_;
+  std::unique_ptr<std::atomic<T>[]> slots_;
+  std::atomic<size_t> size_{0};
+
+  // Ids below the bounds wrap around to large unsigned values
+  inline size_t Slot(const BlockId &blockId) const
+  {
+    const size_t x = size_t(int64_t(blockId.x) - bounds_.min.x);
+    const size_t y = size_t(int64_t(blockId.y) - bounds_.min.y);
+    const size_t z = size_t(int64_t(blockId.z) - bounds_.min.z);
+    if(x >= dimX_ || y >= dimY_ || z >= dimZ_)
+    {
+      return invalidSlot_;
+    }
+    return x + dimX_ * (y + dimY_ * z);
+  }
+};
+} // namespace fusion
+} // namespace spf
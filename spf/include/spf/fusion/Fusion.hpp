@@ -19,6 +19,8 @@
 
 #include <vector>
 #include <limits>
+#include <string>
+#include <mutex>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,12 +35,37 @@
 #include "spf/data_types/RGBDFrame.hpp"
 #include "spf/fusion/VoxelBlock.hpp"
 #include "spf/fusion/Volume.hpp"
+#include "spf/fusion/WeightTable.hpp"
+#include "spf/fusion/KeyframeGate.hpp"
 
 namespace spf
 {
 namespace fusion
 {
 using namespace data_types;
+
+// BlockBucketed is the default. RayMarching is kept as a legacy mode : rays of different threads
+// update the same voxels and halos without synchronization, so concurrent samples may be lost and
+// results vary with the number of threads.
+enum class IntegrationMode
+{
+  RayMarching,   // Each thread updates the voxels hit by its own rays, racy
+  BlockBucketed, // Ray samples are bucketed per block, each block has a single writer
+  Projective     // Voxels of intersecting blocks are projected into the depth map
+};
+
+enum class BlockTraversal
+{
+  Bresenham, // Integer line walk between the end blocks, may skip diagonal blocks
+  DDA        // Exact traversal of the blocks crossed by the truncation segment
+};
+
+enum class RaySampling
+{
+  HalfVoxel, // Fixed steps of half a voxel, most voxels are updated twice per ray
+  VoxelDDA   // Each voxel crossed by the truncation segment is updated once
+};
+
 class Fusion
 {
 public:
@@ -50,22 +77,114 @@ public:
   using OPCType = OrderedPointCloud<OPCPointType>;
   using MeshType = typename Volume::MeshType;
 
+  // Scenes with known bounds index their blocks by a dense grid covering them, blocks outside of
+  // the bounds are not integrated. See BlockBounds::FromBox.
   Fusion(
       const float voxelRes, const float integrationDistance, const size_t maxDepthMapWidth,
-      const size_t maxDepthMapHeight);
+      const size_t maxDepthMapHeight, const size_t weightTableSize = 1024,
+      const BlockBounds &bounds = BlockBounds());
 
   ~Fusion();
 
-  void IntegrateDepthMap(
+  // Both functions return the decision of the keyframe gate for this frame (always Integrate when
+  // the gate is disabled)
+  FrameDecision IntegrateDepthMap(
       const FrameType &depthMap, const IntrinsicsType &intinsics, const Mat4f &transform,
       const float near = 0.0f, const size_t far = 5.0f);
 
-  void IntegrateDepthMapOrdered(
+  FrameDecision IntegrateDepthMapOrdered(
       const FrameType &depthMap, const IntrinsicsType &interinsics, const Mat4f &transform,
       const float near = 0.0f, const size_t far = 5.0f);
 
+  // Integrates a whole sequence of depth maps. Blocks are discovered and allocated once for the
+  // batch, then each block is updated by all the frames seeing it in turn, so that it is loaded
+  // only once per batch. The result is the same as integrating the frames one by one.
+  // In projective mode the frames are projected block by block. In the other modes the ray samples
+  // of the whole batch are bucketed per block, so ray marching is integrated as block bucketed, and
+  // the bucket buffers grow with the number of frames.
+  void IntegrateDepthMaps(
+      const std::vector<FrameType> &depthMaps, const IntrinsicsType &intrinsics,
+      const std::vector<Mat4f> &transforms, const float near = 0.0f, const size_t far = 5.0f);
+
+  inline void SetIntegrationMode(const IntegrationMode mode) { integrationMode_ = mode; }
+  inline IntegrationMode GetIntegrationMode() const { return integrationMode_; }
+
+  inline void SetBlockTraversal(const BlockTraversal traversal) { blockTraversal_ = traversal; }
+  inline BlockTraversal GetBlockTraversal() const { return blockTraversal_; }
+
+  // Voxel sampling of the ray marching and block bucketed modes
+  inline void SetRaySampling(const RaySampling sampling) { raySampling_ = sampling; }
+  inline RaySampling GetRaySampling() const { return raySampling_; }
+
+  // Skips or subsamples the frames that bring little new information, see KeyframeGate. The batch
+  // API is not gated.
+  void EnableKeyframeGate(const KeyframeGateParams &params = KeyframeGateParams());
+  inline void DisableKeyframeGate() { useKeyframeGate_ = false; }
+  inline bool KeyframeGateEnabled() const { return useKeyframeGate_; }
+  inline const KeyframeGate &GetKeyframeGate() const { return keyframeGate_; }
+
+  void SetWeightMode(const WeightMode mode);
+  inline WeightMode GetWeightMode() const { return weightTable_.Mode(); }
+
+  // Storage of the voxels, see VoxelStorage. Compact voxels quantize TSDF values over
+  // [-tau - voxelRes, tau + voxelRes], which covers the distances of the voxel centers sampled
+  // along the rays, and weights in units of 1/256 of a surface sample : they saturate after a few
+  // hundred samples, from which point the voxels follow a moving average.
+  void SetVoxelStorage(const VoxelStorage storage);
+  inline VoxelStorage GetVoxelStorage() const { return volume_.GetVoxelStorage(); }
+  inline size_t VoxelMemory() const { return volume_.VoxelMemory(); }
+  inline size_t ReservedMemory() const { return volume_.ReservedMemory(); }
+
+  // Backs the voxel memory allocated afterwards by transparent huge pages
+  inline void UseHugePages(const bool useHugePages) { volume_.UseHugePages(useHugePages); }
+
+  // Blocks of the instance, e.g. to read voxels between two integrations
+  inline Volume &GetVolume() { return volume_; }
+
+  // Bounds the voxel memory in bytes, 0 for no bound. Once the blocks of a frame are allocated,
+  // the blocks least recently seen, farthest from the camera first, are spilled with their meshes
+  // to spillDir until the voxel memory is back within the budget. Spilled blocks are reloaded
+  // when a frame sees them again and when the meshes around them are updated. The blocks of the
+  // current frame are never spilled, so the budget is exceeded if they do not fit in it.
+  inline bool SetMemoryBudget(const size_t memoryBudget, const std::string &spillDir)
+  {
+    return volume_.SetMemoryBudget(memoryBudget, spillDir);
+  }
+  inline size_t MemoryBudget() const { return volume_.MemoryBudget(); }
+  inline size_t NumSpilledBlocks() const { return volume_.NumSpilledBlocks(); }
+
+  // Blocks crossed by the truncation band are allocated even if no sample lands in them. Every
+  // period integrated frames (0 disables it), the blocks without any observed voxel are removed,
+  // except those of the current frame. Their memory goes back to the pool.
+  inline void SetCollectionPeriod(const size_t period) { collectionPeriod_ = period; }
+  inline size_t GetCollectionPeriod() const { return collectionPeriod_; }
+
+  // Removes all the blocks without any observed voxel and returns their number, each one
+  // reclaims BlockMemory() bytes
+  size_t CollectEmptyBlocks();
+  inline size_t BlockMemory() const { return volume_.BlockMemory(); }
+
+  // Number of threads used by every parallel section of this instance. Several instances can
+  // integrate concurrently from different threads, each one with its own team size.
+  void SetNumThreads(const size_t numThreads);
+  inline size_t GetNumThreads() const { return numThreads_; }
+
+  inline size_t NumBlocks() const { return volume_.NumBlocks(); }
+
   void UpdateMeshes();
 
+  // Updates the meshes affected by the voxels integrated in the given blocks since
+  // their last update, e.g. a block list saved by GetUpdatedBlocks. Blocks that were not
+  // modified are skipped, and neighbours reading modified voxels are included. Spilled blocks
+  // within two blocks of the modified ones are reloaded.
+  // It can run on another thread than IntegrateDepthMap(Ordered) and IntegrateDepthMaps. Meshing
+  // reads the voxels and halos written by integration, so it waits while the volume is modified :
+  // only the point extraction and the block discovery of the next frame run meanwhile.
+  void UpdateMeshes(const BlockIdList &blockIds);
+
+  // Blocks updated by the last integration
+  inline const BlockIdList &GetUpdatedBlocks() const { return newBlocks_; }
+
   void RecomputeMeshes();
 
   void ExportMesh(const char *filename);
@@ -81,30 +200,145 @@ public:
       Mat4f const &OPENGL_TO_CAM);
 
 private:
+  struct IntegrationSample
+  {
+    uint32_t blockIndex;
+    uint32_t frame;
+    uint32_t offset;
+    float tsdf;
+    Color3f rgb;
+  };
+  using SampleList = std::vector<IntegrationSample>;
+
+  // Per frame scratch memory, allocated once for the maximum depth map size and the number of
+  // threads. Buffers only grow, so that integration does not allocate in steady state.
+  struct Workspace
+  {
+    PointCloudType cloud;
+    OPCType opc;
+    std::vector<BlockUpdateList> intersectingBlocks;
+    BlockIdList updateBlocks;
+
+    // Block bucketed integration buffers
+    BlockIdMap blockIndices;
+    std::vector<SampleList> threadSamples;
+    std::vector<size_t> bucketOffsets;
+    std::vector<size_t> bucketCursors;
+    std::vector<size_t> bucketMergeCursors;
+    SampleList bucketedSamples;
+
+    // Batch integration buffers
+    std::vector<PointCloudType> batchClouds;
+    std::vector<BlockIdList> batchFrameBlocks;
+    std::vector<Mat4f> batchWorldToCam;
+    std::vector<size_t> batchBlockFrameOffsets;
+    std::vector<size_t> batchBlockCursors;
+    std::vector<uint32_t> batchBlockFrames;
+  };
+
+  static constexpr float depthScale_ = 5000.0f;
+
   float voxelRes_;
   float tau_;
   size_t maxDepthMapWidth_;
   size_t maxDepthMapHeight_;
+  size_t numThreads_;
+  IntegrationMode integrationMode_{IntegrationMode::BlockBucketed};
+  BlockTraversal blockTraversal_{BlockTraversal::DDA};
+  RaySampling raySampling_{RaySampling::HalfVoxel};
+  bool useKeyframeGate_{false};
+  size_t collectionPeriod_{0};
+  size_t framesSinceCollection_{0};
+  KeyframeGate keyframeGate_;
+  WeightTable weightTable_;
 
   Volume volume_;
-  BlockUpdateList intersectingBlocks_;
   BlockIdList newBlocks_;
+  Workspace workspace_;
+
+  // Held while blocks are added, evicted, reloaded or removed, and while voxels are integrated or
+  // meshed, see UpdateMeshes
+  std::mutex volumeMutex_;
+
+  void AllocateWorkspace();
+
+  FrameDecision GateFrame(const FrameType &depthMap, const Mat4f &transform);
+
+  // Runs the periodic collection of the empty blocks after numFrames integrated frames
+  void CollectGarbage(const size_t numFrames);
+
+  // Advances the volume by the integrated frames and adds newBlocks_ to it, then evicts the blocks
+  // farthest from center when over budget
+  void AllocateBlocks(const Point3f &center, const size_t numFrames = 1);
+
+  void SubsampleCloud(PointCloudType &pointCloud, const size_t stride);
+
+  void SubsampleCloud(OPCType &opc, const size_t stride);
 
   void GetBlocksIntersecting(PointCloudType const &pointCloud, const Point3f &cameraCenter);
 
+  void CollectBlocksIntersecting(PointCloudType const &pointCloud, const Point3f &cameraCenter);
+
   void GetBlocksIntersecting(OPCType const &opc);
 
   void IntegratePointCloud(PointCloudType const &pointCloud, const Point3f &cameraCenter);
 
   void IntegratePointCloud(OPCType const &opc);
 
-  void UpdateGradients();
+  void IntegratePointCloudBucketed(PointCloudType const &pointCloud, const Point3f &cameraCenter);
+
+  void IntegratePointCloudBucketed(OPCType const &opc);
+
+  void BucketPointCloud(
+      PointCloudType const &pointCloud, const Point3f &cameraCenter, const uint32_t frame = 0);
+
+  void IntegrateProjective(
+      const FrameType &depthMap, const IntrinsicsType &intrinsics, const Mat4f &transform,
+      const float near, const float far);
+
+  void IntegrateBlockProjective(
+      VoxelBlock &voxelBlock, const BlockId &blockId, const FrameType &depthMap,
+      const IntrinsicsType &intrinsics, const Mat4f &worldToCam, const float near,
+      const float far);
+
+  void IntegrateBatchProjective(
+      const std::vector<FrameType> &depthMaps, const IntrinsicsType &intrinsics,
+      const std::vector<Mat4f> &transforms, const float near, const float far);
+
+  template <typename Func>
+  void ForEachRaySample(const Point3f &org, const Vec3f &u, Func &&func);
+
+  void PrepareBuckets();
+
+  void BucketRaySamples(
+      const Point3f &org, const Vec3f &u, const Color3f &rgb, const uint32_t frame,
+      SampleList &samples, size_t *blockCounts);
+
+  void SortSampleBuckets();
+
+  void IntegrateBuckets(const size_t numFrames = 1);
+
+  void CollectBlocksToUpdate(const BlockIdList &blockIds);
+
+  void PrepareBlockLists();
+
+  void MergeBlockLists();
+
+  // Offset of the segments along which blocks are discovered. The voxel DDA sampling updates the
+  // voxel whose cell, centered on the voxel, holds the sample, i.e. the voxel at
+  // floor(p / voxelRes + 0.5) : its blocks are those of the segments shifted by half a voxel.
+  inline Vec3f DiscoveryOffset() const
+  {
+    return raySampling_ == RaySampling::VoxelDDA && integrationMode_ != IntegrationMode::Projective
+               ? Vec3f(0.5f * voxelRes_, 0.5f * voxelRes_, 0.5f * voxelRes_)
+               : Vec3f(0.0f, 0.0f, 0.0f);
+  }
 
-  void UpdateAllGradients();
+  void TraverseBlocks(const Point3f &first, const Point3f &last, BlockUpdateList &foundIds);
 
-  void RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<Index3d> &foundIds);
+  void RaycastVoxels(const Index3d &minId, const Index3d &maxId, BlockUpdateList &foundIds);
 
-  void PackTSDF(const BlockId &blockId, float *packedTSDF);
+  void LogCacheStats();
 };
 } // namespace fusion
 } // namespace spf
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "spf/Types.hpp"
+#include "spf/fusion/WeightTable.hpp"
+
+#ifdef __AVX2__
+#  include "spf/math/simd.hpp"
+#endif
+
+namespace spf
+{
+namespace fusion
+{
+#ifdef __AVX2__
+// Weights of 8 samples, see WeightTable. Table lookups gather the entries of the 8 samples.
+static inline __m256 weights256(const WeightTable &weightTable, const __m256 s)
+{
+  const WeightMode mode = weightTable.Mode();
+  if(mode == WeightMode::Exact)
+  {
+    return _mm256_mul_ps(
+        _mm256_set1_ps(weightTable.Coeff()),
+        exp256_ps(_mm256_mul_ps(_mm256_mul_ps(s, s), _mm256_set1_ps(-weightTable.TsdfFact()))));
+  }
+
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 x = _mm256_min_ps(
+      _mm256_mul_ps(_mm256_and_ps(s, absMask), _mm256_set1_ps(weightTable.Scale())),
+      _mm256_set1_ps(float(weightTable.Resolution())));
+  const float *values = weightTable.Values();
+  if(mode == WeightMode::Nearest)
+  {
+    const __m256i i = _mm256_cvttps_epi32(_mm256_add_ps(x, _mm256_set1_ps(0.5f)));
+    return _mm256_i32gather_ps(values, i, 4);
+  }
+
+  const __m256i i = _mm256_cvttps_epi32(x);
+  const __m256 t = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+  const __m256 v0 = _mm256_i32gather_ps(values, i, 4);
+  const __m256 v1 = _mm256_i32gather_ps(values + 1, i, 4);
+  return _mm256_fmadd_ps(t, _mm256_sub_ps(v1, v0), v0);
+}
+#endif
+
+// Merges n consecutive voxels with one sample each. Weights are computed from the sample TSDF
+// by weightTable, in its mode, and scaled by sampleMask (0 leaves the voxel untouched, 1
+// integrates it). The AVX2 path processes 8 voxels per iteration, the scalar path is used for the
+// remainder and when AVX2 is not enabled at build time.
+static inline void integrateVoxels(
+    float *__restrict__ tsdf, float *__restrict__ weights, Color3f *__restrict__ colors,
+    const float *__restrict__ sampleTsdf, const Color3f *__restrict__ sampleRgb,
+    const float *__restrict__ sampleMask, const size_t n, const WeightTable &weightTable)
+{
+  size_t i = 0;
+
+#ifdef __AVX2__
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+
+  // Expand 8 per voxel factors to the 24 interleaved color channels
+  const __m256i expand0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  const __m256i expand1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  const __m256i expand2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+  for(; i + 8 <= n; i += 8)
+  {
+    const __m256 s = _mm256_loadu_ps(sampleTsdf + i);
+    const __m256 w = _mm256_mul_ps(_mm256_loadu_ps(sampleMask + i), weights256(weightTable, s));
+    const __m256 valid = _mm256_cmp_ps(w, zero, _CMP_GT_OQ);
+
+    const __m256 oldW = _mm256_loadu_ps(weights + i);
+    const __m256 sumW = _mm256_add_ps(oldW, w);
+    const __m256 invSumW = _mm256_div_ps(one, _mm256_blendv_ps(one, sumW, valid));
+    const __m256 a = _mm256_blendv_ps(one, _mm256_mul_ps(oldW, invSumW), valid);
+    const __m256 b = _mm256_mul_ps(w, invSumW);
+
+    const __m256 oldTsdf = _mm256_loadu_ps(tsdf + i);
+    _mm256_storeu_ps(tsdf + i, _mm256_fmadd_ps(a, oldTsdf, _mm256_mul_ps(b, s)));
+    _mm256_storeu_ps(weights + i, sumW);
+
+    float *c = reinterpret_cast<float *>(colors + i);
+    const float *sc = reinterpret_cast<const float *>(sampleRgb + i);
+    const __m256 a0 = _mm256_permutevar8x32_ps(a, expand0);
+    const __m256 a1 = _mm256_permutevar8x32_ps(a, expand1);
+    const __m256 a2 = _mm256_permutevar8x32_ps(a, expand2);
+    const __m256 b0 = _mm256_permutevar8x32_ps(b, expand0);
+    const __m256 b1 = _mm256_permutevar8x32_ps(b, expand1);
+    const __m256 b2 = _mm256_permutevar8x32_ps(b, expand2);
+    _mm256_storeu_ps(
+        c, _mm256_fmadd_ps(a0, _mm256_loadu_ps(c), _mm256_mul_ps(b0, _mm256_loadu_ps(sc))));
+    _mm256_storeu_ps(
+        c + 8,
+        _mm256_fmadd_ps(a1, _mm256_loadu_ps(c + 8), _mm256_mul_ps(b1, _mm256_loadu_ps(sc + 8))));
+    _mm256_storeu_ps(
+        c + 16,
+        _mm256_fmadd_ps(
+            a2, _mm256_loadu_ps(c + 16), _mm256_mul_ps(b2, _mm256_loadu_ps(sc + 16))));
+  }
+#endif
+
+  for(; i < n; i++)
+  {
+    if(sampleMask[i] == 0.0f)
+    {
+      continue;
+    }
+
+    const float s = sampleTsdf[i];
+    const float w = sampleMask[i] * weightTable(s);
+    const float invSumW = 1.0f / (weights[i] + w);
+    const float a = weights[i] * invSumW;
+    const float b = w * invSumW;
+
+    tsdf[i] = a * tsdf[i] + b * s;
+    colors[i] = a * colors[i] + b * sampleRgb[i];
+    weights[i] += w;
+  }
+}
+} // namespace fusion
+} // namespace spf
@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "spf/Types.hpp"
+
+namespace spf
+{
+namespace fusion
+{
+enum class FrameDecision
+{
+  Integrate, // All the rays of the frame are integrated
+  Subsample, // Only a subset of the rays is integrated (full integration in projective mode)
+  Skip       // The frame is not integrated
+};
+
+static inline const char *FrameDecisionName(const FrameDecision decision)
+{
+  switch(decision)
+  {
+    case FrameDecision::Subsample:
+      return "subsample";
+    case FrameDecision::Skip:
+      return "skip";
+    default:
+      return "integrate";
+  }
+}
+
+// Thresholds of the keyframe gate. A frame is fully integrated when its motion or depth change
+// since the last fully integrated frame is above one of the integrate thresholds. Otherwise it is
+// subsampled when its change since the last integrated or subsampled frame is above one of the
+// subsample thresholds, and skipped if not.
+struct KeyframeGateParams
+{
+  float subsampleTranslation = 0.005f; // Camera translation (m)
+  float integrateTranslation = 0.02f;
+  float subsampleRotation = 0.01f; // Camera rotation angle (rad)
+  float integrateRotation = 0.035f;
+  float subsampleDepthChange = 0.02f; // Fraction of the sampled pixels whose depth changed
+  float integrateDepthChange = 0.1f;
+  float depthTolerance = 0.02f; // Relative difference above which a pixel depth has changed
+  size_t pixelStep = 8;         // Pixel grid on which depth maps are compared
+  size_t subsampleStride = 2;
+};
+
+// Decides whether a frame brings enough new information to be integrated, from its pose and a
+// sparse sample of its depth map.
+class KeyframeGate
+{
+public:
+  KeyframeGate() = default;
+
+  inline void SetParams(const KeyframeGateParams &params)
+  {
+    params_ = params;
+    params_.pixelStep = std::max(params_.pixelStep, size_t(1));
+    params_.subsampleStride = std::max(params_.subsampleStride, size_t(1));
+    Reset();
+  }
+  inline const KeyframeGateParams &Params() const { return params_; }
+
+  inline void Reset()
+  {
+    keyframe_.valid = false;
+    lastFrame_.valid = false;
+    std::fill(counts_, counts_ + 3, 0);
+  }
+
+  template <typename DepthType>
+  FrameDecision Decide(
+      const DepthType *depth, const size_t width, const size_t height, const Mat4f &transform)
+  {
+    FrameDecision decision = FrameDecision::Integrate;
+    if(keyframe_.Matches(width, height))
+    {
+      Measure(keyframe_, depth, transform);
+      if(translation_ <= params_.integrateTranslation && rotation_ <= params_.integrateRotation
+         && depthChange_ <= params_.integrateDepthChange)
+      {
+        float translation = 0.0f, rotation = 0.0f, depthChange = 0.0f;
+        Measure(lastFrame_, depth, transform, &translation, &rotation, &depthChange);
+        decision = translation > params_.subsampleTranslation
+                           || rotation > params_.subsampleRotation
+                           || depthChange > params_.subsampleDepthChange
+                       ? FrameDecision::Subsample
+                       : FrameDecision::Skip;
+      }
+    }
+    else
+    {
+      translation_ = 0.0f;
+      rotation_ = 0.0f;
+      depthChange_ = 0.0f;
+    }
+
+    if(decision != FrameDecision::Skip)
+    {
+      lastFrame_.Set(depth, width, height, params_.pixelStep, transform);
+    }
+    if(decision == FrameDecision::Integrate)
+    {
+      keyframe_.Set(depth, width, height, params_.pixelStep, transform);
+    }
+    counts_[int(decision)]++;
+    return decision;
+  }
+
+  // Motion and depth change of the last frame passed to Decide, relative to the last fully
+  // integrated frame
+  inline float Translation() const { return translation_; }
+  inline float Rotation() const { return rotation_; }
+  inline float DepthChange() const { return depthChange_; }
+
+  inline size_t Count(const FrameDecision decision) const { return counts_[int(decision)]; }
+
+private:
+  struct Reference
+  {
+    bool valid = false;
+    size_t width = 0;
+    size_t height = 0;
+    Mat4f pose;
+    std::vector<float> depth;
+
+    inline bool Matches(const size_t w, const size_t h) const
+    {
+      return valid && w == width && h == height;
+    }
+
+    template <typename DepthType>
+    void Set(
+        const DepthType *depthMap, const size_t w, const size_t h, const size_t step,
+        const Mat4f &transform)
+    {
+      depth.clear();
+      for(size_t v = step / 2; v < h; v += step)
+      {
+        for(size_t u = step / 2; u < w; u += step)
+        {
+          depth.push_back(float(depthMap[v * w + u]));
+        }
+      }
+      width = w;
+      height = h;
+      pose = transform;
+      valid = true;
+    }
+  };
+
+  KeyframeGateParams params_;
+  Reference keyframe_;
+  Reference lastFrame_;
+
+  float translation_ = 0.0f;
+  float rotation_ = 0.0f;
+  float depthChange_ = 0.0f;
+  size_t counts_[3] = {0, 0, 0};
+
+  template <typename DepthType>
+  inline void Measure(const Reference &ref, const DepthType *depth, const Mat4f &transform)
+  {
+    Measure(ref, depth, transform, &translation_, &rotation_, &depthChange_);
+  }
+
+  // Camera motion and fraction of the sampled pixels that became valid / invalid or whose depth
+  // changed by more than depthTolerance since the reference
+  template <typename DepthType>
+  void Measure(
+      const Reference &ref, const DepthType *depth, const Mat4f &transform, float *translation,
+      float *rotation, float *depthChange) const
+  {
+    const Mat4f &pose = ref.pose;
+    *translation = Vec3f::Dist(
+        Vec3f(transform.c03, transform.c13, transform.c23), Vec3f(pose.c03, pose.c13, pose.c23));
+
+    // trace(Rref^T R) = 1 + 2 cos(theta)
+    const float trace = pose.c00 * transform.c00 + pose.c01 * transform.c01
+                        + pose.c02 * transform.c02 + pose.c10 * transform.c10
+                        + pose.c11 * transform.c11 + pose.c12 * transform.c12
+                        + pose.c20 * transform.c20 + pose.c21 * transform.c21
+                        + pose.c22 * transform.c22;
+    *rotation = acosf(std::clamp(0.5f * (trace - 1.0f), -1.0f, 1.0f));
+
+    const size_t step = params_.pixelStep;
+    size_t numChanged = 0;
+    size_t index = 0;
+    for(size_t v = step / 2; v < ref.height; v += step)
+    {
+      for(size_t u = step / 2; u < ref.width; u += step)
+      {
+        const float d = float(depth[v * ref.width + u]);
+        const float refDepth = ref.depth[index++];
+        if((d > 0.0f) != (refDepth > 0.0f)
+           || fabsf(d - refDepth) > params_.depthTolerance * refDepth)
+        {
+          numChanged++;
+        }
+      }
+    }
+    *depthChange = index > 0 ? float(numChanged) / float(index) : 0.0f;
+  }
+};
+} // namespace fusion
+} // namespace spf
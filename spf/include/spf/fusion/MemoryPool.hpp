@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+#include "spf/fusion/BlockUtils.hpp"
+
+namespace spf
+{
+namespace fusion
+{
+static constexpr size_t cacheLineSize = 64;
+static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+
+struct AlignedDeleter
+{
+  inline void operator()(void* ptr) const { free(ptr); }
+};
+
+using AlignedPtr = std::unique_ptr<char[], AlignedDeleter>;
+
+// size is rounded up to a multiple of alignment, as required by aligned_alloc
+static inline AlignedPtr AlignedAlloc(const size_t size, const size_t alignment = cacheLineSize)
+{
+  const size_t alignedSize = (size + alignment - 1) / alignment * alignment;
+  char* ptr = static_cast<char*>(aligned_alloc(alignment, alignedSize));
+  if(ptr == nullptr)
+  {
+    throw std::bad_alloc();
+  }
+  return AlignedPtr(ptr);
+}
+
+// Stack of free indices, grows when pushing on a full stack
+class IndexStack
+{
+public:
+  IndexStack(const size_t size = 0) : capacity_{size}, indices_{new size_t[size]} {}
+
+  inline size_t Pop() { return indices_[--top_]; }
+  inline void Push(const size_t i)
+  {
+    if(Full())
+    {
+      Realloc(std::max(2 * capacity_, size_t(16)));
+    }
+    indices_[top_++] = i;
+  }
+
+  inline size_t Top() const { return top_; }
+  inline size_t Capacity() const { return capacity_; }
+  inline bool Full() const { return top_ == capacity_; }
+  inline bool Empty() const { return top_ == 0; }
+
+  inline void Clear() { top_ = 0; }
+
+  inline void Realloc(const size_t newSize)
+  {
+    std::unique_ptr<size_t[]> newData(new size_t[newSize]);
+    top_ = std::min(top_, newSize);
+    memcpy(newData.get(), indices_.get(), top_ * sizeof(size_t));
+    std::swap(newData, indices_);
+    capacity_ = newSize;
+  }
+
+private:
+  size_t top_{0};
+  size_t capacity_{0};
+  std::unique_ptr<size_t[]> indices_;
+};
+
+// Slab allocator of fixed size chunks. Chunks are allocated by slabs of N and start on a cache
+// line, released chunks are recycled through a free list and slabs are only freed with the pool.
+// A chunk index stays valid until the chunk is removed : chunk i lives in slab i / N.
+// Slabs can be backed by transparent huge pages, which cuts the TLB misses of the random block
+// accesses of the integration.
+template <size_t N = 64>
+class MemoryPool
+{
+  static_assert((N & (N - 1)) == 0, "N must be a power of 2");
+
+public:
+  MemoryPool(const size_t chunkSize, const bool useHugePages = false) :
+      chunkSize_{(chunkSize + cacheLineSize - 1) / cacheLineSize * cacheLineSize},
+      useHugePages_{useHugePages}
+  {
+    chunkList_.reserve(32);
+  }
+  ~MemoryPool(){};
+  MemoryPool(const MemoryPool& cp) = delete;
+  MemoryPool(MemoryPool&& cp) noexcept = default;
+  MemoryPool& operator=(const MemoryPool& cp) = delete;
+  MemoryPool& operator=(MemoryPool&& cp) noexcept = default;
+
+  inline char* operator[](const size_t i) noexcept
+  {
+    return chunkList_[i >> shift].get() + (i & bitMask) * chunkSize_;
+  }
+  inline const char* operator[](const size_t i) const noexcept
+  {
+    return chunkList_[i >> shift].get() + (i & bitMask) * chunkSize_;
+  }
+
+  // Returns the index of a free chunk, its content is undefined
+  size_t AddChunk()
+  {
+    if(freeChunks_.Empty())
+    {
+      AllocateNewPool();
+    }
+    numChunks_++;
+    return freeChunks_.Pop();
+  }
+  void RemoveChunk(const size_t index)
+  {
+    freeChunks_.Push(index);
+    numChunks_--;
+  }
+
+  // Applies to the slabs allocated afterwards
+  inline void UseHugePages(const bool useHugePages) { useHugePages_ = useHugePages; }
+
+  inline size_t ChunkSize() const { return chunkSize_; }
+  inline size_t NumChunks() const { return numChunks_; }
+  inline size_t Capacity() const { return N * chunkList_.size(); }
+  inline size_t NumSlabs() const { return chunkList_.size(); }
+
+private:
+  static constexpr size_t shift = getShift<N / 2>();
+  static constexpr size_t bitMask = ~((~0UL) << shift);
+
+  size_t chunkSize_;
+  bool useHugePages_;
+  size_t numChunks_{0};
+
+  std::vector<AlignedPtr> chunkList_;
+  IndexStack freeChunks_;
+
+  void AllocateNewPool()
+  {
+    const size_t slabSize = chunkSize_ * N;
+    if(useHugePages_)
+    {
+      chunkList_.emplace_back(AlignedAlloc(slabSize, hugePageSize));
+#ifdef MADV_HUGEPAGE
+      madvise(
+          chunkList_.back().get(), (slabSize + hugePageSize - 1) / hugePageSize * hugePageSize,
+          MADV_HUGEPAGE);
+#endif
+    }
+    else
+    {
+      chunkList_.emplace_back(AlignedAlloc(slabSize));
+    }
+
+    // Chunks are handed out in address order
+    const size_t first = N * (chunkList_.size() - 1);
+    freeChunks_.Realloc(std::max(freeChunks_.Capacity(), N * chunkList_.size()));
+    for(size_t i = first + N; i > first; i--)
+    {
+      freeChunks_.Push(i - 1);
+    }
+  }
+};
+} // namespace fusion
+} // namespace spf
@@ -18,14 +18,20 @@
 #pragma once
 
 #include <vector>
-#include <set>
 #include <memory>
-#include <unordered_map>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include <string>
 
 #include "spf/utils.hpp"
 #include "spf/Types.hpp"
 #include "spf/data_types/Mesh.hpp"
 #include "spf/fusion/BlockUtils.hpp"
+#include "spf/fusion/BlockMap.hpp"
+#include "spf/fusion/DenseBlockMap.hpp"
+#include "spf/fusion/BlockStore.hpp"
+#include "spf/fusion/MemoryPool.hpp"
 #include "spf/fusion/VoxelBlock.hpp"
 #include "spf/marching_cubes/MarchingCubes.hpp"
 
@@ -36,30 +42,166 @@ namespace fusion
 using namespace data_types;
 
 using BlockIdList = std::vector<BlockId>;
-using BlockIdMap = std::unordered_map<BlockId, int, ChunkHasher>;
+using BlockIdMap = BlockMap<int>;
 using BlockList = std::vector<std::unique_ptr<VoxelBlock>>;
 using MeshList = std::vector<std::unique_ptr<data_types::Mesh<data_types::PointXYZRGBN<float>>>>;
-using BlockUpdateList = std::set<BlockId>;
 
+// Index of the blocks of a volume : a BlockMap, or a DenseBlockMap covering the bounds given at
+// construction when they are not empty. Ids outside of the bounds, or out of the range of
+// ValidBlockId for the BlockMap, are never inserted. Only the map in use is allocated.
+class BlockIndex
+{
+public:
+  BlockIndex(const BlockBounds &bounds = BlockBounds())
+  {
+    if(bounds.Empty())
+    {
+      hashed_.reset(new BlockMap<int>());
+    }
+    else
+    {
+      dense_.reset(new DenseBlockMap<int>(bounds));
+    }
+  }
+
+  inline bool IsDense() const { return dense_ != nullptr; }
+
+  inline bool InBounds(const BlockId &blockId) const
+  {
+    return dense_ != nullptr ? dense_->InBounds(blockId) : ValidBlockId(blockId);
+  }
+
+  inline bool Find(const BlockId &blockId, int &value) const
+  {
+    return dense_ != nullptr ? dense_->Find(blockId, value)
+                             : ValidBlockId(blockId) && hashed_->Find(blockId, value);
+  }
+
+  inline bool Contains(const BlockId &blockId) const
+  {
+    return dense_ != nullptr ? dense_->Contains(blockId)
+                             : ValidBlockId(blockId) && hashed_->Contains(blockId);
+  }
+
+  inline bool Insert(const BlockId &blockId, const int value)
+  {
+    return dense_ != nullptr ? dense_->Insert(blockId, value) : hashed_->Insert(blockId, value);
+  }
+
+  inline bool Erase(const BlockId &blockId)
+  {
+    return dense_ != nullptr ? dense_->Erase(blockId) : hashed_->Erase(blockId);
+  }
+
+  inline void ReleaseOldTables()
+  {
+    if(dense_ == nullptr)
+    {
+      hashed_->ReleaseOldTables();
+    }
+  }
+
+  template <typename Func>
+  inline void ForEach(Func &&func) const
+  {
+    if(dense_ != nullptr)
+    {
+      dense_->ForEach(func);
+      return;
+    }
+    hashed_->ForEach(func);
+  }
+
+  inline size_t Size() const { return dense_ != nullptr ? dense_->Size() : hashed_->Size(); }
+
+private:
+  std::unique_ptr<BlockMap<int>> hashed_;
+  std::unique_ptr<DenseBlockMap<int>> dense_;
+};
+
+// List of blocks found by one thread. A small direct mapped filter drops ids that were added
+// recently, which removes most of the duplicates coming from neighbouring rays before sorting.
+// Ids out of the range of ValidBlockId are dropped.
+class BlockUpdateList
+{
+public:
+  BlockUpdateList() : recentIds_(filterSize_, BlockId(std::numeric_limits<int>::max())) {}
+
+  inline void Add(const BlockId &blockId)
+  {
+    if(!ValidBlockId(blockId))
+    {
+      return;
+    }
+    BlockId &recent = recentIds_[ChunkHasher()(blockId) & (filterSize_ - 1)];
+    if(recent == blockId)
+    {
+      return;
+    }
+    recent = blockId;
+    ids_.push_back(blockId);
+  }
+
+  inline void Clear()
+  {
+    ids_.clear();
+    std::fill(recentIds_.begin(), recentIds_.end(), BlockId(std::numeric_limits<int>::max()));
+  }
+
+  inline void SortUnique() { SortBlockIds(ids_); }
+
+  inline const BlockIdList &Ids() const { return ids_; }
+  inline size_t Size() const { return ids_.size(); }
+
+private:
+  static constexpr size_t filterSize_ = 256;
+  BlockIdList ids_;
+  BlockIdList recentIds_;
+};
+
+// Voxels of the blocks are allocated from a MemoryPool. Removed blocks give their voxels and
+// their index back, both are reused by the next blocks added. Blocks in memory are linked to their
+// 26 neighbours, see VoxelBlock::Neighbour. The halos of float blocks follow the voxels of their
+// neighbours : integration pushes the border voxels it updates, and the halos are synchronized
+// when blocks are linked, unlinked or reloaded.
+// Blocks are indexed by a hash map, or for bounded scenes by a dense grid covering the bounds given
+// at construction, see BlockIndex. The blocks outside of the bounds are then never added.
+// With a memory budget, blocks are spilled to a BlockStore on disk with their meshes when the
+// voxel memory goes above it, and reloaded when they are added again. Meshes of the spilled blocks
+// are part of the exported mesh, but are not returned by GetMesh.
 class Volume
 {
-  // TODO : support voxel block suppression
 public:
   using MeshType = data_types::Mesh<data_types::PointXYZRGBN<float>>;
   using MeshPtrType = std::unique_ptr<MeshType>;
   using BlockPtrType = std::unique_ptr<VoxelBlock>;
+  using PoolType = MemoryPool<64>;
 
-  Volume(const float voxelRes);
+  // The blocks are indexed by a dense grid when bounds are not empty
+  Volume(const float voxelRes, const BlockBounds &bounds = BlockBounds());
 
+  // Both functions reload the blocks that were spilled and return the number of new blocks. The
+  // blocks are marked as used by the current frame, they are not evicted until it advances.
+  // The tables left by the growth of the block index are freed, so no lookup may run meanwhile.
   bool AddBlock(const BlockId &blockId);
 
   size_t AddBlocks(const BlockIdList &blockIds);
 
-  // void RemoveBlock(const BlockId &blockId);
+  // Reloads the spilled blocks of the list, without allocating the others. The blocks of the list
+  // are marked as used by the current frame.
+  size_t LoadBlocks(const BlockIdList &blockIds);
+
+  bool RemoveBlock(const BlockId &blockId);
+
+  size_t RemoveBlocks(const BlockIdList &blockIds);
+
+  // Removes the blocks in memory without any observed voxel, see VoxelBlock::IsEmpty, and returns
+  // their number. Blocks used by the current frame are kept if keepCurrentFrame is set.
+  size_t CollectEmptyBlocks(const bool keepCurrentFrame);
 
-  // void RemoveBlocks(const BlockId &blockIds);
+  inline bool Find(const BlockId &blockId) const { return blockIds_.Contains(blockId); }
 
-  inline bool Find(const BlockId &blockId) { return blockIds_.find(blockId) != blockIds_.end(); }
+  inline bool IsDense() const { return blockIds_.IsDense(); }
 
   MeshType *GetMesh(const BlockId &blockId);
 
@@ -69,14 +211,75 @@ public:
 
   inline BlockList &GetVoxelBlocks() { return voxelBlocks_; }
 
-  inline size_t NumBlocks() const { return blockIds_.size(); }
+  // Blocks in memory, spilled blocks are not counted
+  inline size_t NumBlocks() const { return blockIds_.Size(); }
 
   inline float VoxelRes() const { return voxelRes_; }
 
+  // Number of threads used by the parallel sections of the volume, see Fusion::SetNumThreads
+  inline void SetNumThreads(const size_t numThreads) { numThreads_ = numThreads; }
+  inline size_t GetNumThreads() const { return numThreads_; }
+
+  // Storage of the voxels, existing blocks are converted
+  void SetVoxelStorage(
+      const VoxelStorage storage, const VoxelQuantization &quantization = VoxelQuantization());
+  inline VoxelStorage GetVoxelStorage() const { return storage_; }
+
+  // Bytes used by the voxels of one block, of all the blocks, and reserved by the pool
+  inline size_t BlockMemory() const { return pool_.ChunkSize(); }
+  inline size_t VoxelMemory() const { return pool_.NumChunks() * pool_.ChunkSize(); }
+  inline size_t ReservedMemory() const { return pool_.Capacity() * pool_.ChunkSize(); }
+
+  // Backs the voxel slabs allocated afterwards by transparent huge pages
+  inline void UseHugePages(const bool useHugePages)
+  {
+    useHugePages_ = useHugePages;
+    pool_.UseHugePages(useHugePages);
+  }
+
+  // Budget of the voxel memory in bytes, 0 disables the eviction. spillDir is created if needed,
+  // it cannot change while blocks are spilled.
+  bool SetMemoryBudget(const size_t memoryBudget, const std::string &spillDir);
+  inline size_t MemoryBudget() const { return memoryBudget_; }
+
+  inline size_t NumSpilledBlocks() const { return store_.Size(); }
+
+  // Spills blocks until the voxel memory is below 7/8 of the budget, if it is above the budget.
+  // Blocks used by the current frame are kept. The others are evicted from the least recently
+  // used, and from the farthest from center among the blocks last used by the same frame. Empty
+  // blocks are removed instead of being written.
+  size_t EvictBlocks(const Point3f &center);
+
+  // Starts a new frame for the eviction, called once per integrated frame before adding its blocks
+  inline void AdvanceFrame(const size_t numFrames = 1) { currentFrame_ += numFrames; }
+
+  // Hit / miss counters accumulated by the BlockCache instances reading this volume
+  inline void AddCacheStats(const size_t hits, const size_t misses)
+  {
+    cacheHits_ += hits;
+    cacheMisses_ += misses;
+  }
+  inline size_t CacheHits() const { return cacheHits_; }
+  inline size_t CacheMisses() const { return cacheMisses_; }
+  inline float CacheHitRate() const
+  {
+    const size_t total = cacheHits_ + cacheMisses_;
+    return total > 0 ? float(cacheHits_) / float(total) : 0.0f;
+  }
+  inline void ResetCacheStats()
+  {
+    cacheHits_ = 0;
+    cacheMisses_ = 0;
+  }
+
+  // Ids of the blocks in memory
   BlockIdList GetAllIds() const;
 
   void RecomputeMeshes(const BlockIdList &blockList);
 
+  // Recomputes the meshes of all the blocks, spilled ones included, and clears their dirty flags.
+  // Spilled blocks are meshed by batches of neighbouring blocks, which are reloaded with the blocks
+  // they read and spilled again as needed to stay within the memory budget.
   void RecomputeAllMeshes();
 
   void ExportMeshes(const char *filename);
@@ -88,15 +291,116 @@ public:
   void ClearData();
 
 private:
-  static constexpr size_t maxMeshSize_ = 2 * BlockProperties<float, 16>::blockVolume;
-  size_t nextBlockIndex_;
+  // Marching cubes emits at most 5 triangles per cube, a block and its +x / +y / +z faces hold
+  // blockVolume cubes
+  static constexpr size_t maxMeshSize_ = 5 * BlockProperties<float>::blockVolume;
   float voxelRes_;
+  VoxelStorage storage_ = VoxelStorage::Float;
+  VoxelQuantization quantization_;
+  bool useHugePages_ = false;
+  size_t memoryBudget_ = 0;
+  size_t numThreads_;
 
-  BlockIdMap blockIds_;
+  // Declared before the blocks, which point to its chunks
+  PoolType pool_;
+
+  // Blocks, meshes and voxel chunks are stored at the index given by blockIds_
+  BlockIndex blockIds_;
   BlockList voxelBlocks_;
   MeshList meshes_;
+  std::vector<size_t> blockChunks_;
+  IndexStack freeIndices_;
+
+  // Frame that last used each block, see AdvanceFrame
+  std::vector<size_t> lastUse_;
+  // Set when the file of a reloaded block is up to date, its voxels are then not written again
+  // when it is evicted, unless it is dirty
+  std::vector<uint8_t> stored_;
+  size_t currentFrame_ = 0;
+
+  BlockStore store_;
+
+  std::atomic<size_t> cacheHits_{0};
+  std::atomic<size_t> cacheMisses_{0};
+
+  // Per thread buffers of the mesh extraction
+  struct MeshWorkspace
+  {
+    static constexpr size_t tsdfDim = BlockProperties<float>::blockSize + 3;
+
+    MeshType mesh{3 * maxMeshSize_, maxMeshSize_};
+    std::vector<float> tsdf = std::vector<float>(tsdfDim * tsdfDim * tsdfDim);
+    const float *colors[8];
+    const uint8_t *compactColors[8];
+  };
+
+  void AllocateBlock(const BlockId &blockId);
+
+  // Links a block with its neighbours in memory, both ways, and synchronizes their halos
+  void LinkBlock(const BlockId &blockId, VoxelBlock &block);
+
+  // Clears the links and the halos of the neighbours of a block before its removal
+  void UnlinkBlock(VoxelBlock &block);
+
+  // Copies the voxels of the neighbours to the halo of a block, and its voxels to their halos, see
+  // VoxelBlock::PaddedDim. Needed whenever the voxels of a block are written as a whole.
+  void SyncHalos(VoxelBlock &block);
+
+  void ReloadBlocks(const BlockIdList &blockIds);
+
+  void ComputeMeshes(const BlockIdList &blockList);
+
+  // Gathers the colors read by the mesh extraction of a block, see mc::extractMesh
+  void GatherColors(const VoxelBlock &block, MeshWorkspace &workspace);
+
+  // Packs the TSDF of a block without halo and of its neighbours, see mc::extractMesh
+  void PackTSDF(const VoxelBlock &block, MeshWorkspace &workspace);
+
+  size_t ComputeMesh(const BlockId &blockId, MeshWorkspace &workspace);
+};
+
+// Direct mapped cache of the last blocks looked up in a volume. It is meant to be created by each
+// thread at the beginning of a parallel region : lookups are not synchronized, and a cached
+// nullptr is not refreshed if the block is added afterwards.
+class BlockCache
+{
+public:
+  BlockCache(Volume &volume) : volume_(volume) {}
+
+  ~BlockCache() { volume_.AddCacheStats(hits_, misses_); }
+
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
+
+  inline VoxelBlock *GetBlock(const BlockId &blockId)
+  {
+    Entry &entry = entries_[ChunkHasher()(blockId) & (cacheSize_ - 1)];
+    if(entry.id == blockId)
+    {
+      hits_++;
+      return entry.block;
+    }
+    misses_++;
+    entry.id = blockId;
+    entry.block = volume_.GetBlock(blockId);
+    return entry.block;
+  }
+
+  inline size_t Hits() const { return hits_; }
+  inline size_t Misses() const { return misses_; }
+
+private:
+  struct Entry
+  {
+    BlockId id{std::numeric_limits<int>::max()};
+    VoxelBlock *block = nullptr;
+  };
 
-  size_t ComputeMesh(const BlockId &blockId, MeshType &tmp);
+  static constexpr size_t cacheSize_ = 64;
+  Volume &volume_;
+  Entry entries_[cacheSize_];
+  size_t hits_ = 0;
+  size_t misses_ = 0;
 };
 } // namespace fusion
 } // namespace spf
@@ -20,13 +20,18 @@
 #include <cstdlib>
 #include <cstring>
 #include <cfloat>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include <map>
 #include <memory>
+#include <atomic>
 
 #include "spf/Types.hpp"
 #include "spf/data_types/PointCloud.hpp"
 #include "spf/data_types/Mesh.hpp"
 #include "spf/fusion/BlockUtils.hpp"
+#include "spf/fusion/MemoryPool.hpp"
 
 namespace spf
 {
@@ -34,61 +39,343 @@ namespace fusion
 {
 using namespace data_types;
 
+enum class VoxelStorage
+{
+  Float,  // float TSDF, float weight and float RGB : 20 bytes per voxel
+  Compact // int16 TSDF, saturating uint16 weight and RGB8 : 7 bytes per voxel
+};
+
+// Scales of the compact storage
+struct VoxelQuantization
+{
+  float tsdfRange = 1.0f;  // TSDF values in [-tsdfRange, tsdfRange] map to [-32767, 32767]
+  float weightUnit = 1.0f; // Weight of one step of the uint16 weights
+};
+
+// Voxels of a block. They live in a single buffer of VoxelBytes(storage, useColor) bytes starting
+// on a cache line, either a chunk given by the caller (e.g. from a MemoryPool), which must outlive
+// the block, or a buffer owned by the block when data is nullptr.
 class VoxelBlock
 {
 public:
-  VoxelBlock(const float voxelRes, const bool useColor = true);
+  VoxelBlock(
+      const float voxelRes, const bool useColor = true,
+      const VoxelStorage storage = VoxelStorage::Float,
+      const VoxelQuantization& quantization = VoxelQuantization(), void* data = nullptr);
 
   ~VoxelBlock(){};
 
+  VoxelBlock(const VoxelBlock&) = delete;
+  VoxelBlock& operator=(const VoxelBlock&) = delete;
+
   void Clear();
 
+  // True when no voxel has been observed, i.e. no voxel has a positive weight and a valid TSDF.
+  // Such a block can be removed without changing any mesh.
+  bool IsEmpty() const;
+
+  inline float VoxelRes() const { return voxelRes_; }
   inline bool UseColor() const { return useColor_; }
-  inline float* TSDF() const { return tsdf_.get(); }
-  inline float* Weights() const { return weights_.get(); }
-  inline Color3f* Colors() const { return colors_.get(); }
-  inline Vec3f* Gradients() const { return gradients_.get(); }
+  inline VoxelStorage Storage() const { return storage_; }
+  inline const VoxelQuantization& Quantization() const { return quantization_; }
+
+  // Buffer of the voxels, VoxelBytes(Storage(), UseColor()) bytes
+  inline void* Data() const
+  {
+    return storage_ == VoxelStorage::Float ? static_cast<void*>(tsdf_)
+                                           : static_cast<void*>(compactTsdf_);
+  }
+
+  // Float storage, nullptr with the compact storage. The TSDF is indexed by PaddedOffset, weights
+  // and colors by VoxelIndex.
+  inline float* TSDF() const { return tsdf_; }
+  inline float* Weights() const { return weights_; }
+  inline Color3f* Colors() const { return colors_; }
+
+  // Compact storage, nullptr with the float storage, indexed by VoxelIndex. Colors have 3 channels
+  // per voxel.
+  inline int16_t* CompactTSDF() const { return compactTsdf_; }
+  inline uint16_t* CompactWeights() const { return compactWeights_; }
+  inline uint8_t* CompactColors() const { return compactColors_; }
+
+  inline float TSDFAt(const Index3d& index) const { return DecodeTsdf(Offset(index)); }
+
+  inline float WeightAt(const Index3d& index) const { return DecodeWeight(Offset(index)); }
+
+  inline Color3f ColorAt(const Index3d& index) const { return DecodeColor(Offset(index)); }
+
+  // Merges one sample into a voxel, whatever the storage
+  inline void Integrate(
+      const size_t offset, const float tsdf, const float weight, const Color3f& rgb)
+  {
+    if(storage_ == VoxelStorage::Float)
+    {
+      const size_t index = VoxelIndex(offset);
+      const float weightSum = weight + weights_[index];
+      float& voxelTsdf = tsdf_[PaddedOffset(offset)];
+      voxelTsdf = (weights_[index] * voxelTsdf + weight * tsdf) / weightSum;
+      if(useColor_)
+      {
+        colors_[index] = (weights_[index] * colors_[index] + weight * rgb) / weightSum;
+      }
+      weights_[index] += weight;
+      PushHalo(offset);
+      return;
+    }
+
+    const float oldWeight = DecodeWeight(offset);
+    const float weightSum = weight + oldWeight;
+    EncodeTsdf(offset, (oldWeight * DecodeTsdf(offset) + weight * tsdf) / weightSum);
+    if(useColor_)
+    {
+      EncodeColor(offset, (oldWeight * DecodeColor(offset) + weight * rgb) / weightSum);
+    }
+    EncodeWeight(offset, weightSum);
+  }
+
+  // Copy n TSDF values starting at offset to a float array, whatever the storage
+  inline void ReadTSDF(const size_t offset, const size_t n, float* tsdf) const
+  {
+    if(storage_ == VoxelStorage::Float)
+    {
+      for(size_t i = 0; i < n;)
+      {
+        const size_t count = std::min(n - i, BlockSize() - ((offset + i) & (BlockSize() - 1)));
+        memcpy(tsdf + i, tsdf_ + PaddedOffset(offset + i), count * sizeof(float));
+        i += count;
+      }
+      return;
+    }
+    for(size_t i = 0; i < n; i++)
+    {
+      tsdf[i] = DecodeTsdf(offset + i);
+    }
+  }
+
+  // Copy n voxels starting at offset to / from float arrays, whatever the storage. colors is
+  // ignored when the block has no color. WriteVoxels does not update the halos of the neighbours,
+  // see PushHalos.
+  void ReadVoxels(
+      const size_t offset, const size_t n, float* tsdf, float* weights, Color3f* colors) const;
+  void WriteVoxels(
+      const size_t offset, const size_t n, const float* tsdf, const float* weights,
+      const Color3f* colors);
+
+  // Set when integration updates a voxel of the block, cleared once the meshes depending on it
+  // have been recomputed. Several threads may mark the same block.
+  inline void MarkDirty()
+  {
+    if(!dirty_.load(std::memory_order_relaxed))
+    {
+      dirty_.store(true, std::memory_order_relaxed);
+    }
+  }
+  inline bool Dirty() const { return dirty_.load(std::memory_order_relaxed); }
+  inline void ClearDirty() { dirty_.store(false, std::memory_order_relaxed); }
+
+  // Blocks around this one in the volume, nullptr when they are not in memory. Offsets are in
+  // [-1, 1] along each axis, the block itself is at (0, 0, 0). Links are kept up to date by the
+  // volume when blocks are added and removed.
+  inline VoxelBlock* Neighbour(const int dx, const int dy, const int dz) const
+  {
+    return neighbours_[NeighbourIndex(dx, dy, dz)];
+  }
+  inline VoxelBlock* Neighbour(const Index3d& offset) const
+  {
+    return neighbours_[NeighbourIndex(offset.x, offset.y, offset.z)];
+  }
+  inline void SetNeighbour(const Index3d& offset, VoxelBlock* block)
+  {
+    neighbours_[NeighbourIndex(offset.x, offset.y, offset.z)] = block;
+  }
+
+  static constexpr size_t BlockSize() { return BlockProperties<float>::blockSize; }
+  static constexpr size_t BlockVolume() { return BlockProperties<float>::blockVolume; }
+
+  // Float blocks store their TSDF in a PaddedDim()^3 array, laid out as the packed TSDF read by
+  // mc::extractMesh : a halo holds the voxels of the neighbours read by the mesh extraction of the
+  // block, one layer before it and two layers after it along each axis. Integration writes the
+  // border voxels of a block to the halos of its neighbours as it updates them, see PushHalo, and
+  // the volume fills the halos when blocks are linked, so that blocks are meshed in place.
+  static constexpr size_t PaddedDim() { return BlockSize() + 3; }
+
+  // Floats of the padded TSDF, rounded up to a cache line
+  static constexpr size_t PaddedVolume()
+  {
+    return (PaddedDim() * PaddedDim() * PaddedDim() + 15) / 16 * 16;
+  }
 
-  inline float TSDFAt(const Index3d& index) const
+  // Offset in the padded TSDF of the voxel at a given offset
+  static inline size_t PaddedOffset(const size_t offset)
   {
-    return tsdf_
-        [index.x + index.y * BlockProperties<float, 16>::blockSize
-         + index.z * BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize];
+    static constexpr size_t shift = BlockProperties<float>::blockShift;
+    static constexpr size_t mask = BlockSize() - 1;
+    static constexpr size_t dim = PaddedDim();
+    return (offset & mask) + 1 + (((offset >> shift) & mask) + 1) * dim
+           + ((offset >> (2 * shift)) + 1) * dim * dim;
   }
 
-  inline float WeightAt(const Index3d& index) const
+  // Index of the voxel at a given offset in the arrays laid out by VoxelLayout
+  static inline size_t VoxelIndex(const size_t offset)
   {
-    return weights_
-        [index.x + index.y * BlockProperties<float, 16>::blockSize
-         + index.z * BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize];
+    if constexpr(VoxelLayout::isLinear)
+    {
+      return offset;
+    }
+    else
+    {
+      static constexpr size_t shift = BlockProperties<float>::blockShift;
+      static constexpr size_t mask = BlockSize() - 1;
+      return VoxelLayout::Index(
+          offset & mask, (offset >> shift) & mask, offset >> (2 * shift), BlockSize());
+    }
   }
 
-  inline Vec3f GradientAt(const Index3d& index) const
+  inline bool HasHalo() const { return storage_ == VoxelStorage::Float; }
+
+  // Copies to the halo the voxels of the neighbour at offset, whose components are in [-1, 1] and
+  // not all 0, or marks them unobserved. Both do nothing without halo.
+  void CopyHalo(const VoxelBlock& neighbour, const Index3d& offset);
+  void ClearHalo(const Index3d& offset);
+
+  // Copies the TSDF of the voxel at offset to the halos of the linked neighbours holding it, if it
+  // lies on the border of the block. Integrate calls it for each sample, it has to be called after
+  // writing voxels through TSDF() or WriteVoxels. Each halo voxel mirrors a single voxel, so blocks
+  // integrated by different threads never write the same halo voxel. This does not hold in the
+  // ray marching mode, where several threads update the same block, see IntegrationMode.
+  inline void PushHalo(const size_t offset)
   {
-    return gradients_
-        [index.x + index.y * BlockProperties<float, 16>::blockSize
-         + index.z * BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize];
+    static constexpr size_t shift = BlockProperties<float>::blockShift;
+    static constexpr size_t mask = BlockSize() - 1;
+    if(!HasHalo())
+    {
+      return;
+    }
+    const size_t x = offset & mask;
+    const size_t y = (offset >> shift) & mask;
+    const size_t z = offset >> (2 * shift);
+    if(OnBorder(x) || OnBorder(y) || OnBorder(z))
+    {
+      PushBorderVoxel(x, y, z);
+    }
   }
 
-  inline Color3f ColorAt(const Index3d& index) const
+  // Same for n voxels starting at offset
+  inline void PushHalos(const size_t offset, const size_t n)
   {
-    return colors_
-        [index.x + index.y * BlockProperties<float, 16>::blockSize
-         + index.z * BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize];
+    for(size_t i = 0; i < n; i++)
+    {
+      PushHalo(offset + i);
+    }
   }
 
-  static constexpr size_t BlockSize() { return BlockProperties<float, 16>::blockSize; }
-  static constexpr size_t BlockVolume() { return BlockProperties<float, 16>::blockVolume; }
+  // Bytes used by the voxels of a block
+  static constexpr size_t VoxelBytes(const VoxelStorage storage, const bool useColor)
+  {
+    return storage == VoxelStorage::Float
+               ? PaddedVolume() * sizeof(float)
+                     + BlockVolume() * (sizeof(float) + (useColor ? sizeof(Color3f) : 0))
+               : BlockVolume() * (sizeof(int16_t) + sizeof(uint16_t) + (useColor ? 3 : 0));
+  }
 
 private:
+  static constexpr int16_t invalidCompactTsdf_ = INT16_MIN;
+
   float voxelRes_;
   size_t blockVolume_;
   bool useColor_;
+  VoxelStorage storage_;
+  VoxelQuantization quantization_;
+
+  AlignedPtr ownedData_;
+
+  float* tsdf_ = nullptr;
+  float* weights_ = nullptr;
+  Color3f* colors_ = nullptr;
+
+  int16_t* compactTsdf_ = nullptr;
+  uint16_t* compactWeights_ = nullptr;
+  uint8_t* compactColors_ = nullptr;
 
-  std::unique_ptr<float[]> tsdf_;
-  std::unique_ptr<float[]> weights_;
-  std::unique_ptr<Vec3f[]> gradients_;
-  std::unique_ptr<Color3f[]> colors_;
+  std::atomic<bool> dirty_{false};
+
+  VoxelBlock* neighbours_[27];
+
+  // Voxels read by the halos of the neighbours along one axis : the first two layers, for the
+  // previous block, and the last one, for the next block
+  static constexpr bool OnBorder(const size_t v) { return v <= 1 || v == BlockSize() - 1; }
+
+  void PushBorderVoxel(const size_t x, const size_t y, const size_t z);
+
+  static constexpr int NeighbourIndex(const int dx, const int dy, const int dz)
+  {
+    return (dx + 1) + 3 * (dy + 1) + 9 * (dz + 1);
+  }
+
+  static inline size_t Offset(const Index3d& index)
+  {
+    static constexpr size_t blockSize = BlockProperties<float>::blockSize;
+    return index.x + index.y * blockSize + index.z * blockSize * blockSize;
+  }
+
+  inline float DecodeTsdf(const size_t offset) const
+  {
+    if(storage_ == VoxelStorage::Float)
+    {
+      return tsdf_[PaddedOffset(offset)];
+    }
+    const int16_t value = compactTsdf_[VoxelIndex(offset)];
+    return value == invalidCompactTsdf_ ? BlockProperties<float>::invalidTsdf
+                                        : float(value) * (quantization_.tsdfRange / 32767.0f);
+  }
+
+  inline float DecodeWeight(const size_t offset) const
+  {
+    if(storage_ == VoxelStorage::Float)
+    {
+      return weights_[VoxelIndex(offset)];
+    }
+    return float(compactWeights_[VoxelIndex(offset)]) * quantization_.weightUnit;
+  }
+
+  inline Color3f DecodeColor(const size_t offset) const
+  {
+    if(storage_ == VoxelStorage::Float)
+    {
+      return colors_[VoxelIndex(offset)];
+    }
+    const uint8_t* rgb = compactColors_ + 3 * VoxelIndex(offset);
+    return Color3f(float(rgb[0]), float(rgb[1]), float(rgb[2])) / 255.0f;
+  }
+
+  // TSDF values are clamped to the quantization range
+  inline void EncodeTsdf(const size_t offset, const float tsdf)
+  {
+    if(tsdf == BlockProperties<float>::invalidTsdf)
+    {
+      compactTsdf_[VoxelIndex(offset)] = invalidCompactTsdf_;
+      return;
+    }
+    const float value = tsdf * (32767.0f / quantization_.tsdfRange);
+    compactTsdf_[VoxelIndex(offset)] = int16_t(lrintf(std::clamp(value, -32767.0f, 32767.0f)));
+  }
+
+  // Weights saturate at 65535 units. Observed voxels keep at least one unit, so that they are not
+  // confused with unobserved ones.
+  inline void EncodeWeight(const size_t offset, const float weight)
+  {
+    const float value = weight / quantization_.weightUnit;
+    compactWeights_[VoxelIndex(offset)] =
+        weight > 0.0f ? uint16_t(lrintf(std::clamp(value, 1.0f, 65535.0f))) : 0;
+  }
+
+  inline void EncodeColor(const size_t offset, const Color3f& rgb)
+  {
+    uint8_t* dst = compactColors_ + 3 * VoxelIndex(offset);
+    dst[0] = uint8_t(lrintf(std::clamp(255.0f * rgb.x, 0.0f, 255.0f)));
+    dst[1] = uint8_t(lrintf(std::clamp(255.0f * rgb.y, 0.0f, 255.0f)));
+    dst[2] = uint8_t(lrintf(std::clamp(255.0f * rgb.z, 0.0f, 255.0f)));
+  }
 };
 } // namespace fusion
 } // namespace spf
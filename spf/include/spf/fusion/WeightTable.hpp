@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <math.h>
+
+namespace spf
+{
+namespace fusion
+{
+// Evaluation of the sample weights, in every integration mode. Exact is the default : the table
+// is then built but never read.
+enum class WeightMode
+{
+  Exact,        // expf for every sample
+  Interpolated, // Table lookup with linear interpolation
+  Nearest       // Table lookup of the nearest entry
+};
+
+// Gaussian weight of a signed distance, w(d) = coeff * exp(-d^2 / (2 sigma^2)). Values are
+// tabulated on [0, maxDist] and |d| beyond maxDist is clamped to the last entry.
+class WeightTable
+{
+public:
+  WeightTable(
+      const float sigma, const float maxDist, const size_t resolution,
+      const WeightMode mode = WeightMode::Exact) :
+      mode_(mode),
+      resolution_(std::max(resolution, size_t(1))),
+      scale_(float(resolution_) / maxDist),
+      tsdfFact_(1.0f / (2.0f * sigma * sigma)),
+      coeff_(1.0f / (sigma * sqrtf(2 * M_PI))),
+      values_(resolution_ + 2)
+  {
+    for(size_t i = 0; i <= resolution_; i++)
+    {
+      values_[i] = Exact(float(i) / scale_);
+    }
+    // Padding so that interpolation at the last entry stays in bounds
+    values_[resolution_ + 1] = values_[resolution_];
+  }
+
+  inline float operator()(const float tsdf) const
+  {
+    switch(mode_)
+    {
+      case WeightMode::Interpolated:
+        return Interpolated(tsdf);
+      case WeightMode::Nearest:
+        return Nearest(tsdf);
+      default:
+        return Exact(tsdf);
+    }
+  }
+
+  inline float Exact(const float tsdf) const { return coeff_ * expf(-(tsdf * tsdf) * tsdfFact_); }
+
+  inline float Interpolated(const float tsdf) const
+  {
+    const float x = std::min(fabsf(tsdf) * scale_, float(resolution_));
+    const size_t i = size_t(x);
+    const float t = x - float(i);
+    return values_[i] + t * (values_[i + 1] - values_[i]);
+  }
+
+  inline float Nearest(const float tsdf) const
+  {
+    const float x = std::min(fabsf(tsdf) * scale_, float(resolution_));
+    return values_[size_t(x + 0.5f)];
+  }
+
+  inline WeightMode Mode() const { return mode_; }
+  inline size_t Resolution() const { return resolution_; }
+  inline float Coeff() const { return coeff_; }
+  inline float TsdfFact() const { return tsdfFact_; }
+
+  // Entries per unit of distance, and the resolution_ + 2 entries of the table, for vectorized
+  // lookups
+  inline float Scale() const { return scale_; }
+  inline const float *Values() const { return values_.data(); }
+
+private:
+  WeightMode mode_;
+  size_t resolution_;
+  float scale_;
+  float tsdfFact_;
+  float coeff_;
+  std::vector<float> values_;
+};
+} // namespace fusion
+} // namespace spf
@@ -27,14 +27,20 @@ namespace spf
 {
 namespace mc
 {
+// Extracts the mesh of a block of BlockSize^3 voxels from its voxels packed with the neighbouring
+// ones :
+//   - tsdf holds (BlockSize + 3)^3 values, covering voxels [-1, BlockSize + 1] along each axis
+//     so that normals are computed by central differences at the cube corners
+//   - rgb holds the colors of the block and of its +x / +y / +z neighbours, indexed by
+//     x | y << 1 | z << 2, with the voxels of each block laid out by fusion::VoxelLayout. Colors
+//     are only read at the vertices, so they are not packed.
+//     ColorType is float (RGB floats) or uint8_t (RGB8, as stored by compact voxel blocks).
+// Unobserved or missing voxels are set to FLT_MAX, cubes with such a corner are skipped.
+// Instantiated for blocks of 8, 16 and 32 voxels.
+template <size_t BlockSize, typename ColorType>
 size_t extractMesh(
-    const float *tsdf, const float *xx, const float *yy, const float *zz, const float *xy,
-    const float *xz, const float *yz, const float *xyz, const float *rgba, const float *cxx,
-    const float *cyy, const float *czz, const float *cxy, const float *cxz, const float *cyz,
-    const float *cxyz, const float *grad, const float *gxx, const float *gyy, const float *gzz,
-    const float *gxy, const float *gxz, const float *gyz, const float *gxyz, float *triangles,
-    float *colors, float *normals, const size_t blockSize, const float voxelRes,
-    const float *blockPos);
+    const float *tsdf, const ColorType *const *rgb, float *triangles, float *colors, float *normals,
+    const float voxelRes, const float *blockPos);
 
 } // namespace mc
 } // namespace spf
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2024 Adrien ARNAUD
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "spf/fusion/BlockStore.hpp"
+#include "spf/utils.hpp"
+
+#include <sys/stat.h>
+#include <zlib.h>
+
+namespace spf
+{
+namespace fusion
+{
+bool BlockStore::Open(const std::string &dir)
+{
+  if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+  {
+    utils::Log::Error("Spill", "Could not create %s : %s\n", dir.c_str(), strerror(errno));
+    return false;
+  }
+  dir_ = dir;
+  blockIds_.Clear();
+  return true;
+}
+
+std::vector<BlockId> BlockStore::GetAllIds() const
+{
+  std::vector<BlockId> ret;
+  ret.reserve(blockIds_.Size());
+  blockIds_.ForEach([&](const BlockId &blockId, const int) { ret.push_back(blockId); });
+  return ret;
+}
+
+size_t BlockStore::NumTriangles(const BlockId &blockId) const
+{
+  int numTriangles = 0;
+  blockIds_.Find(blockId, numTriangles);
+  return numTriangles;
+}
+
+std::string BlockStore::Filename(const BlockId &blockId) const
+{
+  char filename[64];
+  sprintf(filename, "/%d_%d_%d.blk", blockId.x, blockId.y, blockId.z);
+  return dir_ + filename;
+}
+
+// Meshes are written before the voxels, so that ReadMesh does not decompress the voxels
+bool BlockStore::Write(const BlockId &blockId, const VoxelBlock &block, const MeshType *mesh)
+{
+  const std::string filename = Filename(blockId);
+  gzFile fp = gzopen(filename.c_str(), "wb1");
+  if(!fp)
+  {
+    utils::Log::Error("Spill", "Could not open %s : %s\n", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  FileHeader header;
+  header.magic = magic_;
+  header.storage = uint8_t(block.Storage());
+  header.useColor = block.UseColor();
+  header.dirty = block.Dirty();
+  header.reserved = 0;
+  header.quantization = block.Quantization();
+  header.numTriangles = mesh != nullptr ? mesh->NumTriangles() : 0;
+
+  const size_t numPoints = 3 * header.numTriangles;
+  const size_t voxelBytes = VoxelBlock::VoxelBytes(block.Storage(), block.UseColor());
+  bool ok = gzfwrite(&header, sizeof(FileHeader), 1, fp) == 1;
+  if(numPoints > 0)
+  {
+    ok = ok && gzfwrite(mesh->RawPoints(), sizeof(Point3f), numPoints, fp) == numPoints;
+    ok = ok && gzfwrite(mesh->RawColors(), sizeof(Color3f), numPoints, fp) == numPoints;
+    ok = ok && gzfwrite(mesh->RawNormals(), sizeof(Vec3f), numPoints, fp) == numPoints;
+  }
+  ok = ok && gzfwrite(block.Data(), 1, voxelBytes, fp) == voxelBytes;
+  ok = (gzclose(fp) == Z_OK) && ok;
+  if(!ok)
+  {
+    utils::Log::Error("Spill", "Error writing in %s\n", filename.c_str());
+    return false;
+  }
+
+  blockIds_.Erase(blockId);
+  blockIds_.Insert(blockId, int(header.numTriangles));
+  return true;
+}
+
+static bool readMesh(gzFile fp, const size_t numTriangles, BlockStore::MeshPtrType &mesh)
+{
+  mesh.reset();
+  if(numTriangles == 0)
+  {
+    return true;
+  }
+
+  const size_t numPoints = 3 * numTriangles;
+  mesh.reset(new BlockStore::MeshType(numPoints, numTriangles));
+  mesh->Resize(numPoints, numTriangles);
+  bool ok = gzfread(mesh->RawPoints(), sizeof(Point3f), numPoints, fp) == numPoints;
+  ok = ok && gzfread(mesh->RawColors(), sizeof(Color3f), numPoints, fp) == numPoints;
+  ok = ok && gzfread(mesh->RawNormals(), sizeof(Vec3f), numPoints, fp) == numPoints;
+  return ok;
+}
+
+bool BlockStore::Read(const BlockId &blockId, VoxelBlock &block, MeshPtrType *mesh) const
+{
+  const std::string filename = Filename(blockId);
+  gzFile fp = gzopen(filename.c_str(), "rb");
+  if(!fp)
+  {
+    utils::Log::Error("Spill", "Could not open %s : %s\n", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  FileHeader header;
+  bool ok = gzfread(&header, sizeof(FileHeader), 1, fp) == 1 && header.magic == magic_;
+
+  // Meshes are skipped by reading them in a temporary one
+  MeshPtrType tmpMesh;
+  ok = ok && readMesh(fp, header.numTriangles, mesh != nullptr ? *mesh : tmpMesh);
+
+  const VoxelStorage storage = VoxelStorage(header.storage);
+  const bool sameLayout = storage == block.Storage() && bool(header.useColor) == block.UseColor()
+                          && header.quantization.tsdfRange == block.Quantization().tsdfRange
+                          && header.quantization.weightUnit == block.Quantization().weightUnit;
+  if(ok && sameLayout)
+  {
+    const size_t voxelBytes = VoxelBlock::VoxelBytes(storage, block.UseColor());
+    ok = gzfread(block.Data(), 1, voxelBytes, fp) == voxelBytes;
+  }
+  else if(ok)
+  {
+    static constexpr size_t blockVolume = BlockProperties<float>::blockVolume;
+    VoxelBlock stored(block.VoxelRes(), header.useColor, storage, header.quantization);
+    const size_t voxelBytes = VoxelBlock::VoxelBytes(storage, header.useColor);
+    ok = gzfread(stored.Data(), 1, voxelBytes, fp) == voxelBytes;
+
+    std::vector<float> tsdf(blockVolume);
+    std::vector<float> weights(blockVolume);
+    std::vector<Color3f> colors(blockVolume, Color3f(0.0f, 0.0f, 0.0f));
+    stored.ReadVoxels(0, blockVolume, tsdf.data(), weights.data(), colors.data());
+    block.WriteVoxels(0, blockVolume, tsdf.data(), weights.data(), colors.data());
+  }
+  gzclose(fp);
+
+  if(!ok)
+  {
+    utils::Log::Error("Spill", "Error reading in %s\n", filename.c_str());
+    return false;
+  }
+
+  if(header.dirty)
+  {
+    block.MarkDirty();
+  }
+  return true;
+}
+
+bool BlockStore::ReadMesh(const BlockId &blockId, MeshPtrType &mesh) const
+{
+  const std::string filename = Filename(blockId);
+  gzFile fp = gzopen(filename.c_str(), "rb");
+  if(!fp)
+  {
+    utils::Log::Error("Spill", "Could not open %s : %s\n", filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  FileHeader header;
+  bool ok = gzfread(&header, sizeof(FileHeader), 1, fp) == 1 && header.magic == magic_;
+  ok = ok && readMesh(fp, header.numTriangles, mesh);
+  gzclose(fp);
+
+  if(!ok)
+  {
+    utils::Log::Error("Spill", "Error reading in %s\n", filename.c_str());
+  }
+  return ok;
+}
+
+void BlockStore::Remove(const BlockId &blockId) { blockIds_.Erase(blockId); }
+
+void BlockStore::Restore(const BlockId &blockId, const size_t numTriangles)
+{
+  blockIds_.Insert(blockId, int(numTriangles));
+}
+
+void BlockStore::Clear() { blockIds_.Clear(); }
+} // namespace fusion
+} // namespace spf
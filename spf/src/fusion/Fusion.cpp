@@ -16,6 +16,7 @@
  */
 
 #include "spf/fusion/Fusion.hpp"
+#include "spf/fusion/IntegrationKernels.hpp"
 #include "spf/utils.hpp"
 
 #include <omp.h>
@@ -26,89 +27,469 @@ namespace fusion
 {
 Fusion::Fusion(
     const float voxelRes, const float integrationDistance, const size_t maxDepthMapWidth,
-    const size_t maxDepthMapHeight) :
+    const size_t maxDepthMapHeight, const size_t weightTableSize, const BlockBounds &bounds) :
     voxelRes_(voxelRes),
     tau_(integrationDistance),
     maxDepthMapWidth_(maxDepthMapWidth),
     maxDepthMapHeight_(maxDepthMapHeight),
-    volume_(voxelRes_)
-{}
+    numThreads_(omp_get_max_threads()),
+    weightTable_(tau_, 2.0f * tau_, weightTableSize),
+    volume_(voxelRes_, bounds)
+{
+  AllocateWorkspace();
+}
 
 Fusion::~Fusion() {}
 
-void Fusion::IntegrateDepthMap(
+void Fusion::SetWeightMode(const WeightMode mode)
+{
+  weightTable_ = WeightTable(tau_, 2.0f * tau_, weightTable_.Resolution(), mode);
+}
+
+void Fusion::SetVoxelStorage(const VoxelStorage storage)
+{
+  VoxelQuantization quantization;
+  quantization.tsdfRange = tau_ + voxelRes_;
+  quantization.weightUnit = weightTable_.Coeff() / 256.0f;
+  volume_.SetVoxelStorage(storage, quantization);
+}
+
+void Fusion::SetNumThreads(const size_t numThreads)
+{
+  numThreads_ = std::max(numThreads, size_t(1));
+  volume_.SetNumThreads(numThreads_);
+  AllocateWorkspace();
+}
+
+void Fusion::AllocateWorkspace()
+{
+  const size_t maxNumPoints = maxDepthMapWidth_ * maxDepthMapHeight_;
+  if(workspace_.cloud.PointData().Capacity() < maxNumPoints)
+  {
+    workspace_.cloud = PointCloudType(maxNumPoints);
+  }
+  if(workspace_.opc.Capacity() < maxNumPoints)
+  {
+    workspace_.opc = OPCType(maxDepthMapWidth_, maxDepthMapHeight_);
+  }
+
+  workspace_.intersectingBlocks.resize(numThreads_);
+  workspace_.threadSamples.resize(numThreads_);
+}
+
+void Fusion::EnableKeyframeGate(const KeyframeGateParams &params)
+{
+  keyframeGate_.SetParams(params);
+  useKeyframeGate_ = true;
+}
+
+FrameDecision Fusion::GateFrame(const FrameType &depthMap, const Mat4f &transform)
+{
+  if(!useKeyframeGate_)
+  {
+    return FrameDecision::Integrate;
+  }
+
+  const FrameDecision decision =
+      keyframeGate_.Decide(depthMap.Depth(), depthMap.Width(), depthMap.Height(), transform);
+  utils::Log::Info(
+      "Fusion", "Keyframe gate : %s (translation %f m, rotation %f rad, depth change %f)\n",
+      FrameDecisionName(decision), keyframeGate_.Translation(), keyframeGate_.Rotation(),
+      keyframeGate_.DepthChange());
+  return decision;
+}
+
+// Keeps one point out of stride^2, the cloud only holds valid points so that the pixel grid is
+// not available anymore
+void Fusion::SubsampleCloud(PointCloudType &pointCloud, const size_t stride)
+{
+  const size_t step = stride * stride;
+  size_t numPoints = 0;
+  for(size_t i = 0; i < pointCloud.Size(); i += step)
+  {
+    pointCloud.Points()[numPoints] = pointCloud.Points()[i];
+    pointCloud.Colors()[numPoints] = pointCloud.Colors()[i];
+    numPoints++;
+  }
+  pointCloud.Resize(numPoints);
+}
+
+// Invalidates the pixels that are not on the subsampling grid
+void Fusion::SubsampleCloud(OPCType &opc, const size_t stride)
+{
+  for(size_t i = 0; i < opc.Height(); i++)
+  {
+    for(size_t j = 0; j < opc.Width(); j++)
+    {
+      if(i % stride != 0 || j % stride != 0)
+      {
+        opc.Points(i, j).x = FLT_MAX;
+      }
+    }
+  }
+}
+
+FrameDecision Fusion::IntegrateDepthMap(
     const FrameType &depthMap, const IntrinsicsType &intrinsics, const Mat4f &transform,
     const float near, const size_t far)
 {
+  newBlocks_.clear();
+
+  const FrameDecision decision = GateFrame(depthMap, transform);
+  if(decision == FrameDecision::Skip)
+  {
+    return decision;
+  }
+
   utils::Log::Info("Fusion", "Integrating point cloud\n");
-  static PointCloudType inputCloud(maxDepthMapWidth_ * maxDepthMapHeight_);
+  PointCloudType &inputCloud = workspace_.cloud;
+  if(inputCloud.PointData().Capacity() < depthMap.Width() * depthMap.Height())
+  {
+    inputCloud = PointCloudType(depthMap.Width() * depthMap.Height());
+  }
   inputCloud.Clear();
 
-  newBlocks_.clear();
-  intersectingBlocks_.clear();
-
-  CHRONO((depthMap.ExtractPoints<PointType, float>(inputCloud, intrinsics, near, far, 5000.0f)));
+  CHRONO(
+      (depthMap.ExtractPoints<PointType, float>(inputCloud, intrinsics, near, far, depthScale_)));
+  if(decision == FrameDecision::Subsample && integrationMode_ != IntegrationMode::Projective)
+  {
+    SubsampleCloud(inputCloud, keyframeGate_.Params().subsampleStride);
+  }
   inputCloud.Transform(transform);
 
   const Point3f c = transform * Point3f(0.0f, 0.0f, 0.0f);
   GetBlocksIntersecting(inputCloud, c);
 
-  for(const BlockId &id : intersectingBlocks_)
+  AllocateBlocks(c);
+
   {
-    newBlocks_.emplace_back(id);
+    std::lock_guard<std::mutex> lock(volumeMutex_);
+    if(integrationMode_ == IntegrationMode::Projective)
+    {
+      IntegrateProjective(depthMap, intrinsics, transform, near, far);
+    }
+    else
+    {
+      IntegratePointCloud(inputCloud, c);
+    }
   }
-
-  const size_t numAllocated = volume_.AddBlocks(newBlocks_);
-  utils::Log::Info("Fusion", "There are %lu blocks intersecting\n", newBlocks_.size());
-  utils::Log::Info("Fusion", "Allocated %lu new blocks\n", numAllocated);
-  utils::Log::Info("Fusion", "Total blocks stored : %lu\n", volume_.NumBlocks());
-
-  IntegratePointCloud(inputCloud, c);
-  // UpdateGradients();
+  CollectGarbage(1);
+  return decision;
 }
 
-void Fusion::IntegrateDepthMapOrdered(
+FrameDecision Fusion::IntegrateDepthMapOrdered(
     const FrameType &depthMap, const IntrinsicsType &intrinsics, const Mat4f &transform,
     const float near, const size_t far)
 {
-  utils::Log::Info("Fusion", "Integrating OPC\n");
-  OPCType inputCloud(depthMap.Width(), depthMap.Height());
-
   newBlocks_.clear();
-  intersectingBlocks_.clear();
 
-  CHRONO((depthMap.ExtractPoints<OPCPointType, float>(inputCloud, intrinsics, near, far, 5000.0f)));
-  CHRONO(inputCloud.Transform(transform));
-  CHRONO(inputCloud.EstimateNormals(5.0f * voxelRes_));
+  const FrameDecision decision = GateFrame(depthMap, transform);
+  if(decision == FrameDecision::Skip)
+  {
+    return decision;
+  }
+
+  utils::Log::Info("Fusion", "Integrating OPC\n");
+  OPCType &inputCloud = workspace_.opc;
+  if(inputCloud.Width() != depthMap.Width() || inputCloud.Height() != depthMap.Height())
+  {
+    if(inputCloud.Capacity() < depthMap.Width() * depthMap.Height())
+    {
+      inputCloud.Realloc(depthMap.Width() * depthMap.Height());
+    }
+    inputCloud.Resize(depthMap.Width(), depthMap.Height());
+  }
+
+  START_CHRONO("Extract oriented points");
+  depthMap.ExtractOrientedPoints<OPCPointType, float>(
+      inputCloud, intrinsics, transform, near, far, depthScale_, 5.0f * voxelRes_, numThreads_);
+  STOP_CHRONO();
+  if(decision == FrameDecision::Subsample && integrationMode_ != IntegrationMode::Projective)
+  {
+    SubsampleCloud(inputCloud, keyframeGate_.Params().subsampleStride);
+  }
 
   GetBlocksIntersecting(inputCloud);
 
-  START_CHRONO("Inserting new blocks");
-  for(const BlockId &id : intersectingBlocks_)
+  AllocateBlocks(transform * Point3f(0.0f, 0.0f, 0.0f));
+
+  {
+    std::lock_guard<std::mutex> lock(volumeMutex_);
+    if(integrationMode_ == IntegrationMode::Projective)
+    {
+      IntegrateProjective(depthMap, intrinsics, transform, near, far);
+    }
+    else
+    {
+      IntegratePointCloud(inputCloud);
+    }
+  }
+  CollectGarbage(1);
+  return decision;
+}
+
+void Fusion::IntegrateDepthMaps(
+    const std::vector<FrameType> &depthMaps, const IntrinsicsType &intrinsics,
+    const std::vector<Mat4f> &transforms, const float near, const size_t far)
+{
+  if(depthMaps.size() != transforms.size())
+  {
+    throw std::runtime_error("IntegrateDepthMaps : one transform is needed per depth map");
+  }
+
+  const size_t numFrames = depthMaps.size();
+  utils::Log::Info("Fusion", "Integrating a batch of %lu depth maps\n", numFrames);
+  START_CHRONO("Integrate batch");
+
+  auto &clouds = workspace_.batchClouds;
+  auto &frameBlocks = workspace_.batchFrameBlocks;
+  if(clouds.size() < numFrames)
+  {
+    clouds.resize(numFrames);
+    frameBlocks.resize(numFrames);
+  }
+
+  // Extract all frames and find the blocks seen by each of them
+  for(size_t frame = 0; frame < numFrames; frame++)
+  {
+    const FrameType &depthMap = depthMaps[frame];
+    PointCloudType &cloud = clouds[frame];
+    if(cloud.PointData().Capacity() < depthMap.Width() * depthMap.Height())
+    {
+      cloud = PointCloudType(depthMap.Width() * depthMap.Height());
+    }
+    cloud.Clear();
+    depthMap.ExtractPoints<PointType, float>(cloud, intrinsics, near, far, depthScale_);
+    cloud.Transform(transforms[frame]);
+
+    PrepareBlockLists();
+    CollectBlocksIntersecting(cloud, transforms[frame] * Point3f(0.0f, 0.0f, 0.0f));
+    MergeBlockLists();
+    frameBlocks[frame] = newBlocks_;
+  }
+
+  // Blocks of the whole batch are allocated at once
+  newBlocks_.clear();
+  for(size_t frame = 0; frame < numFrames; frame++)
+  {
+    newBlocks_.insert(newBlocks_.end(), frameBlocks[frame].begin(), frameBlocks[frame].end());
+  }
+  SortBlockIds(newBlocks_);
+
+  AllocateBlocks(
+      numFrames > 0 ? transforms[numFrames - 1] * Point3f(0.0f, 0.0f, 0.0f)
+                    : Point3f(0.0f, 0.0f, 0.0f),
+      numFrames);
+
+  std::unique_lock<std::mutex> lock(volumeMutex_);
+  if(integrationMode_ == IntegrationMode::Projective)
+  {
+    IntegrateBatchProjective(depthMaps, intrinsics, transforms, near, far);
+  }
+  else
   {
-    newBlocks_.emplace_back(id);
+    // Ray samples of all the frames are bucketed over the blocks of the batch, each block then
+    // integrates its samples in frame order.
+    START_CHRONO("Integrate batch (bucketed)");
+    PrepareBuckets();
+    for(size_t frame = 0; frame < numFrames; frame++)
+    {
+      BucketPointCloud(clouds[frame], transforms[frame] * Point3f(0.0f, 0.0f, 0.0f), frame);
+    }
+    SortSampleBuckets();
+    IntegrateBuckets(numFrames);
+    STOP_CHRONO();
   }
+  lock.unlock();
+  CollectGarbage(numFrames);
   STOP_CHRONO();
+}
+
+void Fusion::IntegrateBatchProjective(
+    const std::vector<FrameType> &depthMaps, const IntrinsicsType &intrinsics,
+    const std::vector<Mat4f> &transforms, const float near, const float far)
+{
+  const size_t numFrames = depthMaps.size();
+  const size_t numBlocks = newBlocks_.size();
+  const auto &frameBlocks = workspace_.batchFrameBlocks;
+  auto &worldToCam = workspace_.batchWorldToCam;
+  auto &blockFrameOffsets = workspace_.batchBlockFrameOffsets;
+  auto &blockCursors = workspace_.batchBlockCursors;
+  auto &blockFrames = workspace_.batchBlockFrames;
+
+  worldToCam.resize(numFrames);
+  for(size_t frame = 0; frame < numFrames; frame++)
+  {
+    worldToCam[frame] = Mat4f::Inverse(transforms[frame]);
+  }
+
+  // List the frames seeing each block, in frame order. Block lists are sorted in Morton order, see
+  // SortBlockIds, so the index of a block in the batch is found by walking both lists together.
+  blockFrameOffsets.assign(numBlocks + 1, 0);
+  for(size_t frame = 0; frame < numFrames; frame++)
+  {
+    size_t blockIndex = 0;
+    for(const auto &blockId : frameBlocks[frame])
+    {
+      const uint64_t key = MortonBlockKey(blockId);
+      while(MortonBlockKey(newBlocks_[blockIndex]) < key)
+      {
+        blockIndex++;
+      }
+      blockFrameOffsets[blockIndex + 1]++;
+    }
+  }
+  for(size_t blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+  {
+    blockFrameOffsets[blockIndex + 1] += blockFrameOffsets[blockIndex];
+  }
+
+  blockFrames.resize(blockFrameOffsets[numBlocks]);
+  blockCursors.assign(blockFrameOffsets.begin(), blockFrameOffsets.end() - 1);
+  for(size_t frame = 0; frame < numFrames; frame++)
+  {
+    size_t blockIndex = 0;
+    for(const auto &blockId : frameBlocks[frame])
+    {
+      const uint64_t key = MortonBlockKey(blockId);
+      while(MortonBlockKey(newBlocks_[blockIndex]) < key)
+      {
+        blockIndex++;
+      }
+      blockFrames[blockCursors[blockIndex]++] = frame;
+    }
+  }
 
+  // Each block is then updated by all its frames while it is in cache
+#pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
+  for(size_t blockIndex = 0; blockIndex < numBlocks; blockIndex++)
+  {
+    const BlockId &blockId = newBlocks_[blockIndex];
+    VoxelBlock *voxelBlock = volume_.GetBlock(blockId);
+    if(voxelBlock == NULL)
+    {
+      continue;
+    }
+    for(size_t i = blockFrameOffsets[blockIndex]; i < blockFrameOffsets[blockIndex + 1]; i++)
+    {
+      const size_t frame = blockFrames[i];
+      IntegrateBlockProjective(
+          *voxelBlock, blockId, depthMaps[frame], intrinsics, worldToCam[frame], near, far);
+    }
+  }
+}
+
+void Fusion::UpdateMeshes() { UpdateMeshes(newBlocks_); }
+
+void Fusion::UpdateMeshes(const BlockIdList &blockIds)
+{
+  std::lock_guard<std::mutex> lock(volumeMutex_);
+  CollectBlocksToUpdate(blockIds);
+  volume_.RecomputeMeshes(workspace_.updateBlocks);
+}
+
+void Fusion::RecomputeMeshes() { volume_.RecomputeAllMeshes(); }
+
+size_t Fusion::CollectEmptyBlocks()
+{
+  std::lock_guard<std::mutex> lock(volumeMutex_);
+  return volume_.CollectEmptyBlocks(false);
+}
+
+void Fusion::CollectGarbage(const size_t numFrames)
+{
+  if(collectionPeriod_ == 0)
+  {
+    return;
+  }
+
+  framesSinceCollection_ += numFrames;
+  if(framesSinceCollection_ >= collectionPeriod_)
+  {
+    framesSinceCollection_ = 0;
+    std::lock_guard<std::mutex> lock(volumeMutex_);
+    volume_.CollectEmptyBlocks(true);
+  }
+}
+
+void Fusion::AllocateBlocks(const Point3f &center, const size_t numFrames)
+{
+  std::lock_guard<std::mutex> lock(volumeMutex_);
+  volume_.AdvanceFrame(numFrames);
   const size_t numAllocated = volume_.AddBlocks(newBlocks_);
   utils::Log::Info("Fusion", "There are %lu blocks intersecting\n", newBlocks_.size());
   utils::Log::Info("Fusion", "Allocated %lu new blocks\n", numAllocated);
   utils::Log::Info("Fusion", "Total blocks stored : %lu\n", volume_.NumBlocks());
-
-  IntegratePointCloud(inputCloud);
-  // UpdateGradients();
+  volume_.EvictBlocks(center);
 }
 
-void Fusion::UpdateMeshes()
+// Marching cubes reads the first voxel layers of the +x, +y and +z neighbours and computes normals
+// by central differences, so the mesh of a block only depends on the voxels of the blocks within
+// one block of it. The blocks to update are therefore the dirty blocks among blockIds and their
+// 26 neighbours. When blocks are spilled, those read by the meshes to update, i.e. within two
+// blocks of the dirty ones, are reloaded first.
+void Fusion::CollectBlocksToUpdate(const BlockIdList &blockIds)
 {
-  UpdateGradients();
-  volume_.RecomputeMeshes(newBlocks_);
-}
+  BlockIdList &updateBlocks = workspace_.updateBlocks;
+  updateBlocks.clear();
 
-void Fusion::RecomputeMeshes()
-{
-  UpdateAllGradients();
-  volume_.RecomputeAllMeshes();
+  if(volume_.NumSpilledBlocks() > 0)
+  {
+    for(const auto &blockId : blockIds)
+    {
+      VoxelBlock *voxelBlock = volume_.GetBlock(blockId);
+      if(voxelBlock == nullptr || !voxelBlock->Dirty())
+      {
+        continue;
+      }
+      for(int k = -2; k <= 2; k++)
+      {
+        for(int j = -2; j <= 2; j++)
+        {
+          for(int i = -2; i <= 2; i++)
+          {
+            updateBlocks.emplace_back(blockId + BlockId(i, j, k));
+          }
+        }
+      }
+    }
+    SortBlockIds(updateBlocks);
+    volume_.LoadBlocks(updateBlocks);
+    updateBlocks.clear();
+  }
+
+  size_t numDirty = 0;
+  for(const auto &blockId : blockIds)
+  {
+    VoxelBlock *voxelBlock = volume_.GetBlock(blockId);
+    if(voxelBlock == nullptr || !voxelBlock->Dirty())
+    {
+      continue;
+    }
+    voxelBlock->ClearDirty();
+    numDirty++;
+
+    // Only the neighbours in memory have a mesh to update
+    for(int k = -1; k <= 1; k++)
+    {
+      for(int j = -1; j <= 1; j++)
+      {
+        for(int i = -1; i <= 1; i++)
+        {
+          if(voxelBlock->Neighbour(i, j, k) != nullptr)
+          {
+            updateBlocks.emplace_back(blockId + BlockId(i, j, k));
+          }
+        }
+      }
+    }
+  }
+
+  SortBlockIds(updateBlocks);
+
+  utils::Log::Info(
+      "Fusion", "Updating %lu blocks (%lu dirty out of %lu)\n", updateBlocks.size(), numDirty,
+      blockIds.size());
 }
 
 void Fusion::ExportMesh(const char *filename) { volume_.ExportMeshes(filename); }
@@ -199,36 +580,48 @@ void Fusion::ClearData() {}
 void Fusion::GetBlocksIntersecting(PointCloudType const &inputCloud, const Point3f &cameraCenter)
 {
   START_CHRONO("Get blocks intersecting");
-#pragma omp parallel
+  PrepareBlockLists();
+  CollectBlocksIntersecting(inputCloud, cameraCenter);
+  MergeBlockLists();
+  STOP_CHRONO();
+}
+
+void Fusion::CollectBlocksIntersecting(
+    PointCloudType const &inputCloud, const Point3f &cameraCenter)
+{
+  const Vec3f offset = DiscoveryOffset();
+#pragma omp parallel num_threads(numThreads_)
   {
-    std::set<BlockId> foundIds;
+    BlockUpdateList &foundIds = workspace_.intersectingBlocks[omp_get_thread_num()];
 #pragma omp for
     for(size_t i = 0; i < inputCloud.Size(); i++)
     {
       const auto org = inputCloud.Points()[i];
       const Vec3f u = Vec3f::Normalize(org - cameraCenter);
-      const Point3f first = org - tau_ * u;
-      const Point3f last = org + tau_ * u;
-      const BlockId minId = GetId(first, voxelRes_);
-      const BlockId maxId = GetId(last, voxelRes_);
-
-      RaycastVoxels(minId, maxId, foundIds);
+      const Point3f first = org - tau_ * u + offset;
+      const Point3f last = org + tau_ * u + offset;
+      if(blockTraversal_ == BlockTraversal::DDA)
+      {
+        TraverseBlocks(first, last, foundIds);
+      }
+      else
+      {
+        RaycastVoxels(GetId(first, voxelRes_), GetId(last, voxelRes_), foundIds);
+      }
     }
 
-#pragma omp critical
-    {
-      intersectingBlocks_.insert(foundIds.begin(), foundIds.end());
-    }
+    foundIds.SortUnique();
   } // omp parallel
-  STOP_CHRONO();
 }
 
 void Fusion::GetBlocksIntersecting(OPCType const &opc)
 {
   START_CHRONO("Get blocks intersecting OPC");
-#pragma omp parallel
+  PrepareBlockLists();
+  const Vec3f offset = DiscoveryOffset();
+#pragma omp parallel num_threads(numThreads_)
   {
-    std::set<BlockId> foundIds;
+    BlockUpdateList &foundIds = workspace_.intersectingBlocks[omp_get_thread_num()];
 #pragma omp for
     for(size_t i = 0; i < opc.Height(); i++)
     {
@@ -247,431 +640,588 @@ void Fusion::GetBlocksIntersecting(OPCType const &opc)
           continue;
         }
 
-        const Point3f first = p + tau_ * n;
-        const Point3f last = p - tau_ * n;
-        const BlockId minId = GetId(first, voxelRes_);
-        const BlockId maxId = GetId(last, voxelRes_);
-
-        RaycastVoxels(minId, maxId, foundIds);
+        const Point3f first = p + tau_ * n + offset;
+        const Point3f last = p - tau_ * n + offset;
+        if(blockTraversal_ == BlockTraversal::DDA)
+        {
+          TraverseBlocks(first, last, foundIds);
+        }
+        else
+        {
+          RaycastVoxels(GetId(first, voxelRes_), GetId(last, voxelRes_), foundIds);
+        }
       }
     }
 
-#pragma omp critical
-    {
-      intersectingBlocks_.insert(foundIds.begin(), foundIds.end());
-    }
+    foundIds.SortUnique();
   } // omp parallel
+
+  MergeBlockLists();
   STOP_CHRONO();
 }
 
-void Fusion::IntegratePointCloud(PointCloudType const &inputCloud, const Point3f &cameraCenter)
+void Fusion::PrepareBlockLists()
 {
-  START_CHRONO("Integrate point cloud");
-  const float step = 0.5f * voxelRes_;
-  const float sigma = tau_;
-  const float tsdfFact = 1.0f / (2.0f * sigma * sigma);
-  const float coeff = 1.0f / (sigma * sqrtf(2 * M_PI));
-
-#pragma omp parallel for schedule(static)
-  for(size_t i = 0; i < inputCloud.Size(); i++)
+  for(auto &foundIds : workspace_.intersectingBlocks)
   {
-    const Point3f org = inputCloud.Points()[i];
-    const Color3f rgb = inputCloud.Colors()[i];
-    const Vec3f u = Vec3f::Normalize(org - cameraCenter);
-
-    for(float dist = tau_; dist > -tau_; dist -= step)
-    {
-      const Point3f pos = org - dist * u;
-      const BlockId id = GetId(pos, voxelRes_);
-      const Index3d voxelId = GetVoxelId(pos, voxelRes_);
-      const Point3f voxelPos = GetVoxelPos(GetVoxelAbsolutePos(id, voxelId), voxelRes_);
-      const float tsdf = Vec3f::Dot(u, org - voxelPos) >= 0.0f ? Point3f::Dist(voxelPos, org)
-                                                               : -Point3f::Dist(voxelPos, org);
-
-      // Update volume TSDF
-      VoxelBlock *voxelBlock = volume_.GetBlock(id);
-      if(voxelBlock == NULL)
-      {
-        continue;
-      }
-      const size_t offset = voxelId.x + voxelId.y * BlockProperties<float, 16>::blockSize
-                            + voxelId.z * BlockProperties<float, 16>::blockSize
-                                  * BlockProperties<float, 16>::blockSize;
+    foundIds.Clear();
+  }
+}
 
-      const float weight = coeff * expf(-(tsdf * tsdf) * tsdfFact);
-      float *__restrict tsdfPtr = voxelBlock->TSDF();
-      Color3f *__restrict colorsPtr = voxelBlock->Colors();
-      float *__restrict weightsPtr = voxelBlock->Weights();
+void Fusion::MergeBlockLists()
+{
+  size_t numIds = 0;
+  for(const auto &foundIds : workspace_.intersectingBlocks)
+  {
+    numIds += foundIds.Size();
+  }
 
-      const float weightSum = weight + weightsPtr[offset];
-      tsdfPtr[offset] = (weightsPtr[offset] * tsdfPtr[offset] + weight * tsdf) / weightSum;
-      colorsPtr[offset] = (weightsPtr[offset] * colorsPtr[offset] + weight * rgb) / weightSum;
-      weightsPtr[offset] += weight;
-    }
+  newBlocks_.clear();
+  newBlocks_.reserve(numIds);
+  for(const auto &foundIds : workspace_.intersectingBlocks)
+  {
+    newBlocks_.insert(newBlocks_.end(), foundIds.Ids().begin(), foundIds.Ids().end());
   }
-  STOP_CHRONO();
+  SortBlockIds(newBlocks_);
 }
 
-void Fusion::IntegratePointCloud(OPCType const &opc)
+// Calls func(blockId, voxelId, tsdf) for each voxel updated by the ray going through the surface
+// point org along u, within the truncation distance.
+template <typename Func>
+void Fusion::ForEachRaySample(const Point3f &org, const Vec3f &u, Func &&func)
 {
-  START_CHRONO("Integrate OPC");
-  const float step = 0.5f * voxelRes_;
-  const float sigma = tau_;
-  const float tsdfFact = 1.0f / (2.0f * sigma * sigma);
-  const float coeff = 1.0f / (sigma * sqrtf(2 * M_PI));
+  constexpr int blockShift = BlockProperties<float>::blockShift;
+  constexpr int blockMask = BlockProperties<float>::blockSize - 1;
 
-#pragma omp parallel for schedule(static)
-  for(size_t i = 0; i < opc.Height(); i++)
+  auto signedDist = [&](const Point3f &voxelPos) {
+    return Vec3f::Dot(u, org - voxelPos) >= 0.0f ? Point3f::Dist(voxelPos, org)
+                                                 : -Point3f::Dist(voxelPos, org);
+  };
+
+  if(raySampling_ == RaySampling::VoxelDDA)
   {
-    for(size_t j = 0; j < opc.Width(); j++)
-    {
-      const Point3f org = opc.Points(i, j);
-      const Vec3f u = opc.Normals(i, j);
+    TraverseVoxels(org - tau_ * u, org + tau_ * u, voxelRes_, [&](const Index3d &voxelPos) {
+      const BlockId id(
+          voxelPos.x >> blockShift, voxelPos.y >> blockShift, voxelPos.z >> blockShift);
+      const Index3d voxelId(voxelPos.x & blockMask, voxelPos.y & blockMask, voxelPos.z & blockMask);
+      func(id, voxelId, signedDist(GetVoxelPos(voxelPos, voxelRes_)));
+    });
+    return;
+  }
 
-      if(org.x == FLT_MAX)
-      {
-        continue;
-      }
+  const float step = 0.5f * voxelRes_;
+  for(float dist = tau_; dist > -tau_; dist -= step)
+  {
+    const Point3f pos = org - dist * u;
+    const BlockId id = GetId(pos, voxelRes_);
+    const Index3d voxelId = GetVoxelId(pos, voxelRes_);
+    func(id, voxelId, signedDist(GetVoxelPos(GetVoxelAbsolutePos(id, voxelId), voxelRes_)));
+  }
+}
 
-      if(u.x == 0 && u.y == 0 && u.z == 0)
-      {
-        continue;
-      }
+void Fusion::IntegratePointCloud(PointCloudType const &inputCloud, const Point3f &cameraCenter)
+{
+  if(integrationMode_ == IntegrationMode::BlockBucketed)
+  {
+    IntegratePointCloudBucketed(inputCloud, cameraCenter);
+    return;
+  }
 
-      if(u.x == FLT_MAX || u.y == FLT_MAX || u.z == FLT_MAX)
-      {
-        continue;
-      }
+  START_CHRONO("Integrate point cloud");
 
-      const Color3f rgb = opc.Colors(i, j);
+#pragma omp parallel num_threads(numThreads_)
+  {
+    BlockCache blockCache(volume_);
 
-      for(float dist = tau_; dist > -tau_; dist -= step)
-      {
-        const Point3f pos = org - dist * u;
-        const BlockId id = GetId(pos, voxelRes_);
-        const Index3d voxelId = GetVoxelId(pos, voxelRes_);
-        const Point3f voxelPos = GetVoxelPos(GetVoxelAbsolutePos(id, voxelId), voxelRes_);
-        const float tsdf = Vec3f::Dot(u, org - voxelPos) >= 0.0f ? Point3f::Dist(voxelPos, org)
-                                                                 : -Point3f::Dist(voxelPos, org);
+#pragma omp for schedule(static)
+    for(size_t i = 0; i < inputCloud.Size(); i++)
+    {
+      const Point3f org = inputCloud.Points()[i];
+      const Color3f rgb = inputCloud.Colors()[i];
+      const Vec3f u = Vec3f::Normalize(org - cameraCenter);
 
+      ForEachRaySample(org, u, [&](const BlockId &id, const Index3d &voxelId, const float tsdf) {
         // Update volume TSDF
-        VoxelBlock *voxelBlock = volume_.GetBlock(id);
+        VoxelBlock *voxelBlock = blockCache.GetBlock(id);
         if(voxelBlock == NULL)
         {
-          continue;
+          return;
         }
-        const size_t offset = voxelId.x + voxelId.y * BlockProperties<float, 16>::blockSize
-                              + voxelId.z * BlockProperties<float, 16>::blockSize
-                                    * BlockProperties<float, 16>::blockSize;
-        const float weight = coeff * expf(-(tsdf * tsdf) * tsdfFact);
-
-        float *__restrict tsdfPtr = voxelBlock->TSDF();
-        Color3f *__restrict colorsPtr = voxelBlock->Colors();
-        float *__restrict weightsPtr = voxelBlock->Weights();
-
-        const float weightSum = weight + weightsPtr[offset];
-        tsdfPtr[offset] = (weightsPtr[offset] * tsdfPtr[offset] + weight * tsdf) / weightSum;
-        colorsPtr[offset] = (weightsPtr[offset] * colorsPtr[offset] + weight * rgb) / weightSum;
-        weightsPtr[offset] += weight;
-      }
+        voxelBlock->MarkDirty();
+        const size_t offset = voxelId.x + voxelId.y * BlockProperties<float>::blockSize
+                              + voxelId.z * BlockProperties<float>::blockSize
+                                    * BlockProperties<float>::blockSize;
+
+        voxelBlock->Integrate(offset, tsdf, weightTable_(tsdf), rgb);
+      });
     }
-  }
+  } // omp parallel
   STOP_CHRONO();
+  LogCacheStats();
 }
 
-void Fusion::UpdateGradients()
+void Fusion::IntegratePointCloud(OPCType const &opc)
 {
-  START_CHRONO("Update gradients");
-  static const Index3d BLOCK_DIM(
-      1, BlockProperties<float, 16>::blockSize,
-      BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize);
-  static const Index3d PBLOCK_SIZE(
-      1, BlockProperties<float, 16>::blockSize + 2,
-      (BlockProperties<float, 16>::blockSize + 2) * (BlockProperties<float, 16>::blockSize + 2));
+  if(integrationMode_ == IntegrationMode::BlockBucketed)
+  {
+    IntegratePointCloudBucketed(opc);
+    return;
+  }
 
-#pragma omp parallel
+  START_CHRONO("Integrate OPC");
+
+#pragma omp parallel num_threads(numThreads_)
   {
-    float *packedTSDF = (float *) malloc(
-        ((BlockProperties<float, 16>::blockSize + 2) * (BlockProperties<float, 16>::blockSize + 2)
-         * (BlockProperties<float, 16>::blockSize + 2))
-        * sizeof(float));
+    BlockCache blockCache(volume_);
 
-#pragma omp for
-    for(size_t id = 0; id < newBlocks_.size(); id++)
+#pragma omp for schedule(static)
+    for(size_t i = 0; i < opc.Height(); i++)
     {
-      const BlockId &blockId = newBlocks_[id];
-      if(volume_.GetBlock(blockId) == NULL)
+      for(size_t j = 0; j < opc.Width(); j++)
       {
-        continue;
-      }
+        const Point3f org = opc.Points(i, j);
+        const Vec3f u = opc.Normals(i, j);
 
-      Vec3f *gradPtr = volume_.GetBlock(blockId)->Gradients();
+        if(org.x == FLT_MAX)
+        {
+          continue;
+        }
 
-      PackTSDF(blockId, packedTSDF);
+        if(u.x == 0 && u.y == 0 && u.z == 0)
+        {
+          continue;
+        }
 
-      for(size_t k = 1; k < BlockProperties<float, 16>::blockSize + 1; k++)
-      {
-        for(size_t j = 1; j < BlockProperties<float, 16>::blockSize + 1; j++)
+        if(u.x == FLT_MAX || u.y == FLT_MAX || u.z == FLT_MAX)
         {
-          for(size_t i = 1; i < BlockProperties<float, 16>::blockSize + 1; i++)
+          continue;
+        }
+
+        const Color3f rgb = opc.Colors(i, j);
+
+        ForEachRaySample(org, u, [&](const BlockId &id, const Index3d &voxelId, const float tsdf) {
+          // Update volume TSDF
+          VoxelBlock *voxelBlock = blockCache.GetBlock(id);
+          if(voxelBlock == NULL)
           {
-            const float dx = packedTSDF[Dot(Index3d(i + 1, j, k), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i - 1, j, k), PBLOCK_SIZE)];
-            const float dy = packedTSDF[Dot(Index3d(i, j + 1, k), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i, j - 1, k), PBLOCK_SIZE)];
-            const float dz = packedTSDF[Dot(Index3d(i, j, k + 1), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i, j, k - 1), PBLOCK_SIZE)];
-
-            gradPtr[Dot(Index3d(i - 1, j - 1, k - 1), BLOCK_DIM)] = Vec3f(dx, dy, dz) / voxelRes_;
+            return;
           }
-        }
+          voxelBlock->MarkDirty();
+          const size_t offset = voxelId.x + voxelId.y * BlockProperties<float>::blockSize
+                                + voxelId.z * BlockProperties<float>::blockSize
+                                      * BlockProperties<float>::blockSize;
+          voxelBlock->Integrate(offset, tsdf, weightTable_(tsdf), rgb);
+        });
       }
     }
-
-    free(packedTSDF);
   } // omp parallel
   STOP_CHRONO();
+  LogCacheStats();
 }
 
-void Fusion::UpdateAllGradients()
+void Fusion::IntegratePointCloudBucketed(
+    PointCloudType const &inputCloud, const Point3f &cameraCenter)
 {
-  START_CHRONO("Update all gradients");
-  static const Index3d BLOCK_DIM(
-      1, BlockProperties<float, 16>::blockSize,
-      BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize);
-  static const Index3d PBLOCK_SIZE(
-      1, BlockProperties<float, 16>::blockSize + 2,
-      (BlockProperties<float, 16>::blockSize + 2) * (BlockProperties<float, 16>::blockSize + 2));
+  START_CHRONO("Integrate point cloud (bucketed)");
+  PrepareBuckets();
+  BucketPointCloud(inputCloud, cameraCenter);
+  SortSampleBuckets();
+  IntegrateBuckets();
+  STOP_CHRONO();
+}
 
-  BlockIdList allBlocks = volume_.GetAllIds();
-#pragma omp parallel shared(allBlocks)
+void Fusion::BucketPointCloud(
+    PointCloudType const &inputCloud, const Point3f &cameraCenter, const uint32_t frame)
+{
+  const size_t numBlocks = newBlocks_.size();
+#pragma omp parallel num_threads(numThreads_)
   {
-    float *packedTSDF = (float *) malloc(
-        ((BlockProperties<float, 16>::blockSize + 2) * (BlockProperties<float, 16>::blockSize + 2)
-         * (BlockProperties<float, 16>::blockSize + 2))
-        * sizeof(float));
+    const size_t threadId = omp_get_thread_num();
+    SampleList &samples = workspace_.threadSamples[threadId];
+    size_t *blockCounts = workspace_.bucketCursors.data() + threadId * numBlocks;
 
-#pragma omp for
-    for(size_t id = 0; id < allBlocks.size(); id++)
+#pragma omp for schedule(static)
+    for(size_t i = 0; i < inputCloud.Size(); i++)
     {
-      const BlockId &blockId = allBlocks[id];
-      if(volume_.GetBlock(blockId) == NULL)
-      {
-        continue;
-      }
+      const Point3f org = inputCloud.Points()[i];
+      const Vec3f u = Vec3f::Normalize(org - cameraCenter);
+      BucketRaySamples(org, u, inputCloud.Colors()[i], frame, samples, blockCounts);
+    }
+  } // omp parallel
+}
 
-      Vec3f *gradPtr = volume_.GetBlock(blockId)->Gradients();
+void Fusion::IntegratePointCloudBucketed(OPCType const &opc)
+{
+  START_CHRONO("Integrate OPC (bucketed)");
+  PrepareBuckets();
 
-      PackTSDF(blockId, packedTSDF);
+  const size_t numBlocks = newBlocks_.size();
+#pragma omp parallel num_threads(numThreads_)
+  {
+    const size_t threadId = omp_get_thread_num();
+    SampleList &samples = workspace_.threadSamples[threadId];
+    size_t *blockCounts = workspace_.bucketCursors.data() + threadId * numBlocks;
 
-      for(size_t k = 1; k < BlockProperties<float, 16>::blockSize + 1; k++)
+#pragma omp for schedule(static)
+    for(size_t i = 0; i < opc.Height(); i++)
+    {
+      for(size_t j = 0; j < opc.Width(); j++)
       {
-        for(size_t j = 1; j < BlockProperties<float, 16>::blockSize + 1; j++)
+        const Point3f org = opc.Points(i, j);
+        const Vec3f u = opc.Normals(i, j);
+
+        if(org.x == FLT_MAX)
         {
-          for(size_t i = 1; i < BlockProperties<float, 16>::blockSize + 1; i++)
-          {
-            const float dx = packedTSDF[Dot(Index3d(i + 1, j, k), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i - 1, j, k), PBLOCK_SIZE)];
-            const float dy = packedTSDF[Dot(Index3d(i, j + 1, k), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i, j - 1, k), PBLOCK_SIZE)];
-            const float dz = packedTSDF[Dot(Index3d(i, j, k + 1), PBLOCK_SIZE)]
-                             - packedTSDF[Dot(Index3d(i, j, k - 1), PBLOCK_SIZE)];
-
-            gradPtr[Dot(Index3d(i - 1, j - 1, k - 1), BLOCK_DIM)] = Vec3f(dx, dy, dz) / voxelRes_;
-          }
+          continue;
         }
+
+        if(u.x == 0 && u.y == 0 && u.z == 0)
+        {
+          continue;
+        }
+
+        if(u.x == FLT_MAX || u.y == FLT_MAX || u.z == FLT_MAX)
+        {
+          continue;
+        }
+
+        BucketRaySamples(org, u, opc.Colors(i, j), 0, samples, blockCounts);
       }
     }
-
-    free(packedTSDF);
   } // omp parallel
+
+  SortSampleBuckets();
+  IntegrateBuckets();
   STOP_CHRONO();
 }
 
-void Fusion::PackTSDF(const BlockId &blockId, float *__restrict__ packedTSDF)
+void Fusion::IntegrateProjective(
+    const FrameType &depthMap, const IntrinsicsType &intrinsics, const Mat4f &transform,
+    const float near, const float far)
 {
-  const Index3d BLOCK_DIM(
-      1, BlockProperties<float, 16>::blockSize,
-      BlockProperties<float, 16>::blockSize * BlockProperties<float, 16>::blockSize);
-  const Index3d PBLOCK_SIZE(
-      1, BlockProperties<float, 16>::blockSize + 2,
-      (BlockProperties<float, 16>::blockSize + 2) * (BlockProperties<float, 16>::blockSize + 2));
-
-  const BlockId bMinusX = blockId - BlockId(1, 0, 0);
-  const BlockId bPlusX = blockId + BlockId(1, 0, 0);
-  const BlockId bMinusY = blockId - BlockId(0, 1, 0);
-  const BlockId bPlusY = blockId + BlockId(0, 1, 0);
-  const BlockId bMinusZ = blockId - BlockId(0, 0, 1);
-  const BlockId bPlusZ = blockId + BlockId(0, 0, 1);
-
-  const float *TSDF = volume_.GetBlock(blockId)->TSDF();
-  const float *mXTSDF =
-      volume_.GetBlock(bMinusX) != NULL ? volume_.GetBlock(bMinusX)->TSDF() : NULL;
-  const float *pXTSDF = volume_.GetBlock(bPlusX) != NULL ? volume_.GetBlock(bPlusX)->TSDF() : NULL;
-  const float *mYTSDF =
-      volume_.GetBlock(bMinusY) != NULL ? volume_.GetBlock(bMinusY)->TSDF() : NULL;
-  const float *pYTSDF = volume_.GetBlock(bPlusY) != NULL ? volume_.GetBlock(bPlusY)->TSDF() : NULL;
-  const float *mZTSDF =
-      volume_.GetBlock(bMinusZ) != NULL ? volume_.GetBlock(bMinusZ)->TSDF() : NULL;
-  const float *pZTSDF = volume_.GetBlock(bPlusZ) != NULL ? volume_.GetBlock(bPlusZ)->TSDF() : NULL;
+  START_CHRONO("Integrate projective");
+  const Mat4f worldToCam = Mat4f::Inverse(transform);
 
-  // Along X axis
-  if(mXTSDF != NULL)
+#pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
+  for(size_t blockIndex = 0; blockIndex < newBlocks_.size(); blockIndex++)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+    const BlockId &blockId = newBlocks_[blockIndex];
+    VoxelBlock *voxelBlock = volume_.GetBlock(blockId);
+    if(voxelBlock == NULL)
     {
-      for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
-      {
-        packedTSDF[Dot(Index3d(0, j + 1, k + 1), PBLOCK_SIZE)] =
-            mXTSDF[Dot(Index3d(BlockProperties<float, 16>::blockSize - 1, j, k), BLOCK_DIM)];
-      }
+      continue;
     }
+    IntegrateBlockProjective(*voxelBlock, blockId, depthMap, intrinsics, worldToCam, near, far);
   }
-  else
+  STOP_CHRONO();
+}
+
+void Fusion::IntegrateBlockProjective(
+    VoxelBlock &voxelBlock, const BlockId &blockId, const FrameType &depthMap,
+    const IntrinsicsType &intrinsics, const Mat4f &worldToCam, const float near, const float far)
+{
+  static constexpr size_t blockSize = BlockProperties<float>::blockSize;
+
+  const int width = depthMap.Width();
+  const int height = depthMap.Height();
+  const uint16_t *depth = depthMap.Depth();
+  const uint8_t *color = depthMap.Color();
+
+  // Compact blocks, and blocks whose rows are not contiguous, are copied row by row around the
+  // float kernel
+  const bool copyRows =
+      voxelBlock.Storage() == VoxelStorage::Compact || !VoxelLayout::isLinear;
+  float *__restrict tsdfPtr = voxelBlock.TSDF();
+  Color3f *__restrict colorsPtr = voxelBlock.Colors();
+  float *__restrict weightsPtr = voxelBlock.Weights();
+  float rowTsdf[blockSize];
+  float rowWeights[blockSize];
+  Color3f rowColors[blockSize];
+
+  const Index3d blockOrg = GetVoxelAbsolutePos(blockId, Index3d(0));
+  for(size_t k = 0; k < blockSize; k++)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+    for(size_t j = 0; j < blockSize; j++)
     {
-      for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
+      // Project a whole row of voxels, then merge it with the vectorized kernel
+      float sampleTsdf[blockSize];
+      float sampleMask[blockSize];
+      Color3f sampleRgb[blockSize];
+      size_t numValid = 0;
+
+      for(size_t i = 0; i < blockSize; i++)
       {
-        packedTSDF[Dot(Index3d(0, j + 1, k + 1), PBLOCK_SIZE)] = 0;
+        sampleTsdf[i] = 0.0f;
+        sampleMask[i] = 0.0f;
+
+        const Point3f voxelPos = GetVoxelPos(blockOrg + Index3d(i, j, k), voxelRes_);
+        const Point3f p = worldToCam * voxelPos;
+        if(p.z <= near)
+        {
+          continue;
+        }
+
+        const float x = p.x / p.z;
+        const float y = p.y / p.z;
+        const int u = (int) roundf(intrinsics.fx * x + intrinsics.cx);
+        const int v = (int) roundf(intrinsics.fy * y + intrinsics.cy);
+        if(u < 0 || v < 0 || u >= width || v >= height)
+        {
+          continue;
+        }
+
+        const size_t index = v * width + u;
+        const float z = float(depth[index]) / depthScale_;
+        if(depth[index] == 0 || z <= near || z > far)
+        {
+          continue;
+        }
+
+        // Distance along the pixel ray, to match the ray marching integration
+        const float tsdf = (z - p.z) * sqrtf(1.0f + x * x + y * y);
+        if(tsdf > tau_ || tsdf < -tau_)
+        {
+          continue;
+        }
+
+        sampleTsdf[i] = tsdf;
+        sampleMask[i] = 1.0f;
+        sampleRgb[i] =
+            Color3f(color[3 * index], color[3 * index + 1], color[3 * index + 2]) / 255.0f;
+        numValid++;
       }
-    }
-  }
 
-  if(pXTSDF != NULL)
-  {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
-    {
-      for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
+      if(numValid == 0)
       {
-        packedTSDF[Dot(
-            Index3d(BlockProperties<float, 16>::blockSize + 1, j + 1, k + 1), PBLOCK_SIZE)] =
-            pXTSDF[Dot(Index3d(0, j, k), BLOCK_DIM)];
+        continue;
       }
-    }
-  }
-  else
-  {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
-    {
-      for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
+      voxelBlock.MarkDirty();
+
+      const size_t offset = j * blockSize + k * blockSize * blockSize;
+      if(copyRows)
+      {
+        voxelBlock.ReadVoxels(offset, blockSize, rowTsdf, rowWeights, rowColors);
+        integrateVoxels(
+            rowTsdf, rowWeights, rowColors, sampleTsdf, sampleRgb, sampleMask, blockSize,
+            weightTable_);
+        voxelBlock.WriteVoxels(offset, blockSize, rowTsdf, rowWeights, rowColors);
+      }
+      else
       {
-        packedTSDF[Dot(
-            Index3d(BlockProperties<float, 16>::blockSize + 1, j + 1, k + 1), PBLOCK_SIZE)] = 0;
+        integrateVoxels(
+            tsdfPtr + VoxelBlock::PaddedOffset(offset), weightsPtr + offset, colorsPtr + offset,
+            sampleTsdf, sampleRgb, sampleMask, blockSize, weightTable_);
       }
+      voxelBlock.PushHalos(offset, blockSize);
     }
   }
+}
 
-  // Along Y axis
-  if(mYTSDF != NULL)
+void Fusion::PrepareBuckets()
+{
+  const size_t numBlocks = newBlocks_.size();
+  workspace_.blockIndices.Clear();
+  for(size_t i = 0; i < numBlocks; i++)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
-    {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(Index3d(i + 1, 0, k + 1), PBLOCK_SIZE)] =
-            mYTSDF[Dot(Index3d(i, BlockProperties<float, 16>::blockSize - 1, k), BLOCK_DIM)];
-      }
-    }
+    workspace_.blockIndices.Insert(newBlocks_[i], i);
   }
-  else
+
+  for(auto &samples : workspace_.threadSamples)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+    samples.clear();
+  }
+  workspace_.bucketCursors.assign(numThreads_ * numBlocks, 0);
+}
+
+void Fusion::BucketRaySamples(
+    const Point3f &org, const Vec3f &u, const Color3f &rgb, const uint32_t frame,
+    SampleList &samples, size_t *blockCounts)
+{
+  ForEachRaySample(org, u, [&](const BlockId &id, const Index3d &voxelId, const float tsdf) {
+    // Ids out of range alias other packed keys, see ValidBlockId
+    int blockIndex;
+    if(!ValidBlockId(id) || !workspace_.blockIndices.Find(id, blockIndex))
     {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(Index3d(i + 1, 0, k + 1), PBLOCK_SIZE)] = 0;
-      }
+      return;
     }
-  }
 
-  if(pYTSDF != NULL)
+    const size_t offset = voxelId.x + voxelId.y * BlockProperties<float>::blockSize
+                          + voxelId.z * BlockProperties<float>::blockSize
+                                * BlockProperties<float>::blockSize;
+
+    samples.push_back({uint32_t(blockIndex), frame, uint32_t(offset), tsdf, rgb});
+    blockCounts[blockIndex]++;
+  });
+}
+
+void Fusion::SortSampleBuckets()
+{
+  const size_t numBlocks = newBlocks_.size();
+  const size_t numThreads = workspace_.threadSamples.size();
+
+  // Per thread counts are turned into scatter positions, keeping samples of a bucket in thread
+  // order so that the result does not depend on scheduling.
+  size_t numSamples = 0;
+  workspace_.bucketOffsets.resize(numBlocks + 1);
+  for(size_t blockIndex = 0; blockIndex < numBlocks; blockIndex++)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+    workspace_.bucketOffsets[blockIndex] = numSamples;
+    for(size_t threadId = 0; threadId < numThreads; threadId++)
     {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(
-            Index3d(i + 1, BlockProperties<float, 16>::blockSize + 1, k + 1), PBLOCK_SIZE)] =
-            pYTSDF[Dot(Index3d(i, 0, k), BLOCK_DIM)];
-      }
+      size_t &cursor = workspace_.bucketCursors[threadId * numBlocks + blockIndex];
+      const size_t count = cursor;
+      cursor = numSamples;
+      numSamples += count;
     }
   }
-  else
+  workspace_.bucketOffsets[numBlocks] = numSamples;
+  workspace_.bucketedSamples.resize(numSamples);
+
+#pragma omp parallel for num_threads(numThreads_) schedule(static, 1)
+  for(size_t threadId = 0; threadId < numThreads; threadId++)
   {
-    for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+    size_t *cursors = workspace_.bucketCursors.data() + threadId * numBlocks;
+    for(const auto &sample : workspace_.threadSamples[threadId])
     {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(
-            Index3d(i + 1, BlockProperties<float, 16>::blockSize + 1, k + 1), PBLOCK_SIZE)] = 0;
-      }
+      workspace_.bucketedSamples[cursors[sample.blockIndex]++] = sample;
     }
   }
+}
 
-  // Along Z axis
-  if(mZTSDF != NULL)
+void Fusion::IntegrateBuckets(const size_t numFrames)
+{
+  const size_t numBlocks = newBlocks_.size();
+  const size_t numThreads = workspace_.threadSamples.size();
+  if(workspace_.bucketMergeCursors.size() < numThreads_ * numThreads)
   {
-    for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
-    {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(Index3d(i + 1, j + 1, 0), PBLOCK_SIZE)] =
-            mZTSDF[Dot(Index3d(i, j, BlockProperties<float, 16>::blockSize - 1), BLOCK_DIM)];
-      }
-    }
+    workspace_.bucketMergeCursors.resize(numThreads_ * numThreads);
   }
-  else
+
+#pragma omp parallel num_threads(numThreads_)
   {
-    for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
+    size_t *cursors = workspace_.bucketMergeCursors.data() + omp_get_thread_num() * numThreads;
+
+#pragma omp for schedule(dynamic)
+    for(size_t blockIndex = 0; blockIndex < numBlocks; blockIndex++)
     {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
+      const size_t first = workspace_.bucketOffsets[blockIndex];
+      const size_t last = workspace_.bucketOffsets[blockIndex + 1];
+      if(first == last)
       {
-        packedTSDF[Dot(Index3d(i + 1, j + 1, 0), PBLOCK_SIZE)] = 0;
+        continue;
       }
-    }
-  }
 
-  if(pZTSDF != NULL)
-  {
-    for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
-    {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
+      VoxelBlock *voxelBlock = volume_.GetBlock(newBlocks_[blockIndex]);
+      if(voxelBlock == NULL)
       {
-        packedTSDF[Dot(
-            Index3d(i + 1, j + 1, BlockProperties<float, 16>::blockSize + 1), PBLOCK_SIZE)] =
-            pZTSDF[Dot(Index3d(i, j, 0), BLOCK_DIM)];
+        continue;
       }
-    }
-  }
-  else
-  {
-    for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
-    {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
+      voxelBlock->MarkDirty();
+
+      // A bucket holds one run of samples per bucketing thread, each one in frame order. Runs are
+      // merged frame by frame so that voxels see the frames in the same order as when they are
+      // integrated one by one. After SortSampleBuckets, bucket cursors point at the end of runs.
+      for(size_t threadId = 0; threadId < numThreads; threadId++)
       {
-        packedTSDF[Dot(
-            Index3d(i + 1, j + 1, BlockProperties<float, 16>::blockSize + 1), PBLOCK_SIZE)] = 0;
+        cursors[threadId]
+            = threadId == 0 ? first
+                            : workspace_.bucketCursors[(threadId - 1) * numBlocks + blockIndex];
+      }
+      for(size_t frame = 0; frame < numFrames; frame++)
+      {
+        for(size_t threadId = 0; threadId < numThreads; threadId++)
+        {
+          const size_t end = workspace_.bucketCursors[threadId * numBlocks + blockIndex];
+          size_t &i = cursors[threadId];
+          for(; i < end && workspace_.bucketedSamples[i].frame == frame; i++)
+          {
+            const IntegrationSample &sample = workspace_.bucketedSamples[i];
+            voxelBlock->Integrate(
+                sample.offset, sample.tsdf, weightTable_(sample.tsdf), sample.rgb);
+          }
+        }
       }
     }
-  }
+  } // omp parallel
+}
+
+void Fusion::LogCacheStats()
+{
+  const size_t lookups = volume_.CacheHits() + volume_.CacheMisses();
+  utils::Log::Info(
+      "Fusion", "Block cache : %lu lookups, hit rate %.2f%%\n", lookups,
+      100.0f * volume_.CacheHitRate());
+  volume_.ResetCacheStats();
+}
+
+// Amanatides & Woo, "A Fast Voxel Traversal Algorithm for Ray Tracing", on the block grid. Every
+// block crossed by the segment [first, last] is visited exactly once.
+void Fusion::TraverseBlocks(const Point3f &first, const Point3f &last, BlockUpdateList &foundIds)
+{
+  const float blockRes = float(BlockProperties<float>::blockSize) * voxelRes_;
+  const Vec3f p0 = first / blockRes;
+  const Vec3f dir = (last - first) / blockRes;
 
-  // Inner block
-  for(size_t k = 0; k < BlockProperties<float, 16>::blockSize; k++)
+  BlockId id = GetId(first, voxelRes_);
+  const BlockId lastId = GetId(last, voxelRes_);
+
+  auto initAxis = [](const float p, const float d, const int id, int &step, float &tMax,
+                     float &tDelta) {
+    if(d > 0.0f)
+    {
+      step = 1;
+      tDelta = 1.0f / d;
+      tMax = (float(id + 1) - p) / d;
+    }
+    else if(d < 0.0f)
+    {
+      step = -1;
+      tDelta = -1.0f / d;
+      tMax = (float(id) - p) / d;
+    }
+    else
+    {
+      step = 0;
+      tDelta = std::numeric_limits<float>::max();
+      tMax = std::numeric_limits<float>::max();
+    }
+  };
+
+  int stepX, stepY, stepZ;
+  float tMaxX, tMaxY, tMaxZ;
+  float tDeltaX, tDeltaY, tDeltaZ;
+  initAxis(p0.x, dir.x, id.x, stepX, tMaxX, tDeltaX);
+  initAxis(p0.y, dir.y, id.y, stepY, tMaxY, tDeltaY);
+  initAxis(p0.z, dir.z, id.z, stepZ, tMaxZ, tDeltaZ);
+
+  // Bounds the walk when rounding makes it miss the last block
+  const int maxSteps =
+      std::abs(lastId.x - id.x) + std::abs(lastId.y - id.y) + std::abs(lastId.z - id.z);
+
+  foundIds.Add(id);
+  for(int i = 0; i < maxSteps && !(id == lastId); i++)
   {
-    for(size_t j = 0; j < BlockProperties<float, 16>::blockSize; j++)
+    if(tMaxX <= tMaxY && tMaxX <= tMaxZ)
     {
-      for(size_t i = 0; i < BlockProperties<float, 16>::blockSize; i++)
-      {
-        packedTSDF[Dot(Index3d(i + 1, j + 1, k + 1), PBLOCK_SIZE)] =
-            TSDF[Dot(Index3d(i, j, k), BLOCK_DIM)];
-      }
+      id.x += stepX;
+      tMaxX += tDeltaX;
+    }
+    else if(tMaxY <= tMaxZ)
+    {
+      id.y += stepY;
+      tMaxY += tDeltaY;
+    }
+    else
+    {
+      id.z += stepZ;
+      tMaxZ += tDeltaZ;
     }
+    foundIds.Add(id);
   }
 }
 
 // From : https://gist.github.com/yamamushi/5823518
-void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<Index3d> &foundIds)
+void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, BlockUpdateList &foundIds)
 {
   const int dx = maxId.x - minId.x;
   const int dy = maxId.y - minId.y;
@@ -687,7 +1237,7 @@ void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<
 
   const int dx2 = dx << 1;
   const int dy2 = dy << 1;
-  const int dz2 = dz << 2;
+  const int dz2 = dz << 1;
 
   int err1;
   int err2;
@@ -700,7 +1250,7 @@ void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<
     err2 = dz2 - l;
     for(int i = 0; i <= l; i++)
     {
-      foundIds.emplace(id);
+      foundIds.Add(id);
       if(err1 > 0)
       {
         id.y += incY;
@@ -723,7 +1273,7 @@ void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<
     err2 = dz2 - m;
     for(int i = 0; i <= m; i++)
     {
-      foundIds.emplace(id);
+      foundIds.Add(id);
       if(err1 > 0)
       {
         id.x += incX;
@@ -745,7 +1295,7 @@ void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<
     err2 = dx2 - n;
     for(int i = 0; i <= n; i++)
     {
-      foundIds.emplace(id);
+      foundIds.Add(id);
       if(err1 > 0)
       {
         id.y += incY;
@@ -761,7 +1311,7 @@ void Fusion::RaycastVoxels(const Index3d &minId, const Index3d &maxId, std::set<
       id.z += incZ;
     }
   }
-  foundIds.emplace(id);
+  foundIds.Add(id);
 }
 } // namespace fusion
 } // namespace spf
@@ -16,6 +16,7 @@
  */
 
 #include "spf/fusion/Volume.hpp"
+#include <omp.h>
 #include <dirent.h>
 #include <zlib.h>
 
@@ -23,112 +24,562 @@ namespace spf
 {
 namespace fusion
 {
-Volume::Volume(const float voxelRes)
+Volume::Volume(const float voxelRes, const BlockBounds &bounds) :
+    voxelRes_(voxelRes),
+    numThreads_(omp_get_max_threads()),
+    pool_(VoxelBlock::VoxelBytes(storage_, true)),
+    blockIds_(bounds)
 {
-  this->nextBlockIndex_ = 0;
-  this->voxelRes_ = voxelRes;
+  if(!bounds.Empty())
+  {
+    utils::Log::Info(
+        "Volume", "Dense block index of %lu blocks, from (%d %d %d) to (%d %d %d)\n",
+        bounds.NumBlocks(), bounds.min.x, bounds.min.y, bounds.min.z, bounds.max.x, bounds.max.y,
+        bounds.max.z);
+  }
+}
+
+void Volume::AllocateBlock(const BlockId &blockId)
+{
+  const size_t chunk = pool_.AddChunk();
+  BlockPtrType block(new VoxelBlock(voxelRes_, true, storage_, quantization_, pool_[chunk]));
+
+  if(freeIndices_.Empty())
+  {
+    blockIds_.Insert(blockId, voxelBlocks_.size());
+    voxelBlocks_.push_back(std::move(block));
+    meshes_.push_back(MeshPtrType(nullptr));
+    blockChunks_.push_back(chunk);
+    lastUse_.push_back(currentFrame_);
+    stored_.push_back(false);
+    LinkBlock(blockId, *voxelBlocks_.back());
+    return;
+  }
+
+  const size_t index = freeIndices_.Pop();
+  blockIds_.Insert(blockId, index);
+  voxelBlocks_[index] = std::move(block);
+  blockChunks_[index] = chunk;
+  lastUse_[index] = currentFrame_;
+  stored_[index] = false;
+  LinkBlock(blockId, *voxelBlocks_[index]);
+}
+
+void Volume::LinkBlock(const BlockId &blockId, VoxelBlock &block)
+{
+  for(int k = -1; k <= 1; k++)
+  {
+    for(int j = -1; j <= 1; j++)
+    {
+      for(int i = -1; i <= 1; i++)
+      {
+        if(i == 0 && j == 0 && k == 0)
+        {
+          continue;
+        }
+        VoxelBlock *neighbour = GetBlock(blockId + BlockId(i, j, k));
+        block.SetNeighbour(BlockId(i, j, k), neighbour);
+        if(neighbour != nullptr)
+        {
+          neighbour->SetNeighbour(BlockId(-i, -j, -k), &block);
+        }
+      }
+    }
+  }
+  SyncHalos(block);
+}
+
+void Volume::UnlinkBlock(VoxelBlock &block)
+{
+  for(int k = -1; k <= 1; k++)
+  {
+    for(int j = -1; j <= 1; j++)
+    {
+      for(int i = -1; i <= 1; i++)
+      {
+        VoxelBlock *neighbour = block.Neighbour(i, j, k);
+        if(neighbour != nullptr && neighbour != &block)
+        {
+          neighbour->SetNeighbour(BlockId(-i, -j, -k), nullptr);
+          neighbour->ClearHalo(BlockId(-i, -j, -k));
+        }
+      }
+    }
+  }
+}
+
+void Volume::SyncHalos(VoxelBlock &block)
+{
+  if(!block.HasHalo())
+  {
+    return;
+  }
+
+  for(int k = -1; k <= 1; k++)
+  {
+    for(int j = -1; j <= 1; j++)
+    {
+      for(int i = -1; i <= 1; i++)
+      {
+        if(i == 0 && j == 0 && k == 0)
+        {
+          continue;
+        }
+        VoxelBlock *neighbour = block.Neighbour(i, j, k);
+        if(neighbour == nullptr)
+        {
+          block.ClearHalo(BlockId(i, j, k));
+          continue;
+        }
+        block.CopyHalo(*neighbour, BlockId(i, j, k));
+        neighbour->CopyHalo(block, BlockId(-i, -j, -k));
+      }
+    }
+  }
 }
 
 bool Volume::AddBlock(const BlockId &blockId)
 {
-  if(blockIds_.find(blockId) != blockIds_.end())
+  int index;
+  if(blockIds_.Find(blockId, index))
   {
+    lastUse_[index] = currentFrame_;
     return false;
   }
 
-  blockIds_[blockId] = nextBlockIndex_;
-  nextBlockIndex_++;
+  if(!blockIds_.InBounds(blockId))
+  {
+    return false;
+  }
 
-  voxelBlocks_.push_back(BlockPtrType(new VoxelBlock(voxelRes_)));
-  meshes_.push_back(MeshPtrType(nullptr));
+  if(store_.Contains(blockId))
+  {
+    ReloadBlocks(BlockIdList(1, blockId));
+    blockIds_.ReleaseOldTables();
+    return false;
+  }
 
+  AllocateBlock(blockId);
+  blockIds_.ReleaseOldTables();
   return true;
 }
 
 size_t Volume::AddBlocks(const BlockIdList &blockList)
 {
   size_t numAllocated = 0;
+  BlockIdList spilledIds;
   for(size_t i = 0; i < blockList.size(); i++)
   {
     const BlockId &blockId = blockList[i];
-    if(blockIds_.find(blockId) != blockIds_.end())
+    int index;
+    if(blockIds_.Find(blockId, index))
     {
+      lastUse_[index] = currentFrame_;
       continue;
     }
 
-    blockIds_[blockId] = nextBlockIndex_;
-    nextBlockIndex_++;
+    if(!blockIds_.InBounds(blockId))
+    {
+      continue;
+    }
 
-    voxelBlocks_.push_back(BlockPtrType(new VoxelBlock(voxelRes_)));
-    meshes_.push_back(MeshPtrType(nullptr));
+    if(store_.Contains(blockId))
+    {
+      spilledIds.push_back(blockId);
+      continue;
+    }
+
+    AllocateBlock(blockId);
     numAllocated++;
   }
+  ReloadBlocks(spilledIds);
+  blockIds_.ReleaseOldTables();
 
   return numAllocated;
 }
 
+size_t Volume::LoadBlocks(const BlockIdList &blockList)
+{
+  BlockIdList spilledIds;
+  for(const auto &blockId : blockList)
+  {
+    int index;
+    if(blockIds_.Find(blockId, index))
+    {
+      lastUse_[index] = currentFrame_;
+    }
+    else if(store_.Contains(blockId))
+    {
+      spilledIds.push_back(blockId);
+    }
+  }
+  ReloadBlocks(spilledIds);
+
+  return spilledIds.size();
+}
+
+void Volume::ReloadBlocks(const BlockIdList &blockIds)
+{
+  if(blockIds.empty())
+  {
+    return;
+  }
+
+  for(const auto &blockId : blockIds)
+  {
+    AllocateBlock(blockId);
+  }
+
+#pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
+  for(size_t i = 0; i < blockIds.size(); i++)
+  {
+    int index = 0;
+    blockIds_.Find(blockIds[i], index);
+    stored_[index] = store_.Read(blockIds[i], *voxelBlocks_[index], &meshes_[index]);
+    if(!stored_[index])
+    {
+      voxelBlocks_[index]->Clear();
+      meshes_[index].reset();
+    }
+  }
+
+  // The halos read from the store may be stale, and the reads may have overwritten the voxels
+  // pushed to them by the neighbours
+  for(const auto &blockId : blockIds)
+  {
+    int index = 0;
+    blockIds_.Find(blockId, index);
+    SyncHalos(*voxelBlocks_[index]);
+    store_.Remove(blockId);
+  }
+  utils::Log::Info("Volume", "Reloaded %lu spilled blocks\n", blockIds.size());
+}
+
+bool Volume::SetMemoryBudget(const size_t memoryBudget, const std::string &spillDir)
+{
+  if(memoryBudget > 0 && (!store_.IsOpen() || store_.Dir() != spillDir))
+  {
+    if(!store_.Empty())
+    {
+      utils::Log::Error(
+          "Volume", "Blocks are spilled in %s, the spill directory cannot change\n",
+          store_.Dir().c_str());
+      return false;
+    }
+    if(!store_.Open(spillDir))
+    {
+      return false;
+    }
+  }
+
+  memoryBudget_ = memoryBudget;
+  return true;
+}
+
+size_t Volume::EvictBlocks(const Point3f &center)
+{
+  if(memoryBudget_ == 0 || VoxelMemory() <= memoryBudget_)
+  {
+    return 0;
+  }
+
+  size_t numEvicted = 0;
+  START_CHRONO("Evict blocks");
+  struct Candidate
+  {
+    size_t lastUse;
+    float dist;
+    BlockId blockId;
+    int index;
+  };
+
+  const float blockSize = float(BlockProperties<float>::blockSize) * voxelRes_;
+  std::vector<Candidate> candidates;
+  candidates.reserve(blockIds_.Size());
+  blockIds_.ForEach([&](const BlockId &blockId, const int index) {
+    if(lastUse_[index] == currentFrame_)
+    {
+      return;
+    }
+    const Point3f blockCenter =
+        blockSize * Point3f(blockId.x + 0.5f, blockId.y + 0.5f, blockId.z + 0.5f);
+    candidates.push_back({lastUse_[index], Vec3f::Dist(blockCenter, center), blockId, index});
+  });
+
+  const size_t target = memoryBudget_ - memoryBudget_ / 8;
+  const size_t chunkSize = pool_.ChunkSize();
+  const size_t numVictims =
+      std::min((VoxelMemory() - target + chunkSize - 1) / chunkSize, candidates.size());
+  std::partial_sort(
+      candidates.begin(), candidates.begin() + numVictims, candidates.end(),
+      [](const Candidate &c0, const Candidate &c1) {
+        return c0.lastUse < c1.lastUse || (c0.lastUse == c1.lastUse && c0.dist > c1.dist);
+      });
+
+  // Blocks are only freed once written
+  std::vector<uint8_t> written(numVictims);
+#pragma omp parallel for num_threads(numThreads_) schedule(dynamic)
+  for(size_t i = 0; i < numVictims; i++)
+  {
+    const int index = candidates[i].index;
+    const VoxelBlock &voxelBlock = *voxelBlocks_[index];
+    const MeshType *mesh = meshes_[index].get();
+    if(voxelBlock.IsEmpty())
+    {
+      written[i] = true;
+    }
+    else if(stored_[index] && !voxelBlock.Dirty())
+    {
+      store_.Restore(candidates[i].blockId, mesh != nullptr ? mesh->NumTriangles() : 0);
+      written[i] = true;
+    }
+    else
+    {
+      written[i] = store_.Write(candidates[i].blockId, voxelBlock, mesh);
+    }
+  }
+
+  for(size_t i = 0; i < numVictims; i++)
+  {
+    if(written[i])
+    {
+      RemoveBlock(candidates[i].blockId);
+      numEvicted++;
+    }
+  }
+  blockIds_.ReleaseOldTables();
+  STOP_CHRONO();
+
+  utils::Log::Info(
+      "Volume", "Spilled %lu blocks to %s, %lu blocks in memory\n", numEvicted,
+      store_.Dir().c_str(), blockIds_.Size());
+  return numEvicted;
+}
+
+bool Volume::RemoveBlock(const BlockId &blockId)
+{
+  int index;
+  if(!blockIds_.Find(blockId, index))
+  {
+    return false;
+  }
+
+  blockIds_.Erase(blockId);
+  UnlinkBlock(*voxelBlocks_[index]);
+  voxelBlocks_[index].reset();
+  meshes_[index].reset();
+  pool_.RemoveChunk(blockChunks_[index]);
+  freeIndices_.Push(index);
+  return true;
+}
+
+size_t Volume::RemoveBlocks(const BlockIdList &blockList)
+{
+  size_t numRemoved = 0;
+  for(const auto &blockId : blockList)
+  {
+    numRemoved += RemoveBlock(blockId) ? 1 : 0;
+  }
+  blockIds_.ReleaseOldTables();
+  return numRemoved;
+}
+
+size_t Volume::CollectEmptyBlocks(const bool keepCurrentFrame)
+{
+  size_t numCollected = 0;
+  size_t numCandidates = 0;
+  START_CHRONO("Collect empty blocks");
+  BlockIdList candidateIds;
+  std::vector<int> candidateIndices;
+  candidateIds.reserve(blockIds_.Size());
+  candidateIndices.reserve(blockIds_.Size());
+  blockIds_.ForEach([&](const BlockId &blockId, const int index) {
+    if(!keepCurrentFrame || lastUse_[index] != currentFrame_)
+    {
+      candidateIds.push_back(blockId);
+      candidateIndices.push_back(index);
+    }
+  });
+
+  std::vector<uint8_t> empty(candidateIds.size());
+#pragma omp parallel for num_threads(numThreads_) schedule(dynamic, 64)
+  for(size_t i = 0; i < candidateIds.size(); i++)
+  {
+    empty[i] = voxelBlocks_[candidateIndices[i]]->IsEmpty();
+  }
+
+  BlockIdList emptyIds;
+  for(size_t i = 0; i < candidateIds.size(); i++)
+  {
+    if(empty[i])
+    {
+      emptyIds.push_back(candidateIds[i]);
+    }
+  }
+  numCollected = RemoveBlocks(emptyIds);
+  numCandidates = candidateIds.size();
+  STOP_CHRONO();
+
+  utils::Log::Info(
+      "Volume", "Collected %lu empty blocks out of %lu, %f MB reclaimed\n", numCollected,
+      numCandidates, double(numCollected * pool_.ChunkSize()) / (1024.0 * 1024.0));
+  return numCollected;
+}
+
+void Volume::SetVoxelStorage(const VoxelStorage storage, const VoxelQuantization &quantization)
+{
+  static constexpr size_t blockVolume = BlockProperties<float>::blockVolume;
+
+  storage_ = storage;
+  quantization_ = quantization;
+
+  // Blocks are converted into a new pool, chunk sizes depend on the storage
+  PoolType pool(VoxelBlock::VoxelBytes(storage_, true), useHugePages_);
+  std::vector<float> tsdf(blockVolume);
+  std::vector<float> weights(blockVolume);
+  std::vector<Color3f> colors(blockVolume);
+  for(size_t i = 0; i < voxelBlocks_.size(); i++)
+  {
+    auto &block = voxelBlocks_[i];
+    if(block == nullptr)
+    {
+      continue;
+    }
+
+    const bool useColor = block->UseColor();
+    block->ReadVoxels(0, blockVolume, tsdf.data(), weights.data(), colors.data());
+    const size_t chunk = pool.AddChunk();
+    block.reset(new VoxelBlock(voxelRes_, useColor, storage_, quantization_, pool[chunk]));
+    blockChunks_[i] = chunk;
+    block->WriteVoxels(0, blockVolume, tsdf.data(), weights.data(), colors.data());
+  }
+  pool_ = std::move(pool);
+
+  // Links still point to the previous blocks
+  blockIds_.ForEach(
+      [&](const BlockId &blockId, const int index) { LinkBlock(blockId, *voxelBlocks_[index]); });
+}
+
 Volume::MeshType *Volume::GetMesh(const BlockId &blockId)
 {
-  if(blockIds_.find(blockId) == blockIds_.end())
+  int index;
+  if(!blockIds_.Find(blockId, index))
   {
     return nullptr;
   }
-  return meshes_[blockIds_[blockId]].get();
+  return meshes_[index].get();
 }
 
 VoxelBlock *Volume::GetBlock(const BlockId &blockId)
 {
-  if(blockIds_.find(blockId) == blockIds_.end())
+  int index;
+  if(!blockIds_.Find(blockId, index))
   {
     return nullptr;
   }
-  return voxelBlocks_[blockIds_[blockId]].get();
+  return voxelBlocks_[index].get();
 }
 
 BlockIdList Volume::GetAllIds() const
 {
   BlockIdList ret;
-  for(const auto &id : blockIds_)
-  {
-    ret.push_back(id.first);
-  }
+  ret.reserve(blockIds_.Size());
+  blockIds_.ForEach([&](const BlockId &blockId, const int) { ret.push_back(blockId); });
   return ret;
 }
 
-void Volume::RecomputeMeshes(const BlockIdList &blockList)
+void Volume::ComputeMeshes(const BlockIdList &blockList)
 {
-  START_CHRONO("Update meshes");
-#pragma omp parallel shared(blockList)
+#pragma omp parallel num_threads(numThreads_) shared(blockList)
   {
-    MeshType tmp{3 * maxMeshSize_, maxMeshSize_};
+    MeshWorkspace workspace;
 
 #pragma omp for schedule(dynamic)
     for(size_t numBlock = 0; numBlock < blockList.size(); numBlock++)
     {
-      ComputeMesh(blockList[numBlock], tmp);
+      ComputeMesh(blockList[numBlock], workspace);
     }
   }
+}
+
+void Volume::RecomputeMeshes(const BlockIdList &blockList)
+{
+  START_CHRONO("Update meshes");
+  ComputeMeshes(blockList);
   STOP_CHRONO();
 }
 
 void Volume::RecomputeAllMeshes()
 {
-  START_CHRONO("Update all meshes");
-  BlockIdList idList;
-  for(auto &entry : blockIds_)
+  if(store_.Empty())
   {
-    idList.emplace_back(entry.first);
+    START_CHRONO("Update all meshes");
+    BlockIdList idList = GetAllIds();
+    SortBlockIds(idList);
+    ComputeMeshes(idList);
+    for(auto &voxelBlock : voxelBlocks_)
+    {
+      if(voxelBlock != nullptr)
+      {
+        voxelBlock->ClearDirty();
+      }
+    }
+    STOP_CHRONO();
+    return;
   }
 
-#pragma omp parallel shared(idList)
+  START_CHRONO("Update all meshes out of core");
+  BlockIdList idList = GetAllIds();
+
+  // Batches of consecutive ids in sorted order are made of neighbouring blocks. The raster order
+  // is kept rather than the Morton order : batches then sweep the volume, and the blocks evicted
+  // behind them are not needed again, while the Morton order comes back to the blocks along the
+  // boundaries of its octants.
+  const BlockIdList spilledIds = store_.GetAllIds();
+  idList.insert(idList.end(), spilledIds.begin(), spilledIds.end());
+  std::sort(idList.begin(), idList.end());
+
+  const size_t batchSize =
+      memoryBudget_ > 0 ? std::max(memoryBudget_ / (8 * pool_.ChunkSize()), size_t(1))
+                        : idList.size();
+  const float blockSize = float(BlockProperties<float>::blockSize) * voxelRes_;
+  BlockIdList batch;
+  BlockIdList neighbours;
+  for(size_t first = 0; first < idList.size(); first += batchSize)
   {
-    MeshType tmp{3 * maxMeshSize_, maxMeshSize_};
+    const size_t last = std::min(first + batchSize, idList.size());
+    batch.assign(idList.begin() + first, idList.begin() + last);
 
-#pragma omp for schedule(dynamic)
-    for(size_t numBlock = 0; numBlock < idList.size(); numBlock++)
+    neighbours.clear();
+    for(const auto &blockId : batch)
+    {
+      for(int k = -1; k <= 1; k++)
+      {
+        for(int j = -1; j <= 1; j++)
+        {
+          for(int i = -1; i <= 1; i++)
+          {
+            neighbours.emplace_back(blockId + BlockId(i, j, k));
+          }
+        }
+      }
+    }
+    SortBlockIds(neighbours);
+
+    AdvanceFrame();
+    LoadBlocks(neighbours);
+    ComputeMeshes(batch);
+    for(const auto &blockId : batch)
     {
-      ComputeMesh(idList[numBlock], tmp);
+      VoxelBlock *voxelBlock = GetBlock(blockId);
+      if(voxelBlock != nullptr)
+      {
+        voxelBlock->ClearDirty();
+      }
     }
+
+    const BlockId &mid = batch[batch.size() / 2];
+    EvictBlocks(blockSize * Point3f(mid.x + 0.5f, mid.y + 0.5f, mid.z + 0.5f));
   }
   STOP_CHRONO();
 }
@@ -138,7 +589,7 @@ void Volume::ExportMeshes(const char *filename)
   size_t numTriangles = 0;
 
   utils::Log::Info("Volume", "Recomputing meshes for all blocks...\n");
-  for(size_t i = 0; i < blockIds_.size(); i++)
+  for(size_t i = 0; i < meshes_.size(); i++)
   {
     auto *mesh = meshes_[i].get();
     if(mesh == nullptr)
@@ -147,6 +598,12 @@ void Volume::ExportMeshes(const char *filename)
     numTriangles += mesh->NumTriangles();
   }
 
+  const BlockIdList spilledIds = store_.GetAllIds();
+  for(const auto &blockId : spilledIds)
+  {
+    numTriangles += store_.NumTriangles(blockId);
+  }
+
   FILE *fp = fopen(filename, "w+");
   if(!fp)
   {
@@ -171,36 +628,63 @@ void Volume::ExportMeshes(const char *filename)
   fprintf(fp, "property list uchar int vertex_index\n");
   fprintf(fp, "end_header\n");
 
-  for(size_t i = 0; i < blockIds_.size(); i++)
+  auto writeVertices = [fp](const MeshType &mesh) {
+    const Vec3f *__restrict__ vertices = mesh.RawPoints();
+    const Vec3f *__restrict__ normals = mesh.RawNormals();
+    const Vec3f *__restrict__ colors = mesh.RawColors();
+
+    for(size_t vertexId = 0; vertexId < 3 * mesh.NumTriangles(); vertexId++)
+    {
+      fprintf(
+          fp, "%f %f %f %f %f %f %u %u %u 255\n", vertices[vertexId].x, vertices[vertexId].y,
+          vertices[vertexId].z, normals[vertexId].x, normals[vertexId].y, normals[vertexId].z,
+          (unsigned char) (255.0f * colors[vertexId].x),
+          (unsigned char) (255.0f * colors[vertexId].y),
+          (unsigned char) (255.0f * colors[vertexId].z));
+    }
+  };
+
+  for(size_t i = 0; i < meshes_.size(); i++)
   {
     if(i % 100 == 0)
     {
       utils::Log::Info(
-          "Volume", "Exporting blocks %lu - %lu over %lu\n", i, std::min(i + 100, blockIds_.size()),
-          blockIds_.size());
+          "Volume", "Exporting blocks %lu - %lu over %lu\n", i, std::min(i + 100, meshes_.size()),
+          meshes_.size());
     }
 
     MeshType *mesh = meshes_[i].get();
     if(mesh == nullptr)
       continue;
 
-    const Vec3f *__restrict__ vertices = mesh->RawPoints();
-    const Vec3f *__restrict__ normals = mesh->RawNormals();
-    const Vec3f *__restrict__ colors = mesh->RawColors();
+    writeVertices(*mesh);
+  }
 
-    for(size_t vertexId = 0; vertexId < 3 * mesh->NumTriangles(); vertexId++)
+  // Meshes of the spilled blocks are read one at a time
+  MeshPtrType spilledMesh;
+  for(const auto &blockId : spilledIds)
+  {
+    const size_t numSpilledTriangles = store_.NumTriangles(blockId);
+    if(numSpilledTriangles == 0)
     {
-      fprintf(
-          fp, "%f %f %f %f %f %f %u %u %u 255\n", vertices[vertexId].x, vertices[vertexId].y,
-          vertices[vertexId].z, normals[vertexId].x, normals[vertexId].y, normals[vertexId].z,
-          (unsigned char) (255.0f * colors[vertexId].x),
-          (unsigned char) (255.0f * colors[vertexId].y),
-          (unsigned char) (255.0f * colors[vertexId].z));
+      continue;
+    }
+
+    if(store_.ReadMesh(blockId, spilledMesh) && spilledMesh != nullptr)
+    {
+      writeVertices(*spilledMesh);
+      continue;
+    }
+
+    // Keeps the face indices valid
+    for(size_t vertexId = 0; vertexId < 3 * numSpilledTriangles; vertexId++)
+    {
+      fprintf(fp, "0 0 0 0 0 0 0 0 0 255\n");
     }
   }
 
   size_t triangleOffset = 0;
-  for(size_t i = 0; i < blockIds_.size(); i++)
+  for(size_t i = 0; i < meshes_.size(); i++)
   {
     MeshType *mesh = meshes_[i].get();
     if(mesh == nullptr)
@@ -214,12 +698,23 @@ void Volume::ExportMeshes(const char *filename)
     triangleOffset += mesh->NumTriangles();
   }
 
+  for(const auto &blockId : spilledIds)
+  {
+    const size_t numSpilledTriangles = store_.NumTriangles(blockId);
+    for(size_t face = triangleOffset; face < triangleOffset + numSpilledTriangles; face++)
+    {
+      fprintf(fp, "3 %lu %lu %lu\n", 3 * face, 3 * face + 1, 3 * face + 2);
+    }
+
+    triangleOffset += numSpilledTriangles;
+  }
+
   fclose(fp);
 }
 
 #define WRITE_BLOCK(FP, DATA, T)                                                                   \
-  if(gzfwrite(DATA, sizeof(T), BlockProperties<float, 16>::blockVolume, FP)                        \
-     != BlockProperties<float, 16>::blockVolume)                                                   \
+  if(gzfwrite(DATA, sizeof(T), BlockProperties<float>::blockVolume, FP)                            \
+     != BlockProperties<float>::blockVolume)                                                       \
   {                                                                                                \
     utils::Log::Error("Writing block", "Error writing in %s\n", filename);                         \
     return;                                                                                        \
@@ -227,16 +722,29 @@ void Volume::ExportMeshes(const char *filename)
 
 void Volume::DumpAllBlocks(const char *dir)
 {
-  for(const auto &id : blockIds_)
+  std::vector<float> tsdf(BlockProperties<float>::blockVolume);
+  std::vector<float> weights(BlockProperties<float>::blockVolume);
+  std::vector<Color3f> colors(BlockProperties<float>::blockVolume);
+
+  // Spilled blocks are read one at a time
+  VoxelBlock spilledBlock(voxelRes_, true, storage_, quantization_);
+  BlockIdList idList = GetAllIds();
+  const BlockIdList spilledIds = store_.GetAllIds();
+  idList.insert(idList.end(), spilledIds.begin(), spilledIds.end());
+  for(const auto &blockId : idList)
   {
-    auto *block = voxelBlocks_[id.second].get();
+    VoxelBlock *block = GetBlock(blockId);
+    if(block == nullptr && store_.Read(blockId, spilledBlock, nullptr))
+    {
+      block = &spilledBlock;
+    }
     if(block == nullptr)
     {
       continue;
     }
 
     char filename[512];
-    sprintf(filename, "%s/%d_%d_%d.gz", dir, id.first.x, id.first.y, id.first.z);
+    sprintf(filename, "%s/%d_%d_%d.gz", dir, blockId.x, blockId.y, blockId.z);
     gzFile fp = gzopen(filename, "w6h");
     if(!fp)
     {
@@ -244,14 +752,16 @@ void Volume::DumpAllBlocks(const char *dir)
       return;
     }
 
+    // Blocks are always written as floats
     const bool useColor = block->UseColor();
+    block->ReadVoxels(
+        0, BlockProperties<float>::blockVolume, tsdf.data(), weights.data(), colors.data());
     gzfwrite(&useColor, 1, sizeof(bool), fp);
-    WRITE_BLOCK(fp, block->TSDF(), float);
-    WRITE_BLOCK(fp, block->Weights(), float);
-    WRITE_BLOCK(fp, block->Gradients(), Vec3f);
+    WRITE_BLOCK(fp, tsdf.data(), float);
+    WRITE_BLOCK(fp, weights.data(), float);
     if(useColor)
     {
-      WRITE_BLOCK(fp, block->Colors(), Color3f);
+      WRITE_BLOCK(fp, colors.data(), Color3f);
     }
 
     gzclose(fp);
@@ -259,8 +769,8 @@ void Volume::DumpAllBlocks(const char *dir)
 }
 
 #define READ_BLOCK(FP, DATA, T)                                                                    \
-  if(gzfread(DATA, sizeof(T), BlockProperties<float, 16>::blockVolume, FP)                         \
-     != BlockProperties<float, 16>::blockVolume)                                                   \
+  if(gzfread(DATA, sizeof(T), BlockProperties<float>::blockVolume, FP)                             \
+     != BlockProperties<float>::blockVolume)                                                       \
   {                                                                                                \
     utils::Log::Error("Reading block", "Error reading in %s\n", filename.c_str());                 \
     return;                                                                                        \
@@ -276,6 +786,10 @@ void Volume::PreloadBlocks(const char *dirName)
     return;
   }
 
+  std::vector<float> tsdf(BlockProperties<float>::blockVolume);
+  std::vector<float> weights(BlockProperties<float>::blockVolume);
+  std::vector<Color3f> colors(BlockProperties<float>::blockVolume);
+
   std::vector<std::string> filenames;
   while((ent = readdir(dir)) != NULL)
   {
@@ -332,130 +846,135 @@ void Volume::PreloadBlocks(const char *dirName)
 
     bool useColor;
     gzfread(&useColor, sizeof(bool), 1, fp);
-    READ_BLOCK(fp, block->TSDF(), float);
-    READ_BLOCK(fp, block->Weights(), float);
-    READ_BLOCK(fp, block->Gradients(), Vec3f);
+    READ_BLOCK(fp, tsdf.data(), float);
+    READ_BLOCK(fp, weights.data(), float);
     if(useColor)
     {
-      READ_BLOCK(fp, block->Colors(), Color3f);
+      READ_BLOCK(fp, colors.data(), Color3f);
     }
+    block->WriteVoxels(
+        0, BlockProperties<float>::blockVolume, tsdf.data(), weights.data(), colors.data());
+    SyncHalos(*block);
 
     gzclose(fp);
   }
 }
 
-size_t Volume::ComputeMesh(const BlockId &blockId, MeshType &tmp)
+void Volume::GatherColors(const VoxelBlock &block, MeshWorkspace &workspace)
 {
-  const size_t id = blockIds_[blockId];
-  const BlockId b0 = blockId + BlockId(0, 0, 0);
-  const Vec3f org =
-      (float) BlockProperties<float, 16>::blockSize * voxelRes_ * Vec3f(b0.x, b0.y, b0.z);
-
-  const BlockId bxx = blockId + BlockId(1, 0, 0);
-  const BlockId byy = blockId + BlockId(0, 1, 0);
-  const BlockId bzz = blockId + BlockId(0, 0, 1);
-  const BlockId bxy = blockId + BlockId(1, 1, 0);
-  const BlockId bxz = blockId + BlockId(1, 0, 1);
-  const BlockId byz = blockId + BlockId(0, 1, 1);
-  const BlockId bxyz = blockId + BlockId(1, 1, 1);
-
-  // Empty block
-  if(voxelBlocks_[id] == nullptr)
+  for(int nk = 0; nk <= 1; nk++)
   {
-    return 0;
+    for(int nj = 0; nj <= 1; nj++)
+    {
+      for(int ni = 0; ni <= 1; ni++)
+      {
+        const VoxelBlock *neighbour = block.Neighbour(ni, nj, nk);
+        const int index = ni | (nj << 1) | (nk << 2);
+        workspace.colors[index] =
+            neighbour != nullptr ? reinterpret_cast<const float *>(neighbour->Colors()) : nullptr;
+        workspace.compactColors[index] =
+            neighbour != nullptr ? neighbour->CompactColors() : nullptr;
+      }
+    }
   }
+}
 
-  float *points = reinterpret_cast<float *>(tmp.RawPoints());
-  float *colors = reinterpret_cast<float *>(tmp.RawColors());
-  float *normals = reinterpret_cast<float *>(tmp.RawNormals());
-
-  const float *tsdf = voxelBlocks_[id]->TSDF();
-  const float *rgb = (float *) voxelBlocks_[id]->Colors();
-  const float *grad = (float *) voxelBlocks_[id]->Gradients();
-
-  float *xx = nullptr;
-  float *yy = nullptr;
-  float *zz = nullptr;
-  float *xy = nullptr;
-  float *xz = nullptr;
-  float *yz = nullptr;
-  float *xyz = nullptr;
-
-  float *cxx = nullptr;
-  float *cyy = nullptr;
-  float *czz = nullptr;
-  float *cxy = nullptr;
-  float *cxz = nullptr;
-  float *cyz = nullptr;
-  float *cxyz = nullptr;
-
-  float *gxx = nullptr;
-  float *gyy = nullptr;
-  float *gzz = nullptr;
-  float *gxy = nullptr;
-  float *gxz = nullptr;
-  float *gyz = nullptr;
-  float *gxyz = nullptr;
+void Volume::PackTSDF(const VoxelBlock &block, MeshWorkspace &workspace)
+{
+  static constexpr int blockSize = BlockProperties<float>::blockSize;
+  static constexpr int tsdfDim = blockSize + 3;
 
-  if(blockIds_.find(bxx) != blockIds_.end())
-  {
-    xx = voxelBlocks_[blockIds_[bxx]]->TSDF();
-    cxx = (float *) voxelBlocks_[blockIds_[bxx]]->Colors();
-    gxx = (float *) voxelBlocks_[blockIds_[bxx]]->Gradients();
-  }
+  std::fill(workspace.tsdf.begin(), workspace.tsdf.end(), BlockProperties<float>::invalidTsdf);
 
-  if(blockIds_.find(byy) != blockIds_.end())
-  {
-    yy = voxelBlocks_[blockIds_[byy]]->TSDF();
-    cyy = (float *) voxelBlocks_[blockIds_[byy]]->Colors();
-    gyy = (float *) voxelBlocks_[blockIds_[byy]]->Gradients();
-  }
+  // Voxels of the packed arrays covered by each neighbour along one axis : the last layer of the
+  // previous block, the whole block and the first two layers of the next block
+  static constexpr int first[3] = {blockSize - 1, 0, 0};
+  static constexpr int last[3] = {blockSize, blockSize, 2};
+  static constexpr int packedOrg[3] = {-1, 0, blockSize};
 
-  if(blockIds_.find(bzz) != blockIds_.end())
+  for(int nk = -1; nk <= 1; nk++)
   {
-    zz = voxelBlocks_[blockIds_[bzz]]->TSDF();
-    czz = (float *) voxelBlocks_[blockIds_[bzz]]->Colors();
-    gzz = (float *) voxelBlocks_[blockIds_[bzz]]->Gradients();
+    for(int nj = -1; nj <= 1; nj++)
+    {
+      for(int ni = -1; ni <= 1; ni++)
+      {
+        // Normals only read the voxels along the axes of the cube corners, blocks that are behind
+        // along two axes or more are not needed
+        if((ni < 0) + (nj < 0) + (nk < 0) > 1)
+        {
+          continue;
+        }
+
+        const VoxelBlock *neighbour = block.Neighbour(ni, nj, nk);
+        if(neighbour == nullptr)
+        {
+          continue;
+        }
+
+        const int rowLength = last[ni + 1] - first[ni + 1];
+        const int pi = packedOrg[ni + 1];
+        for(int k = first[nk + 1]; k < last[nk + 1]; k++)
+        {
+          const int pk = packedOrg[nk + 1] + k - first[nk + 1];
+          for(int j = first[nj + 1]; j < last[nj + 1]; j++)
+          {
+            const int pj = packedOrg[nj + 1] + j - first[nj + 1];
+            const int offset = first[ni + 1] + j * blockSize + k * blockSize * blockSize;
+            neighbour->ReadTSDF(
+                offset, rowLength,
+                &workspace.tsdf[(pi + 1) + (pj + 1) * tsdfDim + (pk + 1) * tsdfDim * tsdfDim]);
+          }
+        }
+      }
+    }
   }
+}
 
-  if(blockIds_.find(bxy) != blockIds_.end())
+size_t Volume::ComputeMesh(const BlockId &blockId, MeshWorkspace &workspace)
+{
+  int index;
+  if(!blockIds_.Find(blockId, index))
   {
-    xy = voxelBlocks_[blockIds_[bxy]]->TSDF();
-    cxy = (float *) voxelBlocks_[blockIds_[bxy]]->Colors();
-    gxy = (float *) voxelBlocks_[blockIds_[bxy]]->Gradients();
+    return 0;
   }
+  const size_t id = index;
+  const BlockId b0 = blockId + BlockId(0, 0, 0);
+  const Vec3f org =
+      (float) BlockProperties<float>::blockSize * voxelRes_ * Vec3f(b0.x, b0.y, b0.z);
 
-  if(blockIds_.find(bxz) != blockIds_.end())
+  // Empty block
+  if(voxelBlocks_[id] == nullptr)
   {
-    xz = voxelBlocks_[blockIds_[bxz]]->TSDF();
-    cxz = (float *) voxelBlocks_[blockIds_[bxz]]->Colors();
-    gxz = (float *) voxelBlocks_[blockIds_[bxz]]->Gradients();
+    return 0;
   }
 
-  if(blockIds_.find(byz) != blockIds_.end())
-  {
-    yz = voxelBlocks_[blockIds_[byz]]->TSDF();
-    cyz = (float *) voxelBlocks_[blockIds_[byz]]->Colors();
-    gyz = (float *) voxelBlocks_[blockIds_[byz]]->Gradients();
-  }
+  MeshType &tmp = workspace.mesh;
+  float *points = reinterpret_cast<float *>(tmp.RawPoints());
+  float *colors = reinterpret_cast<float *>(tmp.RawColors());
+  float *normals = reinterpret_cast<float *>(tmp.RawNormals());
 
-  if(blockIds_.find(bxyz) != blockIds_.end())
+  // Blocks with a halo are meshed in place, the others are packed with their neighbours
+  const VoxelBlock &voxelBlock = *voxelBlocks_[id];
+  GatherColors(voxelBlock, workspace);
+  if(!voxelBlock.HasHalo())
   {
-    xyz = voxelBlocks_[blockIds_[bxyz]]->TSDF();
-    cxyz = (float *) voxelBlocks_[blockIds_[bxyz]]->Colors();
-    gxyz = (float *) voxelBlocks_[blockIds_[bxyz]]->Gradients();
+    PackTSDF(voxelBlock, workspace);
   }
-
-  const size_t numTriangles = spf::mc::extractMesh(
-      tsdf, xx, yy, zz, xy, xz, yz, xyz, rgb, cxx, cyy, czz, cxy, cxz, cyz, cxyz, grad, gxx, gyy,
-      gzz, gxy, gxz, gyz, gxyz, points, colors, normals, BlockProperties<float, 16>::blockSize,
-      voxelRes_, (float *) &org);
+  const float *tsdf = voxelBlock.HasHalo() ? voxelBlock.TSDF() : workspace.tsdf.data();
+
+  const size_t numTriangles =
+      storage_ == VoxelStorage::Float
+          ? spf::mc::extractMesh<BlockProperties<float>::blockSize>(
+              tsdf, workspace.colors, points, colors, normals, voxelRes_, (float *) &org)
+          : spf::mc::extractMesh<BlockProperties<float>::blockSize>(
+              tsdf, workspace.compactColors, points, colors, normals, voxelRes_, (float *) &org);
   tmp.Resize(3 * numTriangles, numTriangles);
 
   if(meshes_[id].get())
   {
     meshes_[id].reset();
   }
+  stored_[id] = false;
 
   if(numTriangles > 0)
   {
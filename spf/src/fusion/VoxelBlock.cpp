@@ -21,40 +21,277 @@ namespace spf
 {
 namespace fusion
 {
-VoxelBlock::VoxelBlock(const float voxelRes, bool useColor) :
+VoxelBlock::VoxelBlock(
+    const float voxelRes, bool useColor, const VoxelStorage storage,
+    const VoxelQuantization &quantization, void *data) :
     voxelRes_(voxelRes),
-    blockVolume_(BlockProperties<float, 16>::blockVolume),
+    blockVolume_(BlockProperties<float>::blockVolume),
     useColor_(useColor),
-    tsdf_(new float[BlockProperties<float, 16>::blockVolume]),
-    weights_(new float[BlockProperties<float, 16>::blockVolume]),
-    gradients_(new Point3f[BlockProperties<float, 16>::blockVolume]),
-    colors_(useColor ? new Color3f[BlockProperties<float, 16>::blockVolume] : nullptr)
+    storage_(storage),
+    quantization_(quantization)
 {
-  // Init all values
-  for(size_t i = 0; i < this->blockVolume_; i++)
+  if(data == nullptr)
   {
-    tsdf_[i] = BlockProperties<float, 16>::invalidTsdf;
+    ownedData_ = AlignedAlloc(VoxelBytes(storage_, useColor_));
+    data = ownedData_.get();
   }
-  memset(weights_.get(), 0, blockVolume_ * sizeof(float));
 
-  if(useColor_)
+  // Arrays are stored one after the other, their sizes are multiples of a cache line
+  char *ptr = static_cast<char *>(data);
+  if(storage_ == VoxelStorage::Float)
+  {
+    const size_t paddedBytes = PaddedVolume() * sizeof(float);
+    tsdf_ = reinterpret_cast<float *>(ptr);
+    weights_ = reinterpret_cast<float *>(ptr + paddedBytes);
+    colors_ = useColor ? reinterpret_cast<Color3f *>(
+                  ptr + paddedBytes + blockVolume_ * sizeof(float))
+                       : nullptr;
+  }
+  else
   {
-    memset((unsigned char *) colors_.get(), 0, blockVolume_ * sizeof(Vec3f));
+    compactTsdf_ = reinterpret_cast<int16_t *>(ptr);
+    compactWeights_ = reinterpret_cast<uint16_t *>(ptr + blockVolume_ * sizeof(int16_t));
+    compactColors_ = useColor ? reinterpret_cast<uint8_t *>(
+                         ptr + blockVolume_ * (sizeof(int16_t) + sizeof(uint16_t)))
+                              : nullptr;
   }
+  std::fill(neighbours_, neighbours_ + 27, nullptr);
+  neighbours_[NeighbourIndex(0, 0, 0)] = this;
+  Clear();
 }
 
 void VoxelBlock::Clear()
 {
-  for(size_t i = 0; i < this->blockVolume_; i++)
+  if(storage_ == VoxelStorage::Compact)
+  {
+    std::fill(compactTsdf_, compactTsdf_ + blockVolume_, invalidCompactTsdf_);
+    memset(compactWeights_, 0, blockVolume_ * sizeof(uint16_t));
+    if(useColor_)
+    {
+      memset(compactColors_, 0, 3 * blockVolume_ * sizeof(uint8_t));
+    }
+    return;
+  }
+
+  std::fill(tsdf_, tsdf_ + PaddedVolume(), BlockProperties<float>::invalidTsdf);
+  memset(weights_, 0, blockVolume_ * sizeof(float));
+  if(useColor_)
+  {
+    memset((void *) colors_, 0, blockVolume_ * sizeof(Color3f));
+  }
+}
+
+bool VoxelBlock::IsEmpty() const
+{
+  if(storage_ == VoxelStorage::Compact)
+  {
+    for(size_t i = 0; i < blockVolume_; i++)
+    {
+      if(compactWeights_[i] > 0 && compactTsdf_[i] != invalidCompactTsdf_)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  for(size_t i = 0; i < blockVolume_; i++)
+  {
+    if(weights_[VoxelIndex(i)] > 0.0f
+       && tsdf_[PaddedOffset(i)] != BlockProperties<float>::invalidTsdf)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void VoxelBlock::ReadVoxels(
+    const size_t offset, const size_t n, float *tsdf, float *weights, Color3f *colors) const
+{
+  if(storage_ == VoxelStorage::Float && VoxelLayout::isLinear)
+  {
+    ReadTSDF(offset, n, tsdf);
+    memcpy(weights, weights_ + offset, n * sizeof(float));
+    if(useColor_)
+    {
+      memcpy((void *) colors, colors_ + offset, n * sizeof(Color3f));
+    }
+    return;
+  }
+
+  for(size_t i = 0; i < n; i++)
   {
-    tsdf_[i] = BlockProperties<float, 16>::invalidTsdf;
-    weights_[i] = 0.0f;
-    gradients_[i] = Vec3f(0.0f);
+    tsdf[i] = DecodeTsdf(offset + i);
+    weights[i] = DecodeWeight(offset + i);
     if(useColor_)
     {
-      colors_[i] = Vec3f(0.0f);
+      colors[i] = DecodeColor(offset + i);
+    }
+  }
+}
+
+void VoxelBlock::WriteVoxels(
+    const size_t offset, const size_t n, const float *tsdf, const float *weights,
+    const Color3f *colors)
+{
+  if(storage_ == VoxelStorage::Float)
+  {
+    for(size_t i = 0; i < n;)
+    {
+      const size_t count = std::min(n - i, BlockSize() - ((offset + i) & (BlockSize() - 1)));
+      memcpy(tsdf_ + PaddedOffset(offset + i), tsdf + i, count * sizeof(float));
+      i += count;
+    }
+    if constexpr(VoxelLayout::isLinear)
+    {
+      memcpy(weights_ + offset, weights, n * sizeof(float));
+      if(useColor_)
+      {
+        memcpy((void *) (colors_ + offset), colors, n * sizeof(Color3f));
+      }
+    }
+    else
+    {
+      for(size_t i = 0; i < n; i++)
+      {
+        weights_[VoxelIndex(offset + i)] = weights[i];
+        if(useColor_)
+        {
+          colors_[VoxelIndex(offset + i)] = colors[i];
+        }
+      }
     }
+    return;
+  }
+
+  for(size_t i = 0; i < n; i++)
+  {
+    EncodeTsdf(offset + i, tsdf[i]);
+    EncodeWeight(offset + i, weights[i]);
+    if(useColor_)
+    {
+      EncodeColor(offset + i, colors[i]);
+    }
+  }
+}
+
+// Calls func(haloOffset, voxelOffset, length) for each row of voxels of the neighbour at offset
+// copied to the halo. Normals only read the voxels along the axes of the cube corners, so the
+// neighbours behind along two axes or more have no voxel in the halo.
+template <typename Func>
+static inline void forEachHaloRow(const Index3d &offset, Func &&func)
+{
+  static constexpr int blockSize = BlockProperties<float>::blockSize;
+  static constexpr int dim = VoxelBlock::PaddedDim();
+
+  // Voxels of the neighbour along one axis : its last layer when it is before the block, its
+  // first two layers when it is after it
+  static constexpr int first[3] = {blockSize - 1, 0, 0};
+  static constexpr int last[3] = {blockSize, blockSize, 2};
+  static constexpr int paddedOrg[3] = {0, 1, blockSize + 1};
+
+  if((offset.x < 0) + (offset.y < 0) + (offset.z < 0) > 1)
+  {
+    return;
+  }
+
+  const int length = last[offset.x + 1] - first[offset.x + 1];
+  for(int k = first[offset.z + 1]; k < last[offset.z + 1]; k++)
+  {
+    const int pk = paddedOrg[offset.z + 1] + k - first[offset.z + 1];
+    for(int j = first[offset.y + 1]; j < last[offset.y + 1]; j++)
+    {
+      const int pj = paddedOrg[offset.y + 1] + j - first[offset.y + 1];
+      func(
+          size_t(paddedOrg[offset.x + 1] + pj * dim + pk * dim * dim),
+          size_t(first[offset.x + 1] + j * blockSize + k * blockSize * blockSize), length);
+    }
+  }
+}
+
+void VoxelBlock::CopyHalo(const VoxelBlock &neighbour, const Index3d &offset)
+{
+  if(!HasHalo())
+  {
+    return;
+  }
+  forEachHaloRow(offset, [&](const size_t haloOffset, const size_t voxelOffset, const int length) {
+    memcpy(tsdf_ + haloOffset, neighbour.tsdf_ + PaddedOffset(voxelOffset), length * sizeof(float));
+  });
+}
+
+void VoxelBlock::PushBorderVoxel(const size_t x, const size_t y, const size_t z)
+{
+  static constexpr int blockSize = BlockProperties<float>::blockSize;
+  static constexpr size_t dim = PaddedDim();
+
+  // Along each axis, the neighbours holding the voxel in their halo and its padded coordinate in
+  // them : this block, the previous one for the first two layers, the next one for the last layer
+  const size_t voxel[3] = {x, y, z};
+  int offsets[3][2];
+  size_t padded[3][2];
+  int count[3];
+  for(int axis = 0; axis < 3; axis++)
+  {
+    const size_t v = voxel[axis];
+    offsets[axis][0] = 0;
+    padded[axis][0] = v + 1;
+    count[axis] = 1;
+    if(v <= 1)
+    {
+      offsets[axis][1] = -1;
+      padded[axis][1] = blockSize + 1 + v;
+      count[axis] = 2;
+    }
+    else if(v == blockSize - 1)
+    {
+      offsets[axis][1] = 1;
+      padded[axis][1] = 0;
+      count[axis] = 2;
+    }
+  }
+
+  const float value = tsdf_[PaddedOffset(x + (y + z * blockSize) * blockSize)];
+  for(int k = 0; k < count[2]; k++)
+  {
+    for(int j = 0; j < count[1]; j++)
+    {
+      for(int i = 0; i < count[0]; i++)
+      {
+        if(i == 0 && j == 0 && k == 0)
+        {
+          continue;
+        }
+        const int dx = offsets[0][i];
+        const int dy = offsets[1][j];
+        const int dz = offsets[2][k];
+        // Halos only hold the voxels of the blocks behind them along one axis at most, see
+        // forEachHaloRow
+        if((dx > 0) + (dy > 0) + (dz > 0) > 1)
+        {
+          continue;
+        }
+        VoxelBlock *neighbour = Neighbour(dx, dy, dz);
+        if(neighbour == nullptr || !neighbour->HasHalo())
+        {
+          continue;
+        }
+        neighbour->tsdf_[padded[0][i] + (padded[1][j] + padded[2][k] * dim) * dim] = value;
+      }
+    }
+  }
+}
+
+void VoxelBlock::ClearHalo(const Index3d &offset)
+{
+  if(!HasHalo())
+  {
+    return;
   }
+  forEachHaloRow(offset, [&](const size_t haloOffset, const size_t, const int length) {
+    std::fill(tsdf_ + haloOffset, tsdf_ + haloOffset + length, BlockProperties<float>::invalidTsdf);
+  });
 }
 } // namespace fusion
 } // namespace spf
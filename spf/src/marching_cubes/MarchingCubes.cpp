@@ -17,14 +17,14 @@
 
 #include "spf/marching_cubes/MarchingCubes.hpp"
 #include "spf/marching_cubes/tables.h"
+#include "spf/Types.hpp"
+#include "spf/fusion/BlockUtils.hpp"
 
 #define ISOVALUE_MAX FLT_MAX
 
-#define COLOR_ID(i, j, k, blockSize) (((i) + (j) *blockSize + (k) *blockSize * blockSize))
+#define TSDF_OFFSET(i, j, k, dim) (((i) + 1) + ((j) + 1) * (dim) + ((k) + 1) * (dim) * (dim))
 
-#define GRAD_ID(i, j, k, blockSize) (((i) + (j) *blockSize + (k) *blockSize * blockSize))
-
-#define GRID_OFFSET(i, j, k, blockSize) ((i) + (j) * (blockSize) + (k) * (blockSize) * (blockSize))
+#define COLOR_ID(i, j, k, blockSize) (spf::fusion::VoxelLayout::Index((i), (j), (k), (blockSize)))
 
 #define INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7)                       \
   (tsdf0 == ISOVALUE_MAX || tsdf1 == ISOVALUE_MAX || tsdf2 == ISOVALUE_MAX                         \
@@ -40,73 +40,73 @@
   if(edgeTable[cubeIndex] & 1)                                                                     \
   {                                                                                                \
     v[0] = interpolate(isoValue, p0, p1, tsdf0, tsdf1);                                            \
-    c[0] = interpolate(isoValue, *c0, *c1, tsdf0, tsdf1);                                          \
+    c[0] = interpolate(isoValue, c0, c1, tsdf0, tsdf1);                                            \
     g[0] = normalize(interpolate(isoValue, *g0, *g1, tsdf0, tsdf1));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 2)                                                                     \
   {                                                                                                \
     v[1] = interpolate(isoValue, p1, p2, tsdf1, tsdf2);                                            \
-    c[1] = interpolate(isoValue, *c1, *c2, tsdf1, tsdf2);                                          \
+    c[1] = interpolate(isoValue, c1, c2, tsdf1, tsdf2);                                            \
     g[1] = normalize(interpolate(isoValue, *g1, *g2, tsdf1, tsdf2));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 4)                                                                     \
   {                                                                                                \
     v[2] = interpolate(isoValue, p2, p3, tsdf2, tsdf3);                                            \
-    c[2] = interpolate(isoValue, *c2, *c3, tsdf2, tsdf3);                                          \
+    c[2] = interpolate(isoValue, c2, c3, tsdf2, tsdf3);                                            \
     g[2] = normalize(interpolate(isoValue, *g2, *g3, tsdf2, tsdf3));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 8)                                                                     \
   {                                                                                                \
     v[3] = interpolate(isoValue, p3, p0, tsdf3, tsdf0);                                            \
-    c[3] = interpolate(isoValue, *c3, *c0, tsdf3, tsdf0);                                          \
+    c[3] = interpolate(isoValue, c3, c0, tsdf3, tsdf0);                                            \
     g[3] = normalize(interpolate(isoValue, *g3, *g0, tsdf3, tsdf0));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 16)                                                                    \
   {                                                                                                \
     v[4] = interpolate(isoValue, p4, p5, tsdf4, tsdf5);                                            \
-    c[4] = interpolate(isoValue, *c4, *c5, tsdf4, tsdf5);                                          \
+    c[4] = interpolate(isoValue, c4, c5, tsdf4, tsdf5);                                            \
     g[4] = normalize(interpolate(isoValue, *g4, *g5, tsdf4, tsdf5));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 32)                                                                    \
   {                                                                                                \
     v[5] = interpolate(isoValue, p5, p6, tsdf5, tsdf6);                                            \
-    c[5] = interpolate(isoValue, *c5, *c6, tsdf5, tsdf6);                                          \
+    c[5] = interpolate(isoValue, c5, c6, tsdf5, tsdf6);                                            \
     g[5] = normalize(interpolate(isoValue, *g5, *g6, tsdf5, tsdf6));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 64)                                                                    \
   {                                                                                                \
     v[6] = interpolate(isoValue, p6, p7, tsdf6, tsdf7);                                            \
-    c[6] = interpolate(isoValue, *c6, *c7, tsdf6, tsdf7);                                          \
+    c[6] = interpolate(isoValue, c6, c7, tsdf6, tsdf7);                                            \
     g[6] = normalize(interpolate(isoValue, *g6, *g7, tsdf6, tsdf7));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 128)                                                                   \
   {                                                                                                \
     v[7] = interpolate(isoValue, p7, p4, tsdf7, tsdf4);                                            \
-    c[7] = interpolate(isoValue, *c7, *c4, tsdf7, tsdf4);                                          \
+    c[7] = interpolate(isoValue, c7, c4, tsdf7, tsdf4);                                            \
     g[7] = normalize(interpolate(isoValue, *g7, *g4, tsdf7, tsdf4));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 256)                                                                   \
   {                                                                                                \
     v[8] = interpolate(isoValue, p0, p4, tsdf0, tsdf4);                                            \
-    c[8] = interpolate(isoValue, *c0, *c4, tsdf0, tsdf4);                                          \
+    c[8] = interpolate(isoValue, c0, c4, tsdf0, tsdf4);                                            \
     g[8] = normalize(interpolate(isoValue, *g0, *g4, tsdf0, tsdf4));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 512)                                                                   \
   {                                                                                                \
     v[9] = interpolate(isoValue, p1, p5, tsdf1, tsdf5);                                            \
-    c[9] = interpolate(isoValue, *c1, *c5, tsdf1, tsdf5);                                          \
+    c[9] = interpolate(isoValue, c1, c5, tsdf1, tsdf5);                                            \
     g[9] = normalize(interpolate(isoValue, *g1, *g5, tsdf1, tsdf5));                               \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 1024)                                                                  \
   {                                                                                                \
     v[10] = interpolate(isoValue, p2, p6, tsdf2, tsdf6);                                           \
-    c[10] = interpolate(isoValue, *c2, *c6, tsdf2, tsdf6);                                         \
+    c[10] = interpolate(isoValue, c2, c6, tsdf2, tsdf6);                                           \
     g[10] = normalize(interpolate(isoValue, *g2, *g6, tsdf2, tsdf6));                              \
   }                                                                                                \
   if(edgeTable[cubeIndex] & 2048)                                                                  \
   {                                                                                                \
     v[11] = interpolate(isoValue, p3, p7, tsdf3, tsdf7);                                           \
-    c[11] = interpolate(isoValue, *c3, *c7, tsdf3, tsdf7);                                         \
+    c[11] = interpolate(isoValue, c3, c7, tsdf3, tsdf7);                                           \
     g[11] = normalize(interpolate(isoValue, *g3, *g7, tsdf3, tsdf7));                              \
   }
 
@@ -201,157 +201,98 @@ get3DPos(const size_t i, const size_t j, const size_t k, const vertex_t org, con
   return ret;
 }
 
-static size_t extractInnerMesh(
-    const float *tsdf, const float *rgba, const float *grad, float *triangles, float *colors,
-    float *normals, const float voxelRes, const vertex_t org, const size_t blockSize,
-    const float isoValue);
-
-static size_t extractXFaceMesh(
-    const float *iTsdf, const float *fTsdf, const float *irgba, const float *frgba,
-    const float *grad, const float *fgrad, float *triangles, float *colors, float *normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue);
-
-static size_t extractYFaceMesh(
-    const float *iTsdf, const float *fTsdf, const float *irgba, const float *frgba,
-    const float *igrad, const float *fgrad, float *triangles, float *colors, float *normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue);
-
-static size_t extractZFaceMesh(
-    const float *iTsdf, const float *fTsdf, const float *irgba, const float *frgba,
-    const float *igrad, const float *fgrad, float *triangles, float *colors, float *normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue);
-
-static size_t extractXYEdgeMesh(
-    const float *iTsdf, const float *xTsdf, const float *yTsdf, const float *xyTsdf,
-    const float *irgba, const float *xrgba, const float *yrgba, const float *xyrgba,
-    const float *igrad, const float *xgrad, const float *ygrad, const float *xygrad,
-    float *triangles, float *colors, float *normals, const float voxelRes, const vertex_t org,
-    const size_t blockSize, const float isoValue);
-
-static size_t extractXZEdgeMesh(
-    const float *iTsdf, const float *xTsdf, const float *zTsdf, const float *xzTsdf,
-    const float *irgba, const float *xrgba, const float *zrgba, const float *xzrgba,
-    const float *igrad, const float *xgrad, const float *zgrad, const float *xzgrad,
-    float *triangles, float *colors, float *normals, const float voxelRes, const vertex_t org,
-    const size_t blockSize, const float isoValue);
-
-static size_t extractYZEdgeMesh(
-    const float *iTsdf, const float *yTsdf, const float *zTsdf, const float *yzTsdf,
-    const float *irgba, const float *yrgba, const float *zrgba, const float *yzrgba,
-    const float *igrad, const float *ygrad, const float *zgrad, const float *yzgrad,
-    float *triangles, float *colors, float *normals, const float voxelRes, const vertex_t org,
-    const size_t blockSize, const float isoValue);
-
-static size_t extractXYZCornerMesh(
-    const float *iTsdf, const float *xTsdf, const float *yTsdf, const float *zTsdf,
-    const float *xyTsdf, const float *xzTsdf, const float *yzTsdf, const float *xyzTsdf,
-    const float *irgba, const float *xrgba, const float *yrgba, const float *zrgba,
-    const float *xyrgba, const float *xzrgba, const float *yzrgba, const float *xyzrgba,
-    const float *igrad, const float *xgrad, const float *ygrad, const float *zgrad,
-    const float *xygrad, const float *xzgrad, const float *yzgrad, const float *xyzgrad,
-    float *triangles, float *colors, float *normals, const float voxelRes, const vertex_t org,
-    const size_t blockSize, const float isoValue);
-
-namespace spf
-{
-namespace mc
-{
-size_t extractMesh(
-    const float *tsdf, const float *xx, const float *yy, const float *zz, const float *xy,
-    const float *xz, const float *yz, const float *xyz, const float *rgba, const float *cxx,
-    const float *cyy, const float *czz, const float *cxy, const float *cxz, const float *cyz,
-    const float *cxyz, const float *grad, const float *gxx, const float *gyy, const float *gzz,
-    const float *gxy, const float *gxz, const float *gyz, const float *gxyz, float *triangles,
-    float *colors, float *normals, const size_t blockSize, const float voxelRes,
-    const float *blockPos)
+// Color of the voxel (i, j, k) in [0, blockSize]^3, read from the block or from its +x / +y / +z
+// neighbours. Blocks without colors give black vertices.
+static inline vertex_t
+getColor(const float *const *rgb, size_t i, size_t j, size_t k, const size_t blockSize)
 {
-  const vertex_t org = {blockPos[0], blockPos[1], blockPos[2]};
-  size_t numTriangles = 0;
-
-  if(tsdf == NULL)
-  {
-    return 0;
-  }
-
-  numTriangles = extractInnerMesh(
-      tsdf, rgba, grad, triangles, colors, normals, voxelRes, org, blockSize, 0.0f);
-
-  if(xx != NULL)
+  static const vertex_t black = {0.0f, 0.0f, 0.0f};
+  const size_t block = (i >= blockSize) | ((j >= blockSize) << 1) | ((k >= blockSize) << 2);
+  if(rgb[block] == NULL)
   {
-    numTriangles += extractXFaceMesh(
-        tsdf, xx, rgba, cxx, grad, gxx, triangles + 9 * numTriangles, colors + 9 * numTriangles,
-        normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
-  }
-
-  if(yy != NULL)
-  {
-    numTriangles += extractYFaceMesh(
-        tsdf, yy, rgba, cyy, grad, gyy, triangles + 9 * numTriangles, colors + 9 * numTriangles,
-        normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
-  }
-
-  if(zz != NULL)
-  {
-    numTriangles += extractZFaceMesh(
-        tsdf, zz, rgba, czz, grad, gzz, triangles + 9 * numTriangles, colors + 9 * numTriangles,
-        normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
-  }
-
-  if(xx != NULL && yy != NULL && xy != NULL)
-  {
-    numTriangles += extractXYEdgeMesh(
-        tsdf, xx, yy, xy, rgba, cxx, cyy, cxy, grad, gxx, gyy, gxy, triangles + 9 * numTriangles,
-        colors + 9 * numTriangles, normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
-  }
-
-  if(xx != NULL && zz != NULL && xz != NULL)
-  {
-    numTriangles += extractXZEdgeMesh(
-        tsdf, xx, zz, xz, rgba, cxx, czz, cxz, grad, gxx, gzz, gxz, triangles + 9 * numTriangles,
-        colors + 9 * numTriangles, normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
+    return black;
   }
+  i -= (i >= blockSize) * blockSize;
+  j -= (j >= blockSize) * blockSize;
+  k -= (k >= blockSize) * blockSize;
+  return ((const vertex_t *) rgb[block])[COLOR_ID(i, j, k, blockSize)];
+}
 
-  if(yy != NULL && zz != NULL && yz != NULL)
+// Same with 8 bit colors, 3 channels per voxel
+static inline vertex_t
+getColor(const uint8_t *const *rgb, size_t i, size_t j, size_t k, const size_t blockSize)
+{
+  static const vertex_t black = {0.0f, 0.0f, 0.0f};
+  const size_t block = (i >= blockSize) | ((j >= blockSize) << 1) | ((k >= blockSize) << 2);
+  if(rgb[block] == NULL)
   {
-    numTriangles += extractYZEdgeMesh(
-        tsdf, yy, zz, yz, rgba, cyy, czz, cyz, grad, gyy, gzz, gyz, triangles + 9 * numTriangles,
-        colors + 9 * numTriangles, normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
+    return black;
   }
+  i -= (i >= blockSize) * blockSize;
+  j -= (j >= blockSize) * blockSize;
+  k -= (k >= blockSize) * blockSize;
+  const uint8_t *color = rgb[block] + 3 * COLOR_ID(i, j, k, blockSize);
+  vertex_t ret;
+  ret.x = float(color[0]) / 255.0f;
+  ret.y = float(color[1]) / 255.0f;
+  ret.z = float(color[2]) / 255.0f;
+  return ret;
+}
 
-  if(xx != NULL && yy != NULL && zz != NULL && xy != NULL && xz != NULL && yz != NULL
-     && xyz != NULL)
-  {
-    numTriangles += extractXYZCornerMesh(
-        tsdf, xx, yy, zz, xy, xz, yz, xyz, rgba, cxx, cyy, czz, cxy, cxz, cyz, cxyz, grad, gxx, gyy,
-        gzz, gxy, gxz, gyz, gxyz, triangles + 9 * numTriangles, colors + 9 * numTriangles,
-        normals + 9 * numTriangles, voxelRes, org, blockSize, 0.0f);
-  }
+// Derivative along one axis from the previous, current and next samples. Falls back to a one
+// sided difference when a neighbour has not been observed.
+static inline float derivative(const float prev, const float cur, const float next)
+{
+  const bool prevValid = prev != ISOVALUE_MAX;
+  const bool nextValid = next != ISOVALUE_MAX;
+  const float scale = prevValid && nextValid ? 0.5f : 1.0f;
+  return scale * ((nextValid ? next : cur) - (prevValid ? prev : cur));
+}
 
-  return numTriangles;
+static inline vertex_t gradient(const float *tsdf, const size_t offset, const size_t dim)
+{
+  const float cur = tsdf[offset];
+  vertex_t ret;
+  ret.x = derivative(tsdf[offset - 1], cur, tsdf[offset + 1]);
+  ret.y = derivative(tsdf[offset - dim], cur, tsdf[offset + dim]);
+  ret.z = derivative(tsdf[offset - dim * dim], cur, tsdf[offset + dim * dim]);
+  return ret;
 }
-} // namespace mc
-} // namespace spf
 
-static size_t extractInnerMesh(
-    const float *__restrict__ tsdf, const float *__restrict__ rgba, const float *__restrict__ grad,
-    float *__restrict__ triangles, float *__restrict__ colors, float *__restrict__ normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue)
+// Polygonizes the cubes whose first corner is in the block. The corners on its +x / +y / +z faces
+// and the voxels read by the normals come from the padding of the TSDF, so all cubes go through
+// the same loop.
+template <size_t blockSize, typename ColorType>
+static size_t extractCubes(
+    const float *__restrict__ tsdf, const ColorType *const *rgb, float *__restrict__ triangles,
+    float *__restrict__ colors, float *__restrict__ normals, const float voxelRes,
+    const vertex_t org, const float isoValue)
 {
+  static constexpr size_t dim = blockSize + 3;
   size_t numTriangles = 0;
-  for(size_t k = 0; k < blockSize - 1; k++)
+  for(size_t k = 0; k < blockSize; k++)
   {
-    for(size_t j = 0; j < blockSize - 1; j++)
+    for(size_t j = 0; j < blockSize; j++)
     {
-      for(size_t i = 0; i < blockSize - 1; i++)
+      for(size_t i = 0; i < blockSize; i++)
       {
-        const float tsdf0 = tsdf[GRID_OFFSET(i, j, k, blockSize)];
-        const float tsdf1 = tsdf[GRID_OFFSET(i, j + 1, k, blockSize)];
-        const float tsdf2 = tsdf[GRID_OFFSET(i + 1, j + 1, k, blockSize)];
-        const float tsdf3 = tsdf[GRID_OFFSET(i + 1, j, k, blockSize)];
-        const float tsdf4 = tsdf[GRID_OFFSET(i, j, k + 1, blockSize)];
-        const float tsdf5 = tsdf[GRID_OFFSET(i, j + 1, k + 1, blockSize)];
-        const float tsdf6 = tsdf[GRID_OFFSET(i + 1, j + 1, k + 1, blockSize)];
-        const float tsdf7 = tsdf[GRID_OFFSET(i + 1, j, k + 1, blockSize)];
+        const size_t o0 = TSDF_OFFSET(i, j, k, dim);
+        const size_t o1 = TSDF_OFFSET(i, j + 1, k, dim);
+        const size_t o2 = TSDF_OFFSET(i + 1, j + 1, k, dim);
+        const size_t o3 = TSDF_OFFSET(i + 1, j, k, dim);
+        const size_t o4 = TSDF_OFFSET(i, j, k + 1, dim);
+        const size_t o5 = TSDF_OFFSET(i, j + 1, k + 1, dim);
+        const size_t o6 = TSDF_OFFSET(i + 1, j + 1, k + 1, dim);
+        const size_t o7 = TSDF_OFFSET(i + 1, j, k + 1, dim);
+
+        const float tsdf0 = tsdf[o0];
+        const float tsdf1 = tsdf[o1];
+        const float tsdf2 = tsdf[o2];
+        const float tsdf3 = tsdf[o3];
+        const float tsdf4 = tsdf[o4];
+        const float tsdf5 = tsdf[o5];
+        const float tsdf6 = tsdf[o6];
+        const float tsdf7 = tsdf[o7];
 
         if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
         {
@@ -375,23 +316,27 @@ static size_t extractInnerMesh(
         const vertex_t p6 = get3DPos(i + 1, j + 1, k + 1, org, voxelRes);
         const vertex_t p7 = get3DPos(i + 1, j, k + 1, org, voxelRes);
 
-        const vertex_t *c0 = (vertex_t *) rgba + COLOR_ID(i, j, k, blockSize);
-        const vertex_t *c1 = (vertex_t *) rgba + COLOR_ID(i, j + 1, k, blockSize);
-        const vertex_t *c2 = (vertex_t *) rgba + COLOR_ID(i + 1, j + 1, k, blockSize);
-        const vertex_t *c3 = (vertex_t *) rgba + COLOR_ID(i + 1, j, k, blockSize);
-        const vertex_t *c4 = (vertex_t *) rgba + COLOR_ID(i, j, k + 1, blockSize);
-        const vertex_t *c5 = (vertex_t *) rgba + COLOR_ID(i, j + 1, k + 1, blockSize);
-        const vertex_t *c6 = (vertex_t *) rgba + COLOR_ID(i + 1, j + 1, k + 1, blockSize);
-        const vertex_t *c7 = (vertex_t *) rgba + COLOR_ID(i + 1, j, k + 1, blockSize);
-
-        const vertex_t *g0 = (vertex_t *) grad + GRAD_ID(i, j, k, blockSize);
-        const vertex_t *g1 = (vertex_t *) grad + GRAD_ID(i, j + 1, k, blockSize);
-        const vertex_t *g2 = (vertex_t *) grad + GRAD_ID(i + 1, j + 1, k, blockSize);
-        const vertex_t *g3 = (vertex_t *) grad + GRAD_ID(i + 1, j, k, blockSize);
-        const vertex_t *g4 = (vertex_t *) grad + GRAD_ID(i, j, k + 1, blockSize);
-        const vertex_t *g5 = (vertex_t *) grad + GRAD_ID(i, j + 1, k + 1, blockSize);
-        const vertex_t *g6 = (vertex_t *) grad + GRAD_ID(i + 1, j + 1, k + 1, blockSize);
-        const vertex_t *g7 = (vertex_t *) grad + GRAD_ID(i + 1, j, k + 1, blockSize);
+        const vertex_t c0 = getColor(rgb, i, j, k, blockSize);
+        const vertex_t c1 = getColor(rgb, i, j + 1, k, blockSize);
+        const vertex_t c2 = getColor(rgb, i + 1, j + 1, k, blockSize);
+        const vertex_t c3 = getColor(rgb, i + 1, j, k, blockSize);
+        const vertex_t c4 = getColor(rgb, i, j, k + 1, blockSize);
+        const vertex_t c5 = getColor(rgb, i, j + 1, k + 1, blockSize);
+        const vertex_t c6 = getColor(rgb, i + 1, j + 1, k + 1, blockSize);
+        const vertex_t c7 = getColor(rgb, i + 1, j, k + 1, blockSize);
+
+        const vertex_t grad[8] = {
+            gradient(tsdf, o0, dim), gradient(tsdf, o1, dim), gradient(tsdf, o2, dim),
+            gradient(tsdf, o3, dim), gradient(tsdf, o4, dim), gradient(tsdf, o5, dim),
+            gradient(tsdf, o6, dim), gradient(tsdf, o7, dim)};
+        const vertex_t *g0 = &grad[0];
+        const vertex_t *g1 = &grad[1];
+        const vertex_t *g2 = &grad[2];
+        const vertex_t *g3 = &grad[3];
+        const vertex_t *g4 = &grad[4];
+        const vertex_t *g5 = &grad[5];
+        const vertex_t *g6 = &grad[6];
+        const vertex_t *g7 = &grad[7];
 
         vertex_t v[12];
         vertex_t c[12];
@@ -405,563 +350,34 @@ static size_t extractInnerMesh(
   return numTriangles;
 }
 
-static size_t extractXFaceMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ fTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ frgba,
-    const float *__restrict__ igrad, const float *__restrict__ fgrad, float *__restrict__ triangles,
-    float *__restrict__ colors, float *__restrict__ normals, const float voxelRes,
-    const vertex_t org, const size_t blockSize, const float isoValue)
-{
-  size_t numTriangles = 0;
-  const size_t i0 = blockSize - 1;
-  const size_t i1 = 0;
-  const vertex_t org0 = org;
-  const vertex_t org1 = {org0.x + voxelRes * blockSize, org0.y, org0.z};
-
-  for(size_t k = 0; k < blockSize - 1; k++)
-  {
-    for(size_t j = 0; j < blockSize - 1; j++)
-    {
-      const float tsdf0 = iTsdf[GRID_OFFSET(i0, j, k, blockSize)];
-      const float tsdf1 = iTsdf[GRID_OFFSET(i0, j + 1, k, blockSize)];
-      const float tsdf2 = fTsdf[GRID_OFFSET(i1, j + 1, k, blockSize)];
-      const float tsdf3 = fTsdf[GRID_OFFSET(i1, j, k, blockSize)];
-      const float tsdf4 = iTsdf[GRID_OFFSET(i0, j, k + 1, blockSize)];
-      const float tsdf5 = iTsdf[GRID_OFFSET(i0, j + 1, k + 1, blockSize)];
-      const float tsdf6 = fTsdf[GRID_OFFSET(i1, j + 1, k + 1, blockSize)];
-      const float tsdf7 = fTsdf[GRID_OFFSET(i1, j, k + 1, blockSize)];
-
-      if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-      {
-        continue;
-      }
-
-      const uint8_t cubeIndex =
-          CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-      if(cubeIndex == 0)
-      {
-        continue;
-      }
-
-      const vertex_t p0 = get3DPos(i0, j, k, org0, voxelRes);
-      const vertex_t p1 = get3DPos(i0, j + 1, k, org0, voxelRes);
-      const vertex_t p2 = get3DPos(i1, j + 1, k, org1, voxelRes);
-      const vertex_t p3 = get3DPos(i1, j, k, org1, voxelRes);
-      const vertex_t p4 = get3DPos(i0, j, k + 1, org0, voxelRes);
-      const vertex_t p5 = get3DPos(i0, j + 1, k + 1, org0, voxelRes);
-      const vertex_t p6 = get3DPos(i1, j + 1, k + 1, org1, voxelRes);
-      const vertex_t p7 = get3DPos(i1, j, k + 1, org1, voxelRes);
-
-      const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(i0, j, k, blockSize);
-      const vertex_t *c1 = (vertex_t *) irgba + COLOR_ID(i0, j + 1, k, blockSize);
-      const vertex_t *c2 = (vertex_t *) frgba + COLOR_ID(i1, j + 1, k, blockSize);
-      const vertex_t *c3 = (vertex_t *) frgba + COLOR_ID(i1, j, k, blockSize);
-      const vertex_t *c4 = (vertex_t *) irgba + COLOR_ID(i0, j, k + 1, blockSize);
-      const vertex_t *c5 = (vertex_t *) irgba + COLOR_ID(i0, j + 1, k + 1, blockSize);
-      const vertex_t *c6 = (vertex_t *) frgba + COLOR_ID(i1, j + 1, k + 1, blockSize);
-      const vertex_t *c7 = (vertex_t *) frgba + COLOR_ID(i1, j, k + 1, blockSize);
-
-      const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(i0, j, k, blockSize);
-      const vertex_t *g1 = (vertex_t *) igrad + GRAD_ID(i0, j + 1, k, blockSize);
-      const vertex_t *g2 = (vertex_t *) fgrad + GRAD_ID(i1, j + 1, k, blockSize);
-      const vertex_t *g3 = (vertex_t *) fgrad + GRAD_ID(i1, j, k, blockSize);
-      const vertex_t *g4 = (vertex_t *) igrad + GRAD_ID(i0, j, k + 1, blockSize);
-      const vertex_t *g5 = (vertex_t *) igrad + GRAD_ID(i0, j + 1, k + 1, blockSize);
-      const vertex_t *g6 = (vertex_t *) fgrad + GRAD_ID(i1, j + 1, k + 1, blockSize);
-      const vertex_t *g7 = (vertex_t *) fgrad + GRAD_ID(i1, j, k + 1, blockSize);
-
-      vertex_t v[12];
-      vertex_t c[12];
-      vertex_t g[12];
-
-      INTERPOLATE_POINTS(v, c, g);
-      EXPORT_TRIANGLES(v, c, g);
-    }
-  }
-  return numTriangles;
-}
-
-static size_t extractYFaceMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ fTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ frgba,
-    const float *__restrict__ igrad, const float *__restrict__ fgrad, float *__restrict__ triangles,
-    float *__restrict__ colors, float *__restrict__ normals, const float voxelRes,
-    const vertex_t org, const size_t blockSize, const float isoValue)
-{
-  size_t numTriangles = 0;
-  const size_t j0 = blockSize - 1;
-  const size_t j1 = 0;
-  const vertex_t org0 = org;
-  const vertex_t org1 = {org0.x, org0.y + voxelRes * blockSize, org0.z};
-
-  for(size_t k = 0; k < blockSize - 1; k++)
-  {
-    for(size_t i = 0; i < blockSize - 1; i++)
-    {
-      const float tsdf0 = iTsdf[GRID_OFFSET(i, j0, k, blockSize)];
-      const float tsdf1 = fTsdf[GRID_OFFSET(i, j1, k, blockSize)];
-      const float tsdf2 = fTsdf[GRID_OFFSET(i + 1, j1, k, blockSize)];
-      const float tsdf3 = iTsdf[GRID_OFFSET(i + 1, j0, k, blockSize)];
-      const float tsdf4 = iTsdf[GRID_OFFSET(i, j0, k + 1, blockSize)];
-      const float tsdf5 = fTsdf[GRID_OFFSET(i, j1, k + 1, blockSize)];
-      const float tsdf6 = fTsdf[GRID_OFFSET(i + 1, j1, k + 1, blockSize)];
-      const float tsdf7 = iTsdf[GRID_OFFSET(i + 1, j0, k + 1, blockSize)];
-
-      if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-      {
-        continue;
-      }
-
-      const uint8_t cubeIndex =
-          CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-      if(cubeIndex == 0)
-      {
-        continue;
-      }
-
-      const vertex_t p0 = get3DPos(i, j0, k, org0, voxelRes);
-      const vertex_t p1 = get3DPos(i, j1, k, org1, voxelRes);
-      const vertex_t p2 = get3DPos(i + 1, j1, k, org1, voxelRes);
-      const vertex_t p3 = get3DPos(i + 1, j0, k, org0, voxelRes);
-      const vertex_t p4 = get3DPos(i, j0, k + 1, org0, voxelRes);
-      const vertex_t p5 = get3DPos(i, j1, k + 1, org1, voxelRes);
-      const vertex_t p6 = get3DPos(i + 1, j1, k + 1, org1, voxelRes);
-      const vertex_t p7 = get3DPos(i + 1, j0, k + 1, org0, voxelRes);
-
-      const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(i, j0, k, blockSize);
-      const vertex_t *c1 = (vertex_t *) frgba + COLOR_ID(i, j1, k, blockSize);
-      const vertex_t *c2 = (vertex_t *) frgba + COLOR_ID(i + 1, j1, k, blockSize);
-      const vertex_t *c3 = (vertex_t *) irgba + COLOR_ID(i + 1, j0, k, blockSize);
-      const vertex_t *c4 = (vertex_t *) irgba + COLOR_ID(i, j0, k + 1, blockSize);
-      const vertex_t *c5 = (vertex_t *) frgba + COLOR_ID(i, j1, k + 1, blockSize);
-      const vertex_t *c6 = (vertex_t *) frgba + COLOR_ID(i + 1, j1, k + 1, blockSize);
-      const vertex_t *c7 = (vertex_t *) irgba + COLOR_ID(i + 1, j0, k + 1, blockSize);
-
-      const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(i, j0, k, blockSize);
-      const vertex_t *g1 = (vertex_t *) fgrad + GRAD_ID(i, j1, k, blockSize);
-      const vertex_t *g2 = (vertex_t *) fgrad + GRAD_ID(i + 1, j1, k, blockSize);
-      const vertex_t *g3 = (vertex_t *) igrad + GRAD_ID(i + 1, j0, k, blockSize);
-      const vertex_t *g4 = (vertex_t *) igrad + GRAD_ID(i, j0, k + 1, blockSize);
-      const vertex_t *g5 = (vertex_t *) fgrad + GRAD_ID(i, j1, k + 1, blockSize);
-      const vertex_t *g6 = (vertex_t *) fgrad + GRAD_ID(i + 1, j1, k + 1, blockSize);
-      const vertex_t *g7 = (vertex_t *) igrad + GRAD_ID(i + 1, j0, k + 1, blockSize);
-
-      vertex_t v[12];
-      vertex_t c[12];
-      vertex_t g[12];
-
-      INTERPOLATE_POINTS(v, c, g);
-      EXPORT_TRIANGLES(v, c, g);
-    }
-  }
-  return numTriangles;
-}
-
-static size_t extractZFaceMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ fTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ frgba,
-    const float *__restrict__ igrad, const float *__restrict__ fgrad, float *__restrict__ triangles,
-    float *__restrict__ colors, float *__restrict__ normals, const float voxelRes,
-    const vertex_t org, const size_t blockSize, const float isoValue)
-{
-  size_t numTriangles = 0;
-  const size_t k0 = blockSize - 1;
-  const size_t k1 = 0;
-  const vertex_t org0 = org;
-  const vertex_t org1 = {org0.x, org0.y, org0.z + voxelRes * blockSize};
-
-  for(size_t j = 0; j < blockSize - 1; j++)
-  {
-    for(size_t i = 0; i < blockSize - 1; i++)
-    {
-      const float tsdf0 = iTsdf[GRID_OFFSET(i, j, k0, blockSize)];
-      const float tsdf1 = iTsdf[GRID_OFFSET(i, j + 1, k0, blockSize)];
-      const float tsdf2 = iTsdf[GRID_OFFSET(i + 1, j + 1, k0, blockSize)];
-      const float tsdf3 = iTsdf[GRID_OFFSET(i + 1, j, k0, blockSize)];
-      const float tsdf4 = fTsdf[GRID_OFFSET(i, j, k1, blockSize)];
-      const float tsdf5 = fTsdf[GRID_OFFSET(i, j + 1, k1, blockSize)];
-      const float tsdf6 = fTsdf[GRID_OFFSET(i + 1, j + 1, k1, blockSize)];
-      const float tsdf7 = fTsdf[GRID_OFFSET(i + 1, j, k1, blockSize)];
-
-      if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-      {
-        continue;
-      }
-
-      const uint8_t cubeIndex =
-          CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-      if(cubeIndex == 0)
-      {
-        continue;
-      }
-
-      const vertex_t p0 = get3DPos(i, j, k0, org0, voxelRes);
-      const vertex_t p1 = get3DPos(i, j + 1, k0, org0, voxelRes);
-      const vertex_t p2 = get3DPos(i + 1, j + 1, k0, org0, voxelRes);
-      const vertex_t p3 = get3DPos(i + 1, j, k0, org0, voxelRes);
-      const vertex_t p4 = get3DPos(i, j, k1, org1, voxelRes);
-      const vertex_t p5 = get3DPos(i, j + 1, k1, org1, voxelRes);
-      const vertex_t p6 = get3DPos(i + 1, j + 1, k1, org1, voxelRes);
-      const vertex_t p7 = get3DPos(i + 1, j, k1, org1, voxelRes);
-
-      const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(i, j, k0, blockSize);
-      const vertex_t *c1 = (vertex_t *) irgba + COLOR_ID(i, j + 1, k0, blockSize);
-      const vertex_t *c2 = (vertex_t *) irgba + COLOR_ID(i + 1, j + 1, k0, blockSize);
-      const vertex_t *c3 = (vertex_t *) irgba + COLOR_ID(i + 1, j, k0, blockSize);
-      const vertex_t *c4 = (vertex_t *) frgba + COLOR_ID(i, j, k1, blockSize);
-      const vertex_t *c5 = (vertex_t *) frgba + COLOR_ID(i, j + 1, k1, blockSize);
-      const vertex_t *c6 = (vertex_t *) frgba + COLOR_ID(i + 1, j + 1, k1, blockSize);
-      const vertex_t *c7 = (vertex_t *) frgba + COLOR_ID(i + 1, j, k1, blockSize);
-
-      const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(i, j, k0, blockSize);
-      const vertex_t *g1 = (vertex_t *) igrad + GRAD_ID(i, j + 1, k0, blockSize);
-      const vertex_t *g2 = (vertex_t *) igrad + GRAD_ID(i + 1, j + 1, k0, blockSize);
-      const vertex_t *g3 = (vertex_t *) igrad + GRAD_ID(i + 1, j, k0, blockSize);
-      const vertex_t *g4 = (vertex_t *) fgrad + GRAD_ID(i, j, k1, blockSize);
-      const vertex_t *g5 = (vertex_t *) fgrad + GRAD_ID(i, j + 1, k1, blockSize);
-      const vertex_t *g6 = (vertex_t *) fgrad + GRAD_ID(i + 1, j + 1, k1, blockSize);
-      const vertex_t *g7 = (vertex_t *) fgrad + GRAD_ID(i + 1, j, k1, blockSize);
-
-      vertex_t v[12];
-      vertex_t c[12];
-      vertex_t g[12];
-
-      INTERPOLATE_POINTS(v, c, g);
-      EXPORT_TRIANGLES(v, c, g);
-    }
-  }
-  return numTriangles;
-}
-
-static size_t extractXYEdgeMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ xTsdf,
-    const float *__restrict__ yTsdf, const float *__restrict__ xyTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ xrgba,
-    const float *__restrict__ yrgba, const float *__restrict__ xyrgba,
-    const float *__restrict__ igrad, const float *__restrict__ xgrad,
-    const float *__restrict__ ygrad, const float *__restrict__ xygrad, float *triangles,
-    float *colors, float *normals, const float voxelRes, const vertex_t org, const size_t blockSize,
-    const float isoValue)
-{
-  size_t numTriangles = 0;
-
-  const vertex_t orgi = org;
-  const vertex_t orgx = {orgi.x + voxelRes * blockSize, orgi.y, orgi.z};
-  const vertex_t orgy = {orgi.x, orgi.y + voxelRes * blockSize, orgi.z};
-  const vertex_t orgxy = {orgi.x + voxelRes * blockSize, orgi.y + voxelRes * blockSize, orgi.z};
-
-  for(size_t k = 0; k < blockSize - 1; k++)
-  {
-    const float tsdf0 = iTsdf[GRID_OFFSET(blockSize - 1, blockSize - 1, k, blockSize)];
-    const float tsdf1 = yTsdf[GRID_OFFSET(blockSize - 1, 0, k, blockSize)];
-    const float tsdf2 = xyTsdf[GRID_OFFSET(0, 0, k, blockSize)];
-    const float tsdf3 = xTsdf[GRID_OFFSET(0, blockSize - 1, k, blockSize)];
-    const float tsdf4 = iTsdf[GRID_OFFSET(blockSize - 1, blockSize - 1, k + 1, blockSize)];
-    const float tsdf5 = yTsdf[GRID_OFFSET(blockSize - 1, 0, k + 1, blockSize)];
-    const float tsdf6 = xyTsdf[GRID_OFFSET(0, 0, k + 1, blockSize)];
-    const float tsdf7 = xTsdf[GRID_OFFSET(0, blockSize - 1, k + 1, blockSize)];
-
-    if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-    {
-      continue;
-    }
-
-    const uint8_t cubeIndex =
-        CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-    if(cubeIndex == 0)
-    {
-      continue;
-    }
-
-    const vertex_t p0 = get3DPos(blockSize - 1, blockSize - 1, k, orgi, voxelRes);
-    const vertex_t p1 = get3DPos(blockSize - 1, 0, k, orgy, voxelRes);
-    const vertex_t p2 = get3DPos(0, 0, k, orgxy, voxelRes);
-    const vertex_t p3 = get3DPos(0, blockSize - 1, k, orgx, voxelRes);
-    const vertex_t p4 = get3DPos(blockSize - 1, blockSize - 1, k + 1, orgi, voxelRes);
-    const vertex_t p5 = get3DPos(blockSize - 1, 0, k + 1, orgy, voxelRes);
-    const vertex_t p6 = get3DPos(0, 0, k + 1, orgxy, voxelRes);
-    const vertex_t p7 = get3DPos(0, blockSize - 1, k + 1, orgx, voxelRes);
-
-    const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(blockSize - 1, blockSize - 1, k, blockSize);
-    const vertex_t *c1 = (vertex_t *) yrgba + COLOR_ID(blockSize - 1, 0, k, blockSize);
-    const vertex_t *c2 = (vertex_t *) xyrgba + COLOR_ID(0, 0, k, blockSize);
-    const vertex_t *c3 = (vertex_t *) xrgba + COLOR_ID(0, blockSize - 1, k, blockSize);
-    const vertex_t *c4 =
-        (vertex_t *) irgba + COLOR_ID(blockSize - 1, blockSize - 1, k + 1, blockSize);
-    const vertex_t *c5 = (vertex_t *) yrgba + COLOR_ID(blockSize - 1, 0, k + 1, blockSize);
-    const vertex_t *c6 = (vertex_t *) xyrgba + COLOR_ID(0, 0, k + 1, blockSize);
-    const vertex_t *c7 = (vertex_t *) xrgba + COLOR_ID(0, blockSize - 1, k + 1, blockSize);
-
-    const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(blockSize - 1, blockSize - 1, k, blockSize);
-    const vertex_t *g1 = (vertex_t *) ygrad + GRAD_ID(blockSize - 1, 0, k, blockSize);
-    const vertex_t *g2 = (vertex_t *) xygrad + GRAD_ID(0, 0, k, blockSize);
-    const vertex_t *g3 = (vertex_t *) xgrad + GRAD_ID(0, blockSize - 1, k, blockSize);
-    const vertex_t *g4 =
-        (vertex_t *) igrad + GRAD_ID(blockSize - 1, blockSize - 1, k + 1, blockSize);
-    const vertex_t *g5 = (vertex_t *) ygrad + GRAD_ID(blockSize - 1, 0, k + 1, blockSize);
-    const vertex_t *g6 = (vertex_t *) xygrad + GRAD_ID(0, 0, k + 1, blockSize);
-    const vertex_t *g7 = (vertex_t *) xgrad + GRAD_ID(0, blockSize - 1, k + 1, blockSize);
-
-    vertex_t v[12];
-    vertex_t c[12];
-    vertex_t g[12];
-
-    INTERPOLATE_POINTS(v, c, g);
-    EXPORT_TRIANGLES(v, c, g);
-  }
-  return numTriangles;
-}
-
-static size_t extractXZEdgeMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ xTsdf,
-    const float *__restrict__ zTsdf, const float *__restrict__ xzTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ xrgba,
-    const float *__restrict__ zrgba, const float *__restrict__ xzrgba,
-    const float *__restrict__ igrad, const float *__restrict__ xgrad,
-    const float *__restrict__ zgrad, const float *__restrict__ xzgrad, float *triangles,
-    float *__restrict__ colors, float *__restrict__ normals, const float voxelRes,
-    const vertex_t org, const size_t blockSize, const float isoValue)
+namespace spf
 {
-  size_t numTriangles = 0;
-
-  const vertex_t orgi = org;
-  const vertex_t orgx = {orgi.x + voxelRes * blockSize, orgi.y, orgi.z};
-  const vertex_t orgz = {orgi.x, orgi.y, orgi.z + voxelRes * blockSize};
-  const vertex_t orgxz = {orgi.x + voxelRes * blockSize, orgi.y, orgi.z + voxelRes * blockSize};
-
-  for(size_t j = 0; j < blockSize - 1; j++)
-  {
-    const float tsdf0 = iTsdf[GRID_OFFSET(blockSize - 1, j, blockSize - 1, blockSize)];
-    const float tsdf1 = iTsdf[GRID_OFFSET(blockSize - 1, j + 1, blockSize - 1, blockSize)];
-    const float tsdf2 = xTsdf[GRID_OFFSET(0, j + 1, blockSize - 1, blockSize)];
-    const float tsdf3 = xTsdf[GRID_OFFSET(0, j, blockSize - 1, blockSize)];
-    const float tsdf4 = zTsdf[GRID_OFFSET(blockSize - 1, j, 0, blockSize)];
-    const float tsdf5 = zTsdf[GRID_OFFSET(blockSize - 1, j + 1, 0, blockSize)];
-    const float tsdf6 = xzTsdf[GRID_OFFSET(0, j + 1, 0, blockSize)];
-    const float tsdf7 = xzTsdf[GRID_OFFSET(0, j, 0, blockSize)];
-
-    if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-    {
-      continue;
-    }
-
-    const uint8_t cubeIndex =
-        CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-    if(cubeIndex == 0)
-    {
-      continue;
-    }
-
-    const vertex_t p0 = get3DPos(blockSize - 1, j, blockSize - 1, orgi, voxelRes);
-    const vertex_t p1 = get3DPos(blockSize - 1, j + 1, blockSize - 1, orgi, voxelRes);
-    const vertex_t p2 = get3DPos(0, j + 1, blockSize - 1, orgx, voxelRes);
-    const vertex_t p3 = get3DPos(0, j, blockSize - 1, orgx, voxelRes);
-    const vertex_t p4 = get3DPos(blockSize - 1, j, 0, orgz, voxelRes);
-    const vertex_t p5 = get3DPos(blockSize - 1, j + 1, 0, orgz, voxelRes);
-    const vertex_t p6 = get3DPos(0, j + 1, 0, orgxz, voxelRes);
-    const vertex_t p7 = get3DPos(0, j, 0, orgxz, voxelRes);
-
-    const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(blockSize - 1, j, blockSize - 1, blockSize);
-    const vertex_t *c1 =
-        (vertex_t *) irgba + COLOR_ID(blockSize - 1, j + 1, blockSize - 1, blockSize);
-    const vertex_t *c2 = (vertex_t *) xrgba + COLOR_ID(0, j + 1, blockSize - 1, blockSize);
-    const vertex_t *c3 = (vertex_t *) xrgba + COLOR_ID(0, j, blockSize - 1, blockSize);
-    const vertex_t *c4 = (vertex_t *) zrgba + COLOR_ID(blockSize - 1, j, 0, blockSize);
-    const vertex_t *c5 = (vertex_t *) zrgba + COLOR_ID(blockSize - 1, j + 1, 0, blockSize);
-    const vertex_t *c6 = (vertex_t *) xzrgba + COLOR_ID(0, j + 1, 0, blockSize);
-    const vertex_t *c7 = (vertex_t *) xzrgba + COLOR_ID(0, j, 0, blockSize);
-
-    const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(blockSize - 1, j, blockSize - 1, blockSize);
-    const vertex_t *g1 =
-        (vertex_t *) igrad + GRAD_ID(blockSize - 1, j + 1, blockSize - 1, blockSize);
-    const vertex_t *g2 = (vertex_t *) xgrad + GRAD_ID(0, j + 1, blockSize - 1, blockSize);
-    const vertex_t *g3 = (vertex_t *) xgrad + GRAD_ID(0, j, blockSize - 1, blockSize);
-    const vertex_t *g4 = (vertex_t *) zgrad + GRAD_ID(blockSize - 1, j, 0, blockSize);
-    const vertex_t *g5 = (vertex_t *) zgrad + GRAD_ID(blockSize - 1, j + 1, 0, blockSize);
-    const vertex_t *g6 = (vertex_t *) xzgrad + GRAD_ID(0, j + 1, 0, blockSize);
-    const vertex_t *g7 = (vertex_t *) xzgrad + GRAD_ID(0, j, 0, blockSize);
-
-    vertex_t v[12];
-    vertex_t c[12];
-    vertex_t g[12];
-
-    INTERPOLATE_POINTS(v, c, g);
-    EXPORT_TRIANGLES(v, c, g);
-  }
-  return numTriangles;
-}
-
-static size_t extractYZEdgeMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ yTsdf,
-    const float *__restrict__ zTsdf, const float *__restrict__ yzTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ yrgba,
-    const float *__restrict__ zrgba, const float *__restrict__ yzrgba,
-    const float *__restrict__ igrad, const float *__restrict__ ygrad,
-    const float *__restrict__ zgrad, const float *__restrict__ yzgrad,
-    float *__restrict__ triangles, float *__restrict__ colors, float *__restrict__ normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue)
+namespace mc
 {
-  size_t numTriangles = 0;
-
-  const vertex_t orgi = org;
-  const vertex_t orgy = {orgi.x, orgi.y + voxelRes * blockSize, orgi.z};
-  const vertex_t orgz = {orgi.x, orgi.y, orgi.z + voxelRes * blockSize};
-  const vertex_t orgyz = {orgi.x, orgi.y + voxelRes * blockSize, orgi.z + voxelRes * blockSize};
-
-  for(size_t i = 0; i < blockSize - 1; i++)
-  {
-    const float tsdf0 = iTsdf[GRID_OFFSET(i, blockSize - 1, blockSize - 1, blockSize)];
-    const float tsdf1 = yTsdf[GRID_OFFSET(i, 0, blockSize - 1, blockSize)];
-    const float tsdf2 = yTsdf[GRID_OFFSET(i + 1, 0, blockSize - 1, blockSize)];
-    const float tsdf3 = iTsdf[GRID_OFFSET(i + 1, blockSize - 1, blockSize - 1, blockSize)];
-    const float tsdf4 = zTsdf[GRID_OFFSET(i, blockSize - 1, 0, blockSize)];
-    const float tsdf5 = yzTsdf[GRID_OFFSET(i, 0, 0, blockSize)];
-    const float tsdf6 = yzTsdf[GRID_OFFSET(i + 1, 0, 0, blockSize)];
-    const float tsdf7 = zTsdf[GRID_OFFSET(i + 1, blockSize - 1, 0, blockSize)];
-
-    if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
-    {
-      continue;
-    }
-
-    const uint8_t cubeIndex =
-        CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-    if(cubeIndex == 0)
-    {
-      continue;
-    }
-
-    const vertex_t p0 = get3DPos(i, blockSize - 1, blockSize - 1, orgi, voxelRes);
-    const vertex_t p1 = get3DPos(i, 0, blockSize - 1, orgy, voxelRes);
-    const vertex_t p2 = get3DPos(i + 1, 0, blockSize - 1, orgy, voxelRes);
-    const vertex_t p3 = get3DPos(i + 1, blockSize - 1, blockSize - 1, orgi, voxelRes);
-    const vertex_t p4 = get3DPos(i, blockSize - 1, 0, orgz, voxelRes);
-    const vertex_t p5 = get3DPos(i, 0, 0, orgyz, voxelRes);
-    const vertex_t p6 = get3DPos(i + 1, 0, 0, orgyz, voxelRes);
-    const vertex_t p7 = get3DPos(i + 1, blockSize - 1, 0, orgz, voxelRes);
-
-    const vertex_t *c0 = (vertex_t *) irgba + COLOR_ID(i, blockSize - 1, blockSize - 1, blockSize);
-    const vertex_t *c1 = (vertex_t *) yrgba + COLOR_ID(i, 0, blockSize - 1, blockSize);
-    const vertex_t *c2 = (vertex_t *) yrgba + COLOR_ID(i + 1, 0, blockSize - 1, blockSize);
-    const vertex_t *c3 =
-        (vertex_t *) irgba + COLOR_ID(i + 1, blockSize - 1, blockSize - 1, blockSize);
-    const vertex_t *c4 = (vertex_t *) zrgba + COLOR_ID(i, blockSize - 1, 0, blockSize);
-    const vertex_t *c5 = (vertex_t *) yzrgba + COLOR_ID(i, 0, 0, blockSize);
-    const vertex_t *c6 = (vertex_t *) yzrgba + COLOR_ID(i + 1, 0, 0, blockSize);
-    const vertex_t *c7 = (vertex_t *) zrgba + COLOR_ID(i + 1, blockSize - 1, 0, blockSize);
-
-    const vertex_t *g0 = (vertex_t *) igrad + GRAD_ID(i, blockSize - 1, blockSize - 1, blockSize);
-    const vertex_t *g1 = (vertex_t *) ygrad + GRAD_ID(i, 0, blockSize - 1, blockSize);
-    const vertex_t *g2 = (vertex_t *) ygrad + GRAD_ID(i + 1, 0, blockSize - 1, blockSize);
-    const vertex_t *g3 =
-        (vertex_t *) igrad + GRAD_ID(i + 1, blockSize - 1, blockSize - 1, blockSize);
-    const vertex_t *g4 = (vertex_t *) zgrad + GRAD_ID(i, blockSize - 1, 0, blockSize);
-    const vertex_t *g5 = (vertex_t *) yzgrad + GRAD_ID(i, 0, 0, blockSize);
-    const vertex_t *g6 = (vertex_t *) yzgrad + GRAD_ID(i + 1, 0, 0, blockSize);
-    const vertex_t *g7 = (vertex_t *) zgrad + GRAD_ID(i + 1, blockSize - 1, 0, blockSize);
-
-    vertex_t v[12];
-    vertex_t c[12];
-    vertex_t g[12];
-
-    INTERPOLATE_POINTS(v, c, g);
-    EXPORT_TRIANGLES(v, c, g);
-  }
-  return numTriangles;
-}
-
-static size_t extractXYZCornerMesh(
-    const float *__restrict__ iTsdf, const float *__restrict__ xTsdf,
-    const float *__restrict__ yTsdf, const float *__restrict__ zTsdf,
-    const float *__restrict__ xyTsdf, const float *__restrict__ xzTsdf,
-    const float *__restrict__ yzTsdf, const float *__restrict__ xyzTsdf,
-    const float *__restrict__ irgba, const float *__restrict__ xrgba,
-    const float *__restrict__ yrgba, const float *__restrict__ zrgba,
-    const float *__restrict__ xyrgba, const float *__restrict__ xzrgba,
-    const float *__restrict__ yzrgba, const float *__restrict__ xyzrgba,
-    const float *__restrict__ igrad, const float *__restrict__ xgrad,
-    const float *__restrict__ ygrad, const float *__restrict__ zgrad,
-    const float *__restrict__ xygrad, const float *__restrict__ xzgrad,
-    const float *__restrict__ yzgrad, const float *__restrict__ xyzgrad,
-    float *__restrict__ triangles, float *__restrict__ colors, float *__restrict__ normals,
-    const float voxelRes, const vertex_t org, const size_t blockSize, const float isoValue)
-
+template <size_t BlockSize, typename ColorType>
+size_t extractMesh(
+    const float *tsdf, const ColorType *const *rgb, float *triangles, float *colors, float *normals,
+    const float voxelRes, const float *blockPos)
 {
-  size_t numTriangles = 0;
+  const vertex_t org = {blockPos[0], blockPos[1], blockPos[2]};
 
-  const vertex_t orgi = org;
-  const vertex_t orgx = {orgi.x + voxelRes * blockSize, orgi.y, orgi.z};
-  const vertex_t orgy = {orgi.x, orgi.y + voxelRes * blockSize, orgi.z};
-  const vertex_t orgz = {orgi.x, orgi.y, orgi.z + voxelRes * blockSize};
-  const vertex_t orgxy = {orgi.x + voxelRes * blockSize, orgi.y + voxelRes * blockSize, orgi.z};
-  const vertex_t orgxz = {orgi.x + voxelRes * blockSize, orgi.y, orgi.z + voxelRes * blockSize};
-  const vertex_t orgyz = {orgi.x, orgi.y + voxelRes * blockSize, orgi.z + voxelRes * blockSize};
-  const vertex_t orgxyz = {
-      orgi.x + voxelRes * blockSize, orgi.y + voxelRes * blockSize, orgi.z + voxelRes * blockSize};
-
-  const float tsdf0 = iTsdf[GRID_OFFSET(blockSize - 1, blockSize - 1, blockSize - 1, blockSize)];
-  const float tsdf1 = yTsdf[GRID_OFFSET(blockSize - 1, 0, blockSize - 1, blockSize)];
-  const float tsdf2 = xyTsdf[GRID_OFFSET(0, 0, blockSize - 1, blockSize)];
-  const float tsdf3 = xTsdf[GRID_OFFSET(0, blockSize - 1, blockSize - 1, blockSize)];
-  const float tsdf4 = zTsdf[GRID_OFFSET(blockSize - 1, blockSize - 1, 0, blockSize)];
-  const float tsdf5 = yzTsdf[GRID_OFFSET(blockSize - 1, 0, 0, blockSize)];
-  const float tsdf6 = xyzTsdf[GRID_OFFSET(0, 0, 0, blockSize)];
-  const float tsdf7 = xzTsdf[GRID_OFFSET(0, blockSize - 1, 0, blockSize)];
-
-  if(INVALID_CUBE(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7))
+  if(tsdf == NULL)
   {
     return 0;
   }
 
-  const uint8_t cubeIndex =
-      CUBE_INDEX(tsdf0, tsdf1, tsdf2, tsdf3, tsdf4, tsdf5, tsdf6, tsdf7, isoValue);
-
-  if(cubeIndex == 0)
-  {
-    return 0;
-  }
+  // Cubes touching a missing neighbour hold ISOVALUE_MAX corners and are skipped
+  return extractCubes<BlockSize>(tsdf, rgb, triangles, colors, normals, voxelRes, org, 0.0f);
+}
 
-  const vertex_t p0 = get3DPos(blockSize - 1, blockSize - 1, blockSize - 1, orgi, voxelRes);
-  const vertex_t p1 = get3DPos(blockSize - 1, 0, blockSize - 1, orgy, voxelRes);
-  const vertex_t p2 = get3DPos(0, 0, blockSize - 1, orgxy, voxelRes);
-  const vertex_t p3 = get3DPos(0, blockSize - 1, blockSize - 1, orgx, voxelRes);
-  const vertex_t p4 = get3DPos(blockSize - 1, blockSize - 1, 0, orgz, voxelRes);
-  const vertex_t p5 = get3DPos(blockSize - 1, 0, 0, orgyz, voxelRes);
-  const vertex_t p6 = get3DPos(0, 0, 0, orgxyz, voxelRes);
-  const vertex_t p7 = get3DPos(0, blockSize - 1, 0, orgxz, voxelRes);
-
-  const vertex_t *c0 =
-      (vertex_t *) irgba + COLOR_ID(blockSize - 1, blockSize - 1, blockSize - 1, blockSize);
-  const vertex_t *c1 = (vertex_t *) yrgba + COLOR_ID(blockSize - 1, 0, blockSize - 1, blockSize);
-  const vertex_t *c2 = (vertex_t *) xyrgba + COLOR_ID(0, 0, blockSize - 1, blockSize);
-  const vertex_t *c3 = (vertex_t *) xrgba + COLOR_ID(0, blockSize - 1, blockSize - 1, blockSize);
-  const vertex_t *c4 = (vertex_t *) zrgba + COLOR_ID(blockSize - 1, blockSize - 1, 0, blockSize);
-  const vertex_t *c5 = (vertex_t *) yzrgba + COLOR_ID(blockSize - 1, 0, 0, blockSize);
-  const vertex_t *c6 = (vertex_t *) xyzrgba + COLOR_ID(0, 0, 0, blockSize);
-  const vertex_t *c7 = (vertex_t *) xzrgba + COLOR_ID(0, blockSize - 1, 0, blockSize);
-
-  const vertex_t *g0 =
-      (vertex_t *) igrad + GRAD_ID(blockSize - 1, blockSize - 1, blockSize - 1, blockSize);
-  const vertex_t *g1 = (vertex_t *) ygrad + GRAD_ID(blockSize - 1, 0, blockSize - 1, blockSize);
-  const vertex_t *g2 = (vertex_t *) xygrad + GRAD_ID(0, 0, blockSize - 1, blockSize);
-  const vertex_t *g3 = (vertex_t *) xgrad + GRAD_ID(0, blockSize - 1, blockSize - 1, blockSize);
-  const vertex_t *g4 = (vertex_t *) zgrad + GRAD_ID(blockSize - 1, blockSize - 1, 0, blockSize);
-  const vertex_t *g5 = (vertex_t *) yzgrad + GRAD_ID(blockSize - 1, 0, 0, blockSize);
-  const vertex_t *g6 = (vertex_t *) xyzgrad + GRAD_ID(0, 0, 0, blockSize);
-  const vertex_t *g7 = (vertex_t *) xzgrad + GRAD_ID(0, blockSize - 1, 0, blockSize);
-
-  vertex_t v[12];
-  vertex_t c[12];
-  vertex_t g[12];
-
-  INTERPOLATE_POINTS(v, c, g);
-  EXPORT_TRIANGLES(v, c, g);
+#define INSTANTIATE_EXTRACT_MESH(BLOCK_SIZE)                                                       \
+  template size_t extractMesh<BLOCK_SIZE, float>(                                                  \
+      const float *, const float *const *, float *, float *, float *, const float, const float *); \
+  template size_t extractMesh<BLOCK_SIZE, uint8_t>(                                                \
+      const float *, const uint8_t *const *, float *, float *, float *, const float, const float *);
 
-  return numTriangles;
-}
+INSTANTIATE_EXTRACT_MESH(8)
+INSTANTIATE_EXTRACT_MESH(16)
+INSTANTIATE_EXTRACT_MESH(32)
+} // namespace mc
+} // namespace spf